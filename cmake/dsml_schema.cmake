@@ -0,0 +1,150 @@
+# Generates a header of typed handles to the variables of a configuration file,
+# so that using a variable with the wrong type fails to compile and no variable
+# is looked up by name at run time.
+#
+#   dsml_schema(<target> <config> [NAMESPACE <namespace>] [HEADER <name>])
+#
+# The header, `dsml_vars.hpp` in namespace `dsml::vars` by default, declares a
+# `dsml::Var<T>` for each variable, named after it, and for each `STRUCT`
+# variable `<NAME>` a struct `<NAME>_t` with its fields. It is put on the
+# include path of <target> and regenerated when <config> changes.
+#
+# Run with `cmake -DCONFIG=<config> -DOUTPUT=<header> -DNAMESPACE=<namespace>
+# -P dsml_schema.cmake`, this file generates the header itself.
+
+if(CMAKE_SCRIPT_MODE_FILE)
+    set(type_names INT8 INT16 INT32 INT64 UINT8 UINT16 UINT32 UINT64 FLOAT DOUBLE STRING)
+    set(cpp_types int8_t int16_t int32_t int64_t uint8_t uint16_t uint32_t uint64_t float double std::string)
+    set(type_sizes 1 2 4 8 1 2 4 8 4 8 1)
+
+    file(STRINGS "${CONFIG}" lines)
+    set(fingerprint "")
+    set(structs "")
+    set(handles "")
+    set(index 0)
+    foreach(line IN LISTS lines)
+        string(STRIP "${line}" line)
+        if(line STREQUAL "" OR line MATCHES "^#")
+            continue()
+        endif()
+
+        string(REGEX MATCHALL "[^ \t]+" fields "${line}")
+        list(LENGTH fields count)
+        if(count LESS 4)
+            message(FATAL_ERROR "${CONFIG}: invalid line '${line}'.")
+        endif()
+        list(GET fields 0 var)
+        list(GET fields 1 type)
+        list(GET fields 2 owner)
+        list(GET fields 3 is_array)
+
+        if(NOT var MATCHES "^[A-Za-z_][A-Za-z0-9_]*$")
+            message(FATAL_ERROR "${CONFIG}: variable '${var}' is not a valid C++ name.")
+        endif()
+        if(type MATCHES "^STRUCT{(.+)}$")
+            # Declare the fields in order, which lays them out as the library
+            # does, and check the size that this gives.
+            string(REPLACE "," ";" struct_fields "${CMAKE_MATCH_1}")
+            set(members "")
+            set(size 0)
+            set(alignment 1)
+            foreach(field IN LISTS struct_fields)
+                if(NOT field MATCHES "^([A-Za-z_][A-Za-z0-9_]*):([A-Z0-9]+)(\\[([1-9][0-9]*)\\])?$")
+                    message(FATAL_ERROR "${CONFIG}: variable '${var}' has invalid struct field '${field}'.")
+                endif()
+                set(field_name "${CMAKE_MATCH_1}")
+                set(field_count 1)
+                set(field_extent "")
+                if(CMAKE_MATCH_4)
+                    set(field_count "${CMAKE_MATCH_4}")
+                    set(field_extent "[${CMAKE_MATCH_4}]")
+                endif()
+                list(FIND type_names "${CMAKE_MATCH_2}" field_index)
+                if(field_index LESS 0 OR CMAKE_MATCH_2 STREQUAL "STRING")
+                    message(FATAL_ERROR "${CONFIG}: variable '${var}' has invalid struct field '${field}'.")
+                endif()
+                list(GET cpp_types ${field_index} field_type)
+                list(GET type_sizes ${field_index} field_size)
+                math(EXPR size "(${size} + ${field_size} - 1) / ${field_size} * ${field_size} + ${field_size} * ${field_count}")
+                if(field_size GREATER alignment)
+                    set(alignment ${field_size})
+                endif()
+                string(APPEND members "        ${field_type} ${field_name}${field_extent};\n")
+            endforeach()
+            math(EXPR size "(${size} + ${alignment} - 1) / ${alignment} * ${alignment}")
+            set(cpp_type "${var}_t")
+            string(APPEND structs "    /**\n     * Fields of `${var}`.\n     */\n    struct ${cpp_type}\n    {\n${members}    };\n    static_assert(sizeof(${cpp_type}) == ${size});\n\n")
+        elseif(type MATCHES "^TENSOR{([A-Z0-9]+)}$")
+            list(FIND type_names "${CMAKE_MATCH_1}" element_index)
+            if(element_index LESS 0 OR CMAKE_MATCH_1 STREQUAL "STRING")
+                message(FATAL_ERROR "${CONFIG}: variable '${var}' has invalid type '${type}'.")
+            endif()
+            list(GET cpp_types ${element_index} element_type)
+            set(cpp_type "dsml::Tensor<${element_type}>")
+        else()
+            list(FIND type_names "${type}" type_index)
+            if(type_index LESS 0)
+                message(FATAL_ERROR "${CONFIG}: variable '${var}' has invalid type '${type}'.")
+            endif()
+            list(GET cpp_types ${type_index} cpp_type)
+        endif()
+        if(is_array STREQUAL "true")
+            set(cpp_type "std::vector<${cpp_type}>")
+        elseif(NOT is_array STREQUAL "false")
+            message(FATAL_ERROR "${CONFIG}: variable '${var}' has invalid array specification '${is_array}'.")
+        endif()
+
+        string(APPEND fingerprint "        \"${var} ${type} ${owner} ${is_array}\\n\"\n")
+        string(APPEND handles "    inline constexpr dsml::Var<${cpp_type}> ${var}{${index}, SCHEMA, \"${var}\", \"${owner}\"};\n")
+        math(EXPR index "${index} + 1")
+    endforeach()
+
+    get_filename_component(config_name "${CONFIG}" NAME)
+    file(WRITE "${OUTPUT}.tmp"
+"// Generated from ${config_name} by dsml_schema.cmake. Do not edit.
+#pragma once
+
+#include <dsml.hpp>
+
+namespace ${NAMESPACE}
+{
+    /**
+     * Fingerprint of the variables, which a `dsml::State` checks the handles
+     * against.
+     */
+    inline constexpr uint64_t SCHEMA = dsml::schema_fingerprint(
+${fingerprint}        \"\");
+
+${structs}${handles}}
+")
+    # Leave the header alone if nothing changed, so that nothing is rebuilt.
+    execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different "${OUTPUT}.tmp" "${OUTPUT}")
+    file(REMOVE "${OUTPUT}.tmp")
+    return()
+endif()
+
+set(DSML_SCHEMA_SCRIPT "${CMAKE_CURRENT_LIST_FILE}" CACHE INTERNAL "Script that generates schema headers.")
+
+function(dsml_schema target config)
+    cmake_parse_arguments(ARG "" "NAMESPACE;HEADER" "" ${ARGN})
+    if(NOT ARG_NAMESPACE)
+        set(ARG_NAMESPACE dsml::vars)
+    endif()
+    if(NOT ARG_HEADER)
+        set(ARG_HEADER dsml_vars.hpp)
+    endif()
+
+    get_filename_component(config "${config}" ABSOLUTE)
+    set(dir "${CMAKE_CURRENT_BINARY_DIR}/dsml_schema/${target}")
+    set(output "${dir}/${ARG_HEADER}")
+
+    add_custom_command(
+        OUTPUT "${output}"
+        COMMAND ${CMAKE_COMMAND} -E make_directory "${dir}"
+        COMMAND ${CMAKE_COMMAND} -DCONFIG=${config} -DOUTPUT=${output} -DNAMESPACE=${ARG_NAMESPACE} -P "${DSML_SCHEMA_SCRIPT}"
+        DEPENDS "${config}" "${DSML_SCHEMA_SCRIPT}"
+        COMMENT "Generating ${ARG_HEADER} from ${config}"
+        VERBATIM)
+    target_sources(${target} PRIVATE "${output}")
+    target_include_directories(${target} PRIVATE "${dir}")
+endfunction()
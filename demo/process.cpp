@@ -5,15 +5,15 @@
 #include "tag36h11.h"
 
 #include <dsml.hpp>
+#include <dsml_vars.hpp>
 
 int main(int argc, char *argv[])
 {
     dsml::State dsml("../demo/config.tsv", "DN", 1112);
 
-    dsml.set("DET_POINT_1", std::vector<double>{-1, -1});
-    dsml.set("DET_POINT_2", std::vector<double>{-1, -1});
-    dsml.set("DET_POINT_3", std::vector<double>{-1, -1});
-    dsml.set("DET_POINT_4", std::vector<double>{-1, -1});
+    // The corners of the tag, or -1 if none was detected.
+    const dsml::vars::DET_POINTS_t none = {{-1, -1, -1, -1}, {-1, -1, -1, -1}};
+    dsml.set(dsml::vars::DET_POINTS, none);
 
     std::cout << "Press any key to start the demo...\n";
     std::string x;
@@ -22,44 +22,52 @@ int main(int argc, char *argv[])
     std::cout << "Starting processing unit\n";
 
     dsml.register_owner("CN", "127.0.0.1", 1111);
-    auto sent = dsml.get<uint8_t>("IMAGE_SENT");
+
+    // Only the latest frame matters if detection falls behind.
+    dsml::Subscription latest_only;
+    latest_only.conflate = true;
+    dsml.subscribe(dsml::vars::IMAGE, latest_only);
 
     apriltag_family_t *tf = tag36h11_create();
     apriltag_detector_t *td = apriltag_detector_create();
     apriltag_detector_add_family(td, tf);
 
+    // Version of the last frame processed. Waiting for a newer one, rather
+    // than for the next update, does not miss a frame that arrives while the
+    // last one is being processed.
+    uint64_t processed = 0;
     while (true)
     {
-        dsml.wait("IMAGE_SENT");
+        dsml.wait_newer_than(dsml::vars::IMAGE, processed);
 
-        auto image_data = dsml.get<std::vector<uint8_t>>("IMAGE_DATA");
-        auto rows = dsml.get<int>("IMAGE_ROWS");
-        auto cols = dsml.get<int>("IMAGE_COLS");
+        auto image = dsml.lease(dsml::vars::IMAGE);
+        processed = image.version();
 
         image_u8_t im = {
-            .width = cols,
-            .height = rows,
-            .stride = cols,
-            .buf = image_data.data(),
+            .width = (int32_t)image.shape(1),
+            .height = (int32_t)image.shape(0),
+            .stride = (int32_t)image.stride(0),
+            .buf = const_cast<uint8_t *>(image.data()),
         };
 
         zarray_t *detections = apriltag_detector_detect(td, &im);
         if (zarray_size(detections) == 0)
         {
-            dsml.set("DET_POINT_1", std::vector<double>{-1, -1});
-            dsml.set("DET_POINT_2", std::vector<double>{-1, -1});
-            dsml.set("DET_POINT_3", std::vector<double>{-1, -1});
-            dsml.set("DET_POINT_4", std::vector<double>{-1, -1});
+            dsml.set(dsml::vars::DET_POINTS, none);
             continue;
         }
 
         apriltag_detection *det;
         zarray_get(detections, 0, &det);
 
-        dsml.set("DET_POINT_1", std::vector<double>{det->p[0][0], det->p[0][1]});
-        dsml.set("DET_POINT_2", std::vector<double>{det->p[1][0], det->p[1][1]});
-        dsml.set("DET_POINT_3", std::vector<double>{det->p[2][0], det->p[2][1]});
-        dsml.set("DET_POINT_4", std::vector<double>{det->p[3][0], det->p[3][1]});
+        // All four corners go out in one update.
+        dsml::vars::DET_POINTS_t points;
+        for (int i = 0; i < 4; ++i)
+        {
+            points.x[i] = det->p[i][0];
+            points.y[i] = det->p[i][1];
+        }
+        dsml.set(dsml::vars::DET_POINTS, points);
 
         apriltag_detections_destroy(detections);
     }
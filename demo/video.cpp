@@ -4,6 +4,7 @@
 #include <opencv2/opencv.hpp>
 
 #include <dsml.hpp>
+#include <dsml_vars.hpp>
 
 int main(int argc, char *argv[])
 {
@@ -27,27 +28,26 @@ int main(int argc, char *argv[])
 
     while (true)
     {
-        cv::Mat frame, gray;
+        cv::Mat frame;
         cap >> frame;
+
+        // Convert the frame straight into the tensor, whose shape travels
+        // with it.
+        dsml::Tensor<uint8_t> image({(size_t)frame.rows, (size_t)frame.cols});
+        cv::Mat gray(frame.rows, frame.cols, CV_8UC1, image.data(), image.stride(0));
         cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
-        std::vector<uint8_t> image_data(gray.data, gray.data + gray.rows * gray.cols);
-        dsml.set("IMAGE_DATA", image_data);
-        dsml.set("IMAGE_ROWS", gray.rows);
-        dsml.set("IMAGE_COLS", gray.cols);
-        dsml.set("IMAGE_SENT", (uint8_t)1);
+        dsml.publish({{dsml::vars::IMAGE, image},
+                      {dsml::vars::IMAGE_SENT, (uint8_t)1}});
 
-        auto det0 = dsml.get<std::vector<double>>("DET_POINT_1");
-        auto det1 = dsml.get<std::vector<double>>("DET_POINT_2");
-        auto det2 = dsml.get<std::vector<double>>("DET_POINT_3");
-        auto det3 = dsml.get<std::vector<double>>("DET_POINT_4");
+        auto det = dsml.get(dsml::vars::DET_POINTS);
 
         std::cout << "DETECTED POINTS:\n"
-                  << det0[0] << " " << det0[1] << "\n"
-                  << det1[0] << " " << det1[1] << "\n"
-                  << det2[0] << " " << det2[1] << "\n"
-                  << det3[0] << " " << det3[1] << "\n";
+                  << det.x[0] << " " << det.y[0] << "\n"
+                  << det.x[1] << " " << det.y[1] << "\n"
+                  << det.x[2] << " " << det.y[2] << "\n"
+                  << det.x[3] << " " << det.y[3] << "\n";
 
-        if (det0[0] == -1)
+        if (det.x[0] == -1)
         {
             cv::imshow("Video", frame);
             if (cv::waitKey(30) >= 0)
@@ -58,17 +58,17 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        cv::line(frame, cv::Point(det0[0], det0[1]),
-                 cv::Point(det1[0], det1[1]),
+        cv::line(frame, cv::Point(det.x[0], det.y[0]),
+                 cv::Point(det.x[1], det.y[1]),
                  cv::Scalar(0, 0xff, 0), 8);
-        cv::line(frame, cv::Point(det0[0], det0[1]),
-                 cv::Point(det3[0], det3[1]),
+        cv::line(frame, cv::Point(det.x[0], det.y[0]),
+                 cv::Point(det.x[3], det.y[3]),
                  cv::Scalar(0, 0, 0xff), 8);
-        cv::line(frame, cv::Point(det1[0], det1[1]),
-                 cv::Point(det2[0], det2[1]),
+        cv::line(frame, cv::Point(det.x[1], det.y[1]),
+                 cv::Point(det.x[2], det.y[2]),
                  cv::Scalar(0xff, 0, 0), 8);
-        cv::line(frame, cv::Point(det2[0], det2[1]),
-                 cv::Point(det3[0], det3[1]),
+        cv::line(frame, cv::Point(det.x[2], det.y[2]),
+                 cv::Point(det.x[3], det.y[3]),
                  cv::Scalar(0xff, 0, 0), 8);
 
         cv::imshow("Video", frame);
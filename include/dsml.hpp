@@ -2,21 +2,546 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
+
 namespace dsml
 {
+    /**
+     * Identity type, used to keep a parameter out of template deduction.
+     */
+    template <typename T>
+    struct identity
+    {
+        using type = T;
+    };
+
+    /**
+     * Whether `T` is a `std::vector`.
+     */
+    template <typename T>
+    struct is_vector : std::false_type
+    {
+    };
+
+    template <typename T, typename A>
+    struct is_vector<std::vector<T, A>> : std::true_type
+    {
+    };
+
+    class Reactor;
+    class ShmSegment;
+    class PerfectHash;
+    class Uring;
+
+    template <typename T>
+    class Tensor;
+
+    /**
+     * Whether `T` is a `Tensor`.
+     */
+    template <typename T>
+    struct is_tensor : std::false_type
+    {
+    };
+
+    template <typename T>
+    struct is_tensor<Tensor<T>> : std::true_type
+    {
+    };
+
+    /**
+     * Alignment in bytes of the data of every variable, which suffices for
+     * any SIMD load.
+     */
+    constexpr size_t BUFFER_ALIGNMENT = 64;
+
+    /**
+     * Reference counted storage for the data of a variable. A buffer is not
+     * modified once anything other than its variable refers to it; updates
+     * publish a new buffer instead.
+     */
+    struct Buffer
+    {
+        /**
+         * Allocate a buffer. `bytes` is `nullptr` if the allocation failed.
+         *
+         * @param capacity Size of the buffer in bytes.
+         */
+        explicit Buffer(size_t capacity)
+            : bytes(aligned_alloc(BUFFER_ALIGNMENT, (capacity + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT)),
+              capacity(capacity) {}
+
+        ~Buffer()
+        {
+            free(bytes);
+        }
+
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+
+        void *bytes;
+        size_t capacity;
+    };
+
+    /**
+     * Counts of how the buffers of a variable were obtained.
+     */
+    struct BufferStats
+    {
+        uint64_t allocations; // Updates that had to allocate a new buffer.
+        uint64_t reuses;      // Updates that reused a pooled buffer instead.
+    };
+
+    /**
+     * Backlog of messages waiting to be sent to a subscriber.
+     */
+    struct QueueStats
+    {
+        std::string peer; // Address of the subscriber.
+        size_t messages;  // Messages that have not been sent completely.
+        size_t bytes;     // Bytes of those messages that have not been sent.
+        uint64_t sent;    // Bytes sent so far.
+    };
+
+    /**
+     * Counts and queue latency of the calls of a change handler.
+     */
+    struct HandlerStats
+    {
+        uint64_t calls;     // Calls made so far.
+        uint64_t coalesced; // Changes that joined a call already queued instead.
+        std::chrono::nanoseconds total_latency; // Sum over the calls of the time from queueing to the start.
+        std::chrono::nanoseconds max_latency;   // Longest time from queueing to the start of a call.
+    };
+
+    /**
+     * Options for how the owner of a variable sends its updates to a
+     * subscriber, passed to `State::subscribe`.
+     */
+    struct Subscription
+    {
+        // Replace an update that has not been sent yet with a newer one,
+        // rather than sending both. A subscriber that falls behind then only
+        // ever has the latest value waiting for it.
+        bool conflate = false;
+
+        // Send only the parts of an array or string that changed since the
+        // last update sent to this subscriber. This takes the place of shared
+        // memory on the same host.
+        bool delta = false;
+
+        // Send updates at most this often. An update that comes sooner is
+        // held back, and the latest one held back is sent once the interval
+        // has passed.
+        std::chrono::microseconds min_interval{0};
+
+        // Send only every `decimation`-th update. The latest one held back is
+        // sent if no update comes in the time that the last `decimation`
+        // updates would take.
+        unsigned decimation = 1;
+
+        // Send an update of a numeric variable only once some element of it
+        // differs from the last value sent by more than `deadband`, or by
+        // more than `relative_deadband` times the magnitude of that value.
+        double deadband = 0;
+        double relative_deadband = 0;
+    };
+
+    /**
+     * Largest number of dimensions of a tensor.
+     */
+    constexpr size_t TENSOR_MAX_RANK = 4;
+
+    /**
+     * Start of the value of a tensor variable, which is followed by its
+     * elements. Being `BUFFER_ALIGNMENT` bytes long, it leaves the elements
+     * as aligned as the buffer.
+     */
+    struct TensorHeader
+    {
+        uint8_t dtype; // Type of the elements, see `tensor_dtype`.
+        uint8_t rank;  // Number of dimensions, at most `TENSOR_MAX_RANK`.
+        uint8_t reserved[6];
+        uint64_t size; // Bytes of elements that follow the header.
+        uint32_t shape[TENSOR_MAX_RANK];
+        uint64_t strides[TENSOR_MAX_RANK]; // Bytes from one index of each dimension to the next.
+    };
+    static_assert(sizeof(TensorHeader) == BUFFER_ALIGNMENT);
+
+    /**
+     * Code of the element type `T` of a tensor, which is the position of its
+     * name in the list of types of the configuration file.
+     */
+    template <typename T>
+    constexpr uint8_t tensor_dtype()
+    {
+        if constexpr (std::is_same_v<T, int8_t>)
+            return 0;
+        else if constexpr (std::is_same_v<T, int16_t>)
+            return 1;
+        else if constexpr (std::is_same_v<T, int32_t>)
+            return 2;
+        else if constexpr (std::is_same_v<T, int64_t>)
+            return 3;
+        else if constexpr (std::is_same_v<T, uint8_t>)
+            return 4;
+        else if constexpr (std::is_same_v<T, uint16_t>)
+            return 5;
+        else if constexpr (std::is_same_v<T, uint32_t>)
+            return 6;
+        else if constexpr (std::is_same_v<T, uint64_t>)
+            return 7;
+        else if constexpr (std::is_same_v<T, float>)
+            return 8;
+        else if constexpr (std::is_same_v<T, double>)
+            return 9;
+        else
+            return UINT8_MAX;
+    }
+
+    /**
+     * Read-only view of the data of an array variable, obtained from
+     * `State::lease`. The data stays valid and unchanged while the lease is
+     * held, even if the variable is updated in the meantime.
+     *
+     * @tparam T Type of the array elements.
+     */
+    template <typename T>
+    class Lease
+    {
+    public:
+        Lease() = default;
+
+        const T *data() const
+        {
+            return buffer ? reinterpret_cast<const T *>(static_cast<const char *>(buffer->bytes) + offset) : nullptr;
+        }
+
+        size_t size() const
+        {
+            return count;
+        }
+
+        bool empty() const
+        {
+            return count == 0;
+        }
+
+        const T *begin() const
+        {
+            return data();
+        }
+
+        const T *end() const
+        {
+            return data() + count;
+        }
+
+        const T &operator[](size_t i) const
+        {
+            return data()[i];
+        }
+
+        /**
+         * Number of dimensions, which is 1 unless the variable is a tensor.
+         */
+        size_t rank() const
+        {
+            return tensor ? tensor->rank : 1;
+        }
+
+        /**
+         * Number of indices of dimension `dim`.
+         */
+        size_t shape(size_t dim) const
+        {
+            return tensor ? tensor->shape[dim] : count;
+        }
+
+        /**
+         * Bytes from one index of dimension `dim` to the next.
+         */
+        size_t stride(size_t dim) const
+        {
+            return tensor ? tensor->strides[dim] : sizeof(T);
+        }
+
+        /**
+         * Version of the leased value, see `State::get_with_version`.
+         */
+        uint64_t version() const
+        {
+            return value_version;
+        }
+
+    private:
+        friend class State;
+
+        Lease(std::shared_ptr<const Buffer> buffer, size_t count, uint64_t version)
+            : buffer(std::move(buffer)), count(count), value_version(version) {}
+
+        /**
+         * Lease of the elements of a tensor, which follow `tensor` in `buffer`.
+         */
+        Lease(std::shared_ptr<const Buffer> buffer, const TensorHeader *tensor, uint64_t version)
+            : buffer(std::move(buffer)), count(tensor->size / sizeof(T)), offset(sizeof(TensorHeader)), tensor(tensor),
+              value_version(version) {}
+
+        /**
+         * Buffer being viewed, kept alive by the lease.
+         */
+        std::shared_ptr<const Buffer> buffer;
+
+        /**
+         * Number of elements in the buffer.
+         */
+        size_t count = 0;
+
+        /**
+         * Bytes before the first element.
+         */
+        size_t offset = 0;
+
+        /**
+         * Shape of the elements, if the variable is a tensor.
+         */
+        const TensorHeader *tensor = nullptr;
+
+        uint64_t value_version = 0;
+    };
+
+    /**
+     * Multi-dimensional array of elements of type `T`, the value of a tensor
+     * variable. The elements are stored after a `TensorHeader` with their
+     * shape, and aligned to `BUFFER_ALIGNMENT` bytes. Copies of a tensor
+     * share its elements.
+     *
+     * @tparam T Type of the elements.
+     */
+    template <typename T>
+    class Tensor
+    {
+        static_assert(tensor_dtype<T>() != UINT8_MAX, "Tensor elements must be of one of the types of variables.");
+
+    public:
+        using value_type = T;
+
+        Tensor() = default;
+
+        /**
+         * Allocate a tensor with elements that are not initialized.
+         *
+         * @param shape Number of indices of each dimension, of which there
+         *              are at most `TENSOR_MAX_RANK`.
+         * @param strides Bytes from one index of each dimension to the next,
+         *                or empty for the elements to be contiguous with the
+         *                last dimension varying fastest.
+         */
+        explicit Tensor(const std::vector<size_t> &shape, const std::vector<size_t> &strides = {})
+        {
+            if (shape.size() > TENSOR_MAX_RANK || (!strides.empty() && strides.size() != shape.size()))
+            {
+                throw std::runtime_error("Invalid shape of tensor.");
+            }
+
+            TensorHeader header = {};
+            header.dtype = tensor_dtype<T>();
+            header.rank = shape.size();
+            size_t size = sizeof(T);
+            for (size_t i = shape.size(); i-- > 0;)
+            {
+                if (shape[i] > UINT32_MAX)
+                {
+                    throw std::runtime_error("Invalid shape of tensor.");
+                }
+                if (!strides.empty() && strides[i] % sizeof(T) != 0)
+                {
+                    throw std::runtime_error("Invalid strides of tensor.");
+                }
+                header.shape[i] = shape[i];
+                header.strides[i] = strides.empty() ? size : strides[i];
+                if (strides.empty())
+                {
+                    size *= shape[i];
+                }
+            }
+            for (size_t i = 0; i < strides.size() && size > 0; ++i)
+            {
+                size = shape[i] == 0 ? 0 : size + (shape[i] - 1) * strides[i];
+            }
+            header.size = size;
+
+            buffer = std::make_shared<Buffer>(sizeof(TensorHeader) + size);
+            if (!buffer->bytes)
+            {
+                throw std::bad_alloc();
+            }
+            memcpy(buffer->bytes, &header, sizeof(header));
+        }
+
+        T *data()
+        {
+            return buffer ? reinterpret_cast<T *>(static_cast<char *>(buffer->bytes) + sizeof(TensorHeader)) : nullptr;
+        }
+
+        const T *data() const
+        {
+            return buffer ? reinterpret_cast<const T *>(static_cast<const char *>(buffer->bytes) + sizeof(TensorHeader)) : nullptr;
+        }
+
+        /**
+         * Number of dimensions.
+         */
+        size_t rank() const
+        {
+            return buffer ? header()->rank : 0;
+        }
+
+        /**
+         * Number of indices of dimension `dim`.
+         */
+        size_t shape(size_t dim) const
+        {
+            return header()->shape[dim];
+        }
+
+        /**
+         * Bytes from one index of dimension `dim` to the next.
+         */
+        size_t stride(size_t dim) const
+        {
+            return header()->strides[dim];
+        }
+
+        /**
+         * Bytes spanned by the elements.
+         */
+        size_t size() const
+        {
+            return buffer ? header()->size : 0;
+        }
+
+    private:
+        friend class State;
+
+        const TensorHeader *header() const
+        {
+            return static_cast<const TensorHeader *>(buffer->bytes);
+        }
+
+        /**
+         * Header followed by the elements, or `nullptr` if there are none.
+         */
+        std::shared_ptr<Buffer> buffer;
+    };
+
+    /**
+     * Handle to a variable, obtained from `State::handle`.
+     *
+     * @tparam T Type of the variable.
+     */
+    template <typename T>
+    class VarHandle
+    {
+    public:
+        VarHandle() = default;
+
+    protected:
+        constexpr VarHandle(size_t index, uint64_t schema) : index(index), schema(schema) {}
+
+    private:
+        friend class State;
+
+        /**
+         * Index of the variable in the variable table.
+         */
+        size_t index = SIZE_MAX;
+
+        /**
+         * Fingerprint of the variables of the configuration file that `index`
+         * refers to, see `schema_fingerprint`.
+         */
+        uint64_t schema = 0;
+    };
+
+    /**
+     * Fingerprint the variables of a configuration file, given as one line of
+     * name, type, owner and whether it is an array per variable, separated by
+     * single spaces.
+     *
+     * @param text The variables.
+     * @return The fingerprint.
+     */
+    constexpr uint64_t schema_fingerprint(const char *text)
+    {
+        uint64_t h = 0xcbf29ce484222325;
+        for (; *text; ++text)
+        {
+            h = (h ^ (unsigned char)*text) * 0x100000001b3;
+        }
+        return h;
+    }
+
+    /**
+     * Handle to a variable known at compile time, as generated from a
+     * configuration file by `dsml_schema` in `cmake/dsml_schema.cmake`. It is
+     * used like a `VarHandle`, without looking the variable up first, and
+     * only with a `State` of the same variables.
+     *
+     * @tparam T Type of the variable.
+     */
+    template <typename T>
+    class Var : public VarHandle<T>
+    {
+    public:
+        using type = T;
+
+        /**
+         * @param index Position of the variable in the configuration file.
+         * @param schema Fingerprint of the configuration file.
+         * @param name Name of the variable.
+         * @param owner Name of the program that owns the variable.
+         */
+        constexpr Var(size_t index, uint64_t schema, const char *name, const char *owner)
+            : VarHandle<T>(index, schema), name(name), owner(owner) {}
+
+        const char *name;
+        const char *owner;
+    };
+
+    /**
+     * Ways in which a `State` can do its socket I/O.
+     */
+    enum IoBackend
+    {
+        IO_REACTOR, // Non-blocking system calls when epoll, or poll, says so.
+        IO_URING,   // Requests batched through io_uring, where the kernel has it.
+    };
+
     class State
     {
     public:
@@ -26,8 +551,15 @@ namespace dsml
          * @param config Path to the configuration file.
          * @param program_name Name of the program.
          * @param port Port on which to listen.
+         * @param backend How to do socket I/O. `IO_URING` falls back to
+         *                `IO_REACTOR` if the kernel does not support it.
+         * @param io_threads Number of threads that connections are spread
+         *                   across for socket I/O.
+         * @param handler_threads Number of threads that change handlers are
+         *                        called on, started with the first handler.
          */
-        State(std::string config, std::string program_name, int port = 0);
+        State(std::string config, std::string program_name, int port = 0, IoBackend backend = IO_REACTOR,
+              unsigned io_threads = 1, unsigned handler_threads = 1);
 
         /**
          * Destroy the `State` object.
@@ -53,6 +585,53 @@ namespace dsml
          */
         int register_owner(std::string variable_owner, int socket);
 
+        /**
+         * Subscribe to a variable with the given options, replacing those of
+         * an earlier subscription. Without this, `get` and friends subscribe
+         * with the default options. The owner must be registered.
+         *
+         * @param var Name of the variable.
+         * @param options How the owner should send updates.
+         */
+        void subscribe(const std::string &var, const Subscription &options)
+        {
+            subscribe_slot(find_var(var), options);
+        }
+
+        /**
+         * Subscribe to a variable with the given options, replacing those of
+         * an earlier subscription.
+         *
+         * @param var Handle of the variable.
+         * @param options How the owner should send updates.
+         */
+        template <typename T>
+        void subscribe(const VarHandle<T> &var, const Subscription &options)
+        {
+            subscribe_slot(index_of(var), options);
+        }
+
+        /**
+         * Resolve a variable to a handle.
+         *
+         * The name lookup and type check are done once here, so that `get`,
+         * `set`, `wait`, `wait_for` and `last_updated` can index straight into
+         * the variable table when given the returned handle. The owner does not
+         * need to be registered yet.
+         *
+         * @tparam T Type of the variable.
+         * @param var Name of the variable.
+         * @return Handle to the variable.
+         */
+        template <typename T>
+        VarHandle<T> handle(const std::string &var)
+        {
+            size_t index = find_var(var);
+            check_slot_type<T>(*this, index);
+
+            return VarHandle<T>(index, schema);
+        }
+
         /**
          * Get the variable stored in the state.
          *
@@ -61,7 +640,7 @@ namespace dsml
          * @return The variable.
          */
         template <typename T>
-        T get(std::string var)
+        T get(const std::string &var)
         {
             T v;
             get(var, v);
@@ -76,462 +655,2103 @@ namespace dsml
          * @param ret_value Where to store the variable.
          */
         template <typename T>
-        void get(std::string var, T &ret_value)
+        void get(const std::string &var, T &ret_value)
+        {
+            get(handle<T>(var), ret_value);
+        }
+
+        /**
+         * Get the variable stored in the state.
+         *
+         * @tparam T Type of the variable.
+         * @param var Handle of the variable.
+         * @return The variable.
+         */
+        template <typename T>
+        T get(const VarHandle<T> &var)
         {
-            std::unique_lock lk(var_locks[var]);
+            T v;
+            get(var, v);
+            return v;
+        }
 
-            check_var_type<T>(var);
+        /**
+         * Get the variable stored in the state.
+         *
+         * @tparam T Type of the variable.
+         * @param var Handle of the variable.
+         * @param ret_value Where to store the variable.
+         */
+        template <typename T>
+        void get(const VarHandle<T> &var, T &ret_value)
+        {
+            Slot &s = slot(index_of(var));
 
-            // Tell the owner that we are interested in this variable.
-            if (vars[var].owner != self && interested_vars.find(var) == interested_vars.end())
+            // Scalars that have a value are read without taking the lock.
+            if constexpr (std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(uint64_t))
             {
-                if (send_interest(vars[var].owner_socket, var) < 0)
+                if (s.var.scalar && s.var.scalar->readable.load(std::memory_order_acquire))
                 {
-                    throw std::runtime_error("Owner of '" + var + "', '" + vars[var].owner + "', is no longer connected.");
+                    uint64_t bits = s.var.scalar->bits.load(std::memory_order_acquire);
+                    memcpy(&ret_value, &bits, sizeof(T));
+                    return;
                 }
-                interested_vars.insert(var);
-                var_cvs[var].wait(lk);
             }
 
-            ret_value = *static_cast<T *>(vars[var].data);
+            std::unique_lock lk(s.lock);
+            wait_first_value(s, lk);
+            read_value(s, ret_value);
         }
 
         /**
-         * Get the variable stored in the state.
+         * Get the variable stored in the state, along with its version. The
+         * version counts the updates of the variable by its owner, and
+         * numbers the value the same in every program; it is 0 before the
+         * first update. A gap between the versions of two values read means
+         * that the updates in between were missed, for instance when they
+         * were conflated.
          *
          * @tparam T Type of the variable.
          * @param var Name of the variable.
          * @param ret_value Where to store the variable.
+         * @return Version of the value.
          */
         template <typename T>
-        void get(std::string var, std::vector<T> &ret_value)
+        uint64_t get_with_version(const std::string &var, T &ret_value)
         {
-            std::unique_lock lk(var_locks[var]);
-
-            check_var_type<std::vector<T>>(var);
+            return get_with_version(handle<T>(var), ret_value);
+        }
 
-            // Tell the owner that we are interested in this variable.
-            if (vars[var].owner != self && interested_vars.find(var) == interested_vars.end())
-            {
-                if (send_interest(vars[var].owner_socket, var) < 0)
-                {
-                    throw std::runtime_error("Owner of '" + var + "', '" + vars[var].owner + "', is no longer connected.");
-                }
-                interested_vars.insert(var);
-                var_cvs[var].wait(lk);
-            }
+        /**
+         * Get the variable stored in the state, along with its version.
+         *
+         * @tparam T Type of the variable.
+         * @param var Handle of the variable.
+         * @param ret_value Where to store the variable.
+         * @return Version of the value.
+         */
+        template <typename T>
+        uint64_t get_with_version(const VarHandle<T> &var, T &ret_value)
+        {
+            Slot &s = slot(index_of(var));
+            std::unique_lock lk(s.lock);
+            wait_first_value(s, lk);
+            read_value(s, ret_value);
 
-            ret_value = std::vector<T>(static_cast<T *>(vars[var].data),
-                                       static_cast<T *>(vars[var].data) + vars[var].size);
+            return s.var.version;
         }
 
         /**
-         * Get the variable stored in the state.
+         * Set the variable stored in the state.
+         *
+         * @tparam T Type of the variable.
+         * @param var Name of the variable.
+         * @param value New value of the variable.
+         */
+        template <typename T>
+        void set(const std::string &var, const T &value)
+        {
+            set(handle<T>(var), value);
+        }
+
+        /**
+         * Set the variable stored in the state.
+         *
+         * @tparam T Type of the variable.
+         * @param var Handle of the variable.
+         * @param value New value of the variable.
+         */
+        template <typename T>
+        void set(const VarHandle<T> &var, const typename identity<T>::type &value)
+        {
+            size_t index = index_of(var);
+            Slot &s = slot(index);
+            std::unique_lock lk(s.lock);
+
+            check_owner(s);
+
+            const void *data;
+            int data_size, count;
+            describe(value, data, data_size, count);
+
+            // Check if this program owns the variable.
+            if (!s.owned)
+            {
+                if (request_update(s, data, data_size) < 0)
+                {
+                    throw std::runtime_error("Owner of '" + s.name + "', '" + s.var.owner + "', is no longer connected.");
+                }
+                return;
+            }
+
+            store(s.var, data, data_size, count);
+            s.var.last_updated = std::chrono::system_clock::now();
+            notify_waiters(s);
+
+            lk.unlock();
+            notify_subscribers(index);
+        }
+
+        /**
+         * New value of a variable, for `publish`.
+         */
+        class Update
+        {
+        public:
+            /**
+             * @tparam T Type of the variable.
+             * @param var Name of the variable.
+             * @param value New value of the variable, which must outlive the
+             *              `Update`.
+             */
+            template <typename T>
+            Update(const std::string &var, const T &value) : var(var), check(&State::check_slot_type<T>)
+            {
+                describe(value, data, data_size, count);
+            }
+
+            /**
+             * @tparam T Type of the variable.
+             * @param var Handle of the variable.
+             * @param value New value of the variable, which must outlive the
+             *              `Update`.
+             */
+            template <typename T>
+            Update(const VarHandle<T> &var, const typename identity<T>::type &value) : index(var.index), schema(var.schema)
+            {
+                describe(value, data, data_size, count);
+            }
+
+        private:
+            friend class State;
+
+            std::string var;
+            size_t index = SIZE_MAX;
+            uint64_t schema = 0;
+            void (*check)(State &, size_t) = nullptr; // Type check, unless resolved through a handle.
+            const void *data;
+            int data_size, count;
+        };
+
+        /**
+         * Set several variables owned by this program together. All of them
+         * are stored before any waiter is woken, and each subscriber is sent
+         * the ones it is subscribed to in a single message, so that it never
+         * sees only some of them.
+         *
+         * @param updates Variables and their new values.
+         */
+        void publish(const std::vector<Update> &updates);
+
+        /**
+         * Lease the data of an array variable without copying it.
+         *
+         * @tparam T Type of the array elements.
+         * @param var Name of the variable.
+         * @return Lease of the current data.
+         */
+        template <typename T>
+        Lease<T> lease(const std::string &var)
+        {
+            if (slot(find_var(var)).var.type == TENSOR)
+            {
+                return lease(handle<Tensor<T>>(var));
+            }
+            return lease(handle<std::vector<T>>(var));
+        }
+
+        /**
+         * Lease the data of an array variable without copying it.
+         *
+         * @tparam T Type of the array elements.
+         * @param var Handle of the variable.
+         * @return Lease of the current data.
+         */
+        template <typename T>
+        Lease<T> lease(const VarHandle<std::vector<T>> &var)
+        {
+            Slot &s = slot(index_of(var));
+            std::unique_lock lk(s.lock);
+            wait_first_value(s, lk);
+
+            return Lease<T>(s.var.data, s.var.size, s.var.version);
+        }
+
+        /**
+         * Lease the elements of a tensor variable without copying them.
+         *
+         * @tparam T Type of the elements.
+         * @param var Handle of the variable.
+         * @return Lease of the current elements, with their shape.
+         */
+        template <typename T>
+        Lease<T> lease(const VarHandle<Tensor<T>> &var)
+        {
+            Slot &s = slot(index_of(var));
+            std::unique_lock lk(s.lock);
+            wait_first_value(s, lk);
+
+            if (s.var.size == 0)
+            {
+                return Lease<T>();
+            }
+            return Lease<T>(s.var.data, static_cast<const TensorHeader *>(s.var.data->bytes), s.var.version);
+        }
+
+        /**
+         * Returns how the buffers of `var` have been obtained so far.
+         */
+        BufferStats buffer_stats(const std::string &var)
+        {
+            return buffer_stats_slot(find_var(var));
+        }
+
+        /**
+         * Returns how the buffers of `var` have been obtained so far.
+         */
+        template <typename T>
+        BufferStats buffer_stats(const VarHandle<T> &var)
+        {
+            return buffer_stats_slot(index_of(var));
+        }
+
+        /**
+         * Returns the backlog of messages waiting to be sent to each
+         * subscriber.
+         */
+        std::vector<QueueStats> queue_stats();
+
+        /**
+         * Returns how socket I/O is done, which is `IO_REACTOR` if `IO_URING`
+         * was asked for but is not supported. All I/O threads use the same
+         * backend.
+         */
+        IoBackend io_backend() const
+        {
+            return io_threads[0]->uring ? IO_URING : IO_REACTOR;
+        }
+
+        /**
+         * Waits indefinitely until `var` is changed.
+         *
+         * @param var Name of the variable.
+         */
+        void wait(const std::string &var)
+        {
+            wait_slot(find_var(var));
+        }
+
+        /**
+         * Waits indefinitely until `var` is changed.
+         *
+         * @param var Handle of the variable.
+         */
+        template <typename T>
+        void wait(const VarHandle<T> &var)
+        {
+            wait_slot(index_of(var));
+        }
+
+        /**
+         * Waits for `rel_time` or until `var` is changed.
+         *
+         * @param var Name of the variable.
+         * @param rel_time Maximum duration to wait in the same style as
+         *                 `std::condition_variable::wait_for`.
+         *
+         * @return Whether the variable was changed.
+         */
+        template <class Rep, class Period>
+        bool wait_for(const std::string &var, const std::chrono::duration<Rep, Period> &rel_time)
+        {
+            return wait_for_slot(find_var(var), rel_time);
+        }
+
+        /**
+         * Waits for `rel_time` or until `var` is changed.
+         *
+         * @param var Handle of the variable.
+         * @param rel_time Maximum duration to wait in the same style as
+         *                 `std::condition_variable::wait_for`.
+         *
+         * @return Whether the variable was changed.
+         */
+        template <typename T, class Rep, class Period>
+        bool wait_for(const VarHandle<T> &var, const std::chrono::duration<Rep, Period> &rel_time)
+        {
+            return wait_for_slot(index_of(var), rel_time);
+        }
+
+        /**
+         * Waits until the version of `var` is greater than `version`, which
+         * returns at once if it already is. Unlike `wait`, this does not miss
+         * an update made since `version` was read.
+         *
+         * @param var Name of the variable.
+         * @param version Version of the value last seen, e.g. from
+         *                `get_with_version`.
+         * @return The version now.
+         */
+        uint64_t wait_newer_than(const std::string &var, uint64_t version)
+        {
+            return wait_newer_than_slot(find_var(var), version, std::chrono::steady_clock::time_point::max());
+        }
+
+        /**
+         * Waits until the version of `var` is greater than `version`.
+         *
+         * @param var Handle of the variable.
+         * @param version Version of the value last seen.
+         * @return The version now.
+         */
+        template <typename T>
+        uint64_t wait_newer_than(const VarHandle<T> &var, uint64_t version)
+        {
+            return wait_newer_than_slot(index_of(var), version, std::chrono::steady_clock::time_point::max());
+        }
+
+        /**
+         * Waits for `rel_time` or until the version of `var` is greater than
+         * `version`.
+         *
+         * @param var Name of the variable.
+         * @param version Version of the value last seen.
+         * @param rel_time Maximum duration to wait.
+         * @return The version now, which is not greater than `version` if the
+         *         time ran out.
+         */
+        template <class Rep, class Period>
+        uint64_t wait_newer_than(const std::string &var, uint64_t version, const std::chrono::duration<Rep, Period> &rel_time)
+        {
+            return wait_newer_than_slot(find_var(var), version, deadline_after(rel_time));
+        }
+
+        /**
+         * Waits for `rel_time` or until the version of `var` is greater than
+         * `version`.
+         *
+         * @param var Handle of the variable.
+         * @param version Version of the value last seen.
+         * @param rel_time Maximum duration to wait.
+         * @return The version now.
+         */
+        template <typename T, class Rep, class Period>
+        uint64_t wait_newer_than(const VarHandle<T> &var, uint64_t version, const std::chrono::duration<Rep, Period> &rel_time)
+        {
+            return wait_newer_than_slot(index_of(var), version, deadline_after(rel_time));
+        }
+
+        /**
+         * Variable given by name or by a handle of any type, for `wait_any`
+         * and `wait_all`.
+         */
+        class VarRef
+        {
+        public:
+            VarRef(const std::string &var) : var(var) {}
+            VarRef(const char *var) : var(var) {}
+
+            template <typename T>
+            VarRef(const VarHandle<T> &var) : index(var.index), schema(var.schema) {}
+
+        private:
+            friend class State;
+
+            std::string var;
+            size_t index = SIZE_MAX;
+            uint64_t schema = 0;
+        };
+
+        /**
+         * Waits for `rel_time` or until any of `vars` is changed.
+         *
+         * @param vars Names or handles of the variables.
+         * @param rel_time Maximum duration to wait.
+         * @return Positions in `vars` of the variables that changed, in
+         *         order, or none if the time ran out.
+         */
+        template <class Rep, class Period>
+        std::vector<size_t> wait_any(const std::vector<VarRef> &vars, const std::chrono::duration<Rep, Period> &rel_time)
+        {
+            return wait_slots(resolve(vars), false, deadline_after(rel_time));
+        }
+
+        /**
+         * Waits for `rel_time` or until each of `vars` has changed at least
+         * once.
+         *
+         * @param vars Names or handles of the variables.
+         * @param rel_time Maximum duration to wait.
+         * @return Whether all of the variables changed.
+         */
+        template <class Rep, class Period>
+        bool wait_all(const std::vector<VarRef> &vars, const std::chrono::duration<Rep, Period> &rel_time)
+        {
+            return wait_slots(resolve(vars), true, deadline_after(rel_time)).size() == vars.size();
+        }
+
+        /**
+         * Call `handler` on a handler thread whenever `var` is changed,
+         * replacing an earlier handler of `var`; an empty `handler` removes
+         * it. The calls for a variable never overlap, and changes that come
+         * while a call is queued share that call, so the handler should read
+         * the latest value itself. The value that the owner sends on
+         * subscribing calls it too. Calls for different variables run in
+         * parallel on up to `handler_threads` threads.
+         *
+         * @param var Name of the variable.
+         * @param handler Function to call.
+         */
+        void on_change(const std::string &var, std::function<void()> handler)
+        {
+            on_change_slot(find_var(var), std::move(handler));
+        }
+
+        /**
+         * Call `handler` on a handler thread whenever `var` is changed,
+         * replacing an earlier handler of `var`; an empty `handler` removes
+         * it.
+         *
+         * @param var Handle of the variable.
+         * @param handler Function to call.
+         */
+        template <typename T>
+        void on_change(const VarHandle<T> &var, std::function<void()> handler)
+        {
+            on_change_slot(index_of(var), std::move(handler));
+        }
+
+        /**
+         * Returns how the change handler of `var` has been called so far.
+         */
+        HandlerStats handler_stats(const std::string &var)
+        {
+            return handler_stats_slot(find_var(var));
+        }
+
+        /**
+         * Returns how the change handler of `var` has been called so far.
+         */
+        template <typename T>
+        HandlerStats handler_stats(const VarHandle<T> &var)
+        {
+            return handler_stats_slot(index_of(var));
+        }
+
+        /**
+         * Like `wait`, but without blocking: the returned future becomes
+         * ready on a handler thread once `var` is changed.
+         *
+         * @param var Name of the variable.
+         * @return Future of the change.
+         */
+        std::future<void> changed_future(const std::string &var)
+        {
+            return changed_future_slot(find_var(var));
+        }
+
+        /**
+         * Like `wait`, but without blocking: the returned future becomes
+         * ready on a handler thread once `var` is changed.
+         *
+         * @param var Handle of the variable.
+         * @return Future of the change.
+         */
+        template <typename T>
+        std::future<void> changed_future(const VarHandle<T> &var)
+        {
+            return changed_future_slot(index_of(var));
+        }
+
+        /**
+         * Like `get`, but without blocking: the returned future is given the
+         * value at once if there is one, and otherwise on a handler thread
+         * once it is received from the owner.
+         *
+         * @tparam T Type of the variable.
+         * @param var Name of the variable.
+         * @return Future of the value.
+         */
+        template <typename T>
+        std::future<T> get_future(const std::string &var)
+        {
+            return get_future(handle<T>(var));
+        }
+
+        /**
+         * Like `get`, but without blocking: the returned future is given the
+         * value at once if there is one, and otherwise on a handler thread
+         * once it is received from the owner.
+         *
+         * @tparam T Type of the variable.
+         * @param var Handle of the variable.
+         * @return Future of the value.
+         */
+        template <typename T>
+        std::future<T> get_future(const VarHandle<T> &var)
+        {
+            auto promise = std::make_shared<std::promise<T>>();
+            std::future<T> future = promise->get_future();
+            auto deliver = [this, var, promise]
+            {
+                try
+                {
+                    promise->set_value(get(var));
+                }
+                catch (...)
+                {
+                    promise->set_exception(std::current_exception());
+                }
+            };
+            if (!when_changed(index_of(var), true, deliver))
+            {
+                deliver();
+            }
+            return future;
+        }
+
+#ifdef __cpp_impl_coroutine
+        /**
+         * Result of `changed` and `get_async`, for a coroutine to
+         * `co_await`. The coroutine is resumed on a handler thread, so one
+         * handler thread can serve any number of coroutines that wait for
+         * variables.
+         *
+         * @tparam T Type of the variable, or `void` to wait for a change.
+         */
+        template <typename T>
+        class Awaitable
+        {
+        public:
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> coroutine)
+            {
+                return state->when_changed(index, !std::is_void_v<T>, [coroutine] { coroutine.resume(); });
+            }
+
+            T await_resume()
+            {
+                if constexpr (!std::is_void_v<T>)
+                {
+                    return state->get(VarHandle<T>(index, state->schema));
+                }
+            }
+
+        private:
+            friend class State;
+
+            Awaitable(State *state, size_t index) : state(state), index(index) {}
+
+            State *state;
+            size_t index;
+        };
+
+        /**
+         * Like `wait`, but suspends the calling coroutine instead of
+         * blocking, e.g. `co_await state.changed("X")`.
+         *
+         * @param var Name of the variable.
+         * @return What to `co_await`.
+         */
+        Awaitable<void> changed(const std::string &var)
+        {
+            return Awaitable<void>(this, find_var(var));
+        }
+
+        /**
+         * Like `wait`, but suspends the calling coroutine instead of
+         * blocking.
+         *
+         * @param var Handle of the variable.
+         * @return What to `co_await`.
+         */
+        template <typename T>
+        Awaitable<void> changed(const VarHandle<T> &var)
+        {
+            return Awaitable<void>(this, index_of(var));
+        }
+
+        /**
+         * Like `get`, but suspends the calling coroutine if the value has to
+         * be received from the owner first, e.g.
+         * `int32_t x = co_await state.get_async<int32_t>("X")`.
+         *
+         * @tparam T Type of the variable.
+         * @param var Name of the variable.
+         * @return What to `co_await` for the value.
+         */
+        template <typename T>
+        Awaitable<T> get_async(const std::string &var)
+        {
+            return get_async(handle<T>(var));
+        }
+
+        /**
+         * Like `get`, but suspends the calling coroutine if the value has to
+         * be received from the owner first.
+         *
+         * @tparam T Type of the variable.
+         * @param var Handle of the variable.
+         * @return What to `co_await` for the value.
+         */
+        template <typename T>
+        Awaitable<T> get_async(const VarHandle<T> &var)
+        {
+            return Awaitable<T>(this, index_of(var));
+        }
+#endif
+
+        /**
+         * Returns when `var` was last updated.
+         */
+        std::chrono::time_point<std::chrono::system_clock> last_updated(const std::string &var)
+        {
+            return last_updated_slot(find_var(var));
+        }
+
+        /**
+         * Returns when `var` was last updated.
+         */
+        template <typename T>
+        std::chrono::time_point<std::chrono::system_clock> last_updated(const VarHandle<T> &var)
+        {
+            return last_updated_slot(index_of(var));
+        }
+
+    private:
+        /**
+         * Self program name.
+         */
+        std::string self;
+
+        /**
+         * Whether the I/O threads are running.
+         */
+        std::atomic<bool> io_thread_running;
+
+        /**
+         * Socket for the server.
+         */
+        int server_socket;
+
+        /**
+         * Enumerates how the data of a message is encoded.
+         */
+        enum Encoding : uint8_t
+        {
+            ENCODING_RAW,       // The data itself.
+            ENCODING_SHM,       // Name of the shared memory segment holding the data.
+            ENCODING_DELTA,     // Changes to the last value sent, see `DeltaHeader`.
+            ENCODING_LZ,        // Compressed data of another encoding, see `LzHeader`.
+            ENCODING_QUANTIZED, // Floating point array at lower precision, see `QuantizedHeader`.
+        };
+
+        /**
+         * Enumerates the 16-bit forms that floating point arrays may be sent
+         * in.
+         */
+        enum Quantization : uint8_t
+        {
+            QUANTIZE_NONE,
+            QUANTIZE_F16,  // IEEE half precision.
+            QUANTIZE_BF16, // Upper half of a float.
+            QUANTIZE_I16,  // Multiples of a step away from an offset.
+        };
+
+        /**
+         * Enumerates the kinds of messages.
+         */
+        enum MessageKind : uint8_t
+        {
+            MESSAGE_UPDATE,   // New value of a variable, sent by its owner.
+            MESSAGE_INTEREST, // Request to be sent updates of a variable.
+            MESSAGE_REQUEST,  // Request for the owner to update a variable.
+            MESSAGE_GROUP,    // Updates to apply together, as a series of messages without a name.
+            MESSAGE_RESYNC,   // Request for the value to be sent again, in full if by delta.
+            MESSAGE_REJECT,   // Refusal of an interest by the owner, which sends no updates.
+        };
+
+        /**
+         * Header that starts every message. It is followed by `name_size`
+         * bytes of variable name and `data_size` bytes of data.
+         */
+        struct MessageHeader
+        {
+            MessageKind kind;
+            Encoding encoding;
+            uint16_t name_size;
+            uint32_t data_size;
+            uint64_t version = 0; // Of an update, the version of the value, see `Variable::version`.
+        };
+
+        /**
+         * Data of an interest message. Fields missing from a shorter message
+         * keep their defaults, so that new ones can be added at the end.
+         */
+        struct InterestData
+        {
+            uint8_t shm = 0; // Whether to send updates through shared memory.
+            uint8_t conflate = 0;
+            uint8_t delta = 0;
+            uint8_t compress = 0; // Whether the subscriber can decompress `ENCODING_LZ`.
+            uint8_t quantize = 0; // Whether the subscriber can decode `ENCODING_QUANTIZED`.
+            uint8_t reserved[3] = {};
+            uint64_t layout = 0; // If the variable is a `STRUCT`, its layout as the subscriber has it.
+            uint32_t min_interval = 0; // Microseconds to leave between updates.
+            uint32_t decimation = 0;   // Send only every `decimation`-th update, if above 1.
+            double deadband = 0;          // Smallest change to send.
+            double relative_deadband = 0; // Smallest change to send, relative to the value sent.
+        };
+
+        /**
+         * Start of the data of a message with `ENCODING_DELTA`. It is followed
+         * by `runs` pairs of a `DeltaRun` and its bytes, which are copied over
+         * the value of version `base_version` to make version `version`. If
+         * `base_version` is 0, the runs cover the whole value.
+         */
+        struct DeltaHeader
+        {
+            uint64_t base_version;
+            uint64_t version;
+            uint32_t size; // Size of the new value in bytes.
+            uint32_t runs;
+        };
+
+        struct DeltaRun
+        {
+            uint32_t offset;
+            uint32_t length;
+        };
+
+        /**
+         * Start of the data of a message with `ENCODING_LZ`. It is followed by
+         * the first `prefix_size` bytes of the original data as they are, and
+         * then the rest of it compressed with `lz::compress`.
+         */
+        struct LzHeader
+        {
+            Encoding encoding; // Encoding of the original data.
+            uint8_t reserved[3];
+            uint32_t prefix_size;
+            uint32_t size; // Size of the original data.
+        };
+
+        /**
+         * Compressed data of an update, shared by the messages that carry it
+         * to different subscribers and made when the first of them is sent.
+         */
+        struct Compressed
+        {
+            std::once_flag once;
+            std::shared_ptr<Buffer> data; // Null if compression did not pay off.
+            size_t size = 0;
+        };
+
+        /**
+         * Start of the data of a message with `ENCODING_QUANTIZED`. It is
+         * followed by the values, 16 bits each.
+         */
+        struct QuantizedHeader
+        {
+            Quantization format;
+            uint8_t reserved[7];
+            double offset; // For `QUANTIZE_I16`, the value that 0 stands for.
+            double step;   // For `QUANTIZE_I16`, the value that 1 adds.
+        };
+
+        /**
+         * Quantized data of an update, shared like `Compressed`.
+         */
+        struct Quantized
+        {
+            std::once_flag once;
+            std::shared_ptr<Buffer> data; // Null if the values do not fit the format.
+            QuantizedHeader header = {};
+            std::shared_ptr<Compressed> compressed; // For compressing `data` in turn.
+        };
+
+        /**
+         * Get the size of a message on the wire.
+         *
+         * @param header Header of the message.
+         * @return Size of the message, including its header.
+         */
+        static size_t message_length(const MessageHeader &header);
+
+        /**
+         * Message waiting to be sent. The name and data are only referenced,
+         * and gathered into a single `sendmsg` when the connection is flushed.
+         */
+        struct Outgoing
+        {
+            MessageHeader header;
+            const std::string *name;            // Name of the variable, from `var_table`.
+            std::shared_ptr<const Buffer> data; // Data of the message, after `small_data`.
+            std::string small_data;             // Start of the data of the message.
+            std::vector<Outgoing> members;      // Messages that make up a group.
+            size_t index = 0;                   // Index of the variable.
+            bool delta = false;                 // Whether to delta encode `data` when sent.
+            bool compress = false;              // Whether to compress the data when sent.
+            std::shared_ptr<Compressed> compressed;
+            bool quantize = false; // Whether to quantize the data when sent.
+            std::shared_ptr<Quantized> quantized;
+        };
+
+        struct IoThread;
+
+        /**
+         * Connection to another program.
+         */
+        struct Connection
+        {
+            IoThread *io; // Thread that does the I/O of the connection.
+            int socket;
+            bool to_owner;    // Whether the other program owns variables that we read.
+            std::string peer; // Address of the other program.
+
+            // Received data that has not been handled yet is kept between
+            // `rx_start` and `rx_end`.
+            std::vector<char> rx;
+            size_t rx_start = 0, rx_end = 0;
+            std::vector<char> inflated;    // Decompressed data of the message being handled.
+            std::vector<char> dequantized; // Reconstructed values of the message being handled.
+
+            // Messages waiting to be sent, of which the first `tx_offset`
+            // bytes have been sent already. Only `io` removes them, so
+            // it may send from them without holding `tx_m`.
+            std::mutex tx_m;
+            std::deque<Outgoing> tx;
+            size_t tx_offset = 0;
+            size_t tx_frozen = 0;      // Messages at the front taken by `io` to send as they are.
+            size_t tx_bytes = 0;       // Bytes in `tx` that have not been sent.
+            bool tx_scheduled = false; // In `flush_list`, or waiting until the socket is writable.
+            bool tx_waiting = false;   // Waiting until the socket is writable.
+            bool closed = false;       // Closed by `io`; nothing more may be queued.
+            uint64_t tx_total = 0;     // Bytes sent so far.
+
+            // Last value of each variable sent with delta encoding, indexed
+            // like `var_table`. Only used by `io`.
+            struct Sent
+            {
+                std::shared_ptr<const Buffer> data;
+                size_t size;
+                uint64_t version;
+            };
+            std::vector<Sent> sent;
+
+            // Messages being sent through `io->uring`, one request per
+            // message. Only used by `io`.
+            std::vector<struct iovec> tx_iov;
+            std::vector<struct msghdr> tx_msgs;
+            size_t tx_inflight = 0; // Requests that have not completed.
+            size_t tx_done = 0;     // Bytes sent by those that have.
+            bool tx_failed = false;
+            int uring_requests = 0; // Requests in flight that refer to the connection.
+        };
+
+        /**
+         * Mutex for the `connections` map, which owns the `Connection`s that
+         * the I/O threads refer to.
+         */
+        std::mutex connections_m;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+
+        /**
+         * Thread for socket I/O, which accepts connections if it is the first
+         * one and sends and receives the messages of the connections assigned
+         * to it.
+         */
+        struct IoThread
+        {
+            std::thread thread;
+
+            /**
+             * Reactor that `thread` waits on, unless it uses `uring`.
+             */
+            std::unique_ptr<Reactor> reactor;
+
+            /**
+             * io_uring instance that `thread` does its I/O through, if
+             * `IO_URING` was asked for and is supported.
+             */
+            std::unique_ptr<Uring> uring;
+
+            /**
+             * Mutex for the `flush_list` list of connections with messages
+             * for `thread` to send.
+             */
+            std::mutex flush_m;
+            std::vector<Connection *> flush_list;
+            std::vector<Connection *> flushing; // Taken from `flush_list` by `thread`.
+
+            /**
+             * Connections added with `uring`, which `thread` starts receiving
+             * from. Protected by `flush_m`.
+             */
+            std::vector<Connection *> arm_list;
+
+            /**
+             * Connections closed during the current iteration of the loop,
+             * which are freed at its end since later events may still refer
+             * to them.
+             */
+            std::vector<Connection *> closed_connections;
+        };
+
+        /**
+         * The I/O threads. Connections are assigned to them by socket number.
+         */
+        std::vector<std::unique_ptr<IoThread>> io_threads;
+
+        /**
+         * Connection subscribed to a variable, along with the options it
+         * asked for and what has been sent to it.
+         */
+        struct Subscriber
+        {
+            Connection *connection;
+            bool shm = false; // Whether updates are published through shared memory.
+            bool conflate = false;
+            bool delta = false;
+            bool compress = false;
+            bool quantize = false;
+            bool due = false; // Whether the update being prepared goes to this subscriber.
+
+            // Rate limit asked for, and the state of it. An update that is
+            // held back is sent at `trailing_at` unless a later one is sent
+            // first.
+            std::chrono::steady_clock::duration min_interval{0};
+            uint32_t decimation = 1;
+            uint32_t held = 0; // Updates since the last one sent.
+            bool trailing = false;
+            std::chrono::steady_clock::time_point last_sent, last_update, trailing_at;
+
+            // Deadband asked for, and the value last sent to compare with.
+            // The value is copied, rather than its buffer kept, so that the
+            // buffer goes back to the pool; the copy reuses its capacity.
+            double deadband = 0;
+            double relative_deadband = 0;
+            bool has_sent = false;
+            std::vector<char> sent;
+        };
+
+        /**
+         * Mutex for the `subscriber_list` list, which is indexed like
+         * `var_table`.
+         */
+        std::mutex subscriber_list_m;
+        std::vector<std::vector<Subscriber>> subscriber_list;
+
+        /**
+         * Distinguishes the shared memory segments of `State` objects within
+         * the same process.
+         */
+        unsigned instance;
+
+        /**
+         * Enumerates the types of variables.
+         */
+        enum Type : uint8_t
+        {
+            INT8,
+            INT16,
+            INT32,
+            INT64,
+            UINT8,
+            UINT16,
+            UINT32,
+            UINT64,
+            FLOAT,
+            DOUBLE,
+            STRING,
+            STRUCT,
+            TENSOR,
+        };
+
+        /**
+         * Get the size of a type.
+         *
+         * @param type Type of variable.
+         * @return Size of the type.
+         */
+        size_t type_size(Type type);
+
+        /**
+         * Maps a string to a `Type` enum.
+         */
+        std::unordered_map<std::string, Type> type_map = {
+            {"INT8", INT8},
+            {"INT16", INT16},
+            {"INT32", INT32},
+            {"INT64", INT64},
+            {"UINT8", UINT8},
+            {"UINT16", UINT16},
+            {"UINT32", UINT32},
+            {"UINT64", UINT64},
+            {"FLOAT", FLOAT},
+            {"DOUBLE", DOUBLE},
+            {"STRING", STRING},
+        };
+
+        /**
+         * Options of a variable, from the optional last column of the
+         * configuration file.
+         */
+        struct VarOptions
+        {
+            bool compress = false; // Compress large updates for subscribers that support it.
+            Quantization quantize = QUANTIZE_NONE; // Send the values of a FLOAT or DOUBLE array at lower precision.
+            double max_error = 0;                  // Largest error allowed with `QUANTIZE_I16`.
+        };
+
+        /**
+         * Copy of the value of a scalar variable that `get` reads without
+         * taking the variable's lock. Every type of scalar, and a `STRUCT` of
+         * up to 8 bytes, fits in `bits`, so a single atomic load reads a
+         * whole value. It is written with the
+         * variable's lock held, and has a cache line to itself so that
+         * readers of other variables are left alone.
+         */
+        struct alignas(64) Scalar
+        {
+            std::atomic<uint64_t> bits{0};
+            std::atomic<bool> readable{false}; // Whether `bits` holds a value that `get` may return.
+        };
+
+        /**
+         * Structure for storing a variable.
+         */
+        struct Variable
+        {
+            Type type;
+            bool is_array;
+            int size; // If `is_array`, then the number of elements in the array.
+            size_t element_size; // Size of the value, or of an element if `is_array`.
+            uint64_t layout = 0;  // If `STRUCT`, fingerprint of its fields, which subscribers must share.
+            Type element_type;    // If `TENSOR`, type of its elements.
+            std::string owner;
+            Connection *owner_connection; // Guarded by the variable's lock.
+            std::shared_ptr<Buffer> data;
+            std::chrono::time_point<std::chrono::system_clock> last_updated;
+            std::vector<std::shared_ptr<Buffer>> spare_buffers; // Previous buffers kept for reuse.
+            BufferStats buffer_stats;
+            std::shared_ptr<ShmSegment> shm; // Segment published to, or read from if not owned.
+            std::vector<std::shared_ptr<ShmSegment>> retired_shm; // Outgrown segments, still linked for readers.
+            uint64_t version = 0; // Counts updates; if not owned, as numbered by the owner.
+            bool received = false; // If not owned, whether a value came from the owner, even of version 0.
+            bool resync = false;  // Whether the value was asked for again after an update failed.
+            VarOptions options;
+            Scalar *scalar = nullptr; // If it fits in one, the lock-free copy of the value.
+
+            /**
+             * Whether the size of the value can change from one update to
+             * the next.
+             */
+            bool resizable() const
+            {
+                return is_array || type == STRING || type == TENSOR;
+            }
+        };
+
+        /**
+         * Check that the value of a tensor variable is a tensor of its type
+         * whose elements lie within the value.
+         *
+         * @param v The variable.
+         * @param data The value.
+         * @param size Size of the value in bytes; 0 for no tensor.
+         * @return Whether the value is valid.
+         */
+        bool valid_tensor(const Variable &v, const void *data, size_t size);
+
+        /**
+         * Maximum number of previous buffers kept for reuse by each variable.
+         */
+        static constexpr size_t max_spare_buffers = 2;
+
+        /**
+         * Get a buffer of at least `size` bytes for the next value of a
+         * variable, reusing a pooled buffer if one is no longer referenced
+         * elsewhere. The variable's lock must be held.
+         *
+         * @param v The variable.
+         * @param size Size of the buffer in bytes.
+         * @param in_place Whether the current buffer of the variable may be
+         *                 returned.
+         * @return The buffer.
+         */
+        std::shared_ptr<Buffer> acquire_buffer(Variable &v, size_t size, bool in_place);
+
+        /**
+         * Make `buffer` the current buffer of a variable, returning the old one
+         * to the pool. The variable's lock must be held.
+         *
+         * @param v The variable.
+         * @param buffer The new buffer.
+         */
+        void publish_buffer(Variable &v, std::shared_ptr<Buffer> buffer);
+
+        /**
+         * Store a new value in a variable. The variable's lock must be held.
+         *
+         * @param v The variable.
+         * @param data New data.
+         * @param data_size Size of the new data.
+         * @param count Number of elements in the new data.
+         */
+        void store(Variable &v, const void *data, int data_size, int count);
+
+        /**
+         * Thread in `wait_any` or `wait_all`, registered with each of the
+         * variables it waits for under its position in the list of them.
+         */
+        struct Waiter
+        {
+            std::mutex m;
+            std::condition_variable cv;
+            std::vector<bool> changed; // Guarded by `m`.
+            size_t count = 0;          // Number of `changed` that are set.
+
+            /**
+             * Mark the variable at `position` as changed and wake the
+             * thread.
+             */
+            void notify(size_t position)
+            {
+                {
+                    std::unique_lock lk(m);
+                    if (changed[position])
+                    {
+                        return;
+                    }
+                    changed[position] = true;
+                    ++count;
+                }
+                cv.notify_one();
+            }
+        };
+
+        /**
+         * Entry of the variable table, holding everything about a variable.
+         * Entries start on a cache line of their own, so that threads using
+         * different variables do not slow each other down.
+         */
+        struct alignas(64) Slot
+        {
+            std::string name;
+            Variable var;
+            std::mutex lock;
+            std::condition_variable cv;
+            bool owned = false;
+            bool interested = false; // Guarded by `lock`.
+            bool rejected = false;   // Whether the owner refused the interest, guarded by `lock`.
+            Subscription subscription; // Guarded by `lock`.
+            Scalar scalar; // Referred to by `var.scalar` if the variable is a scalar.
+
+            // Change handler and the state of its calls, guarded by
+            // `handlers_m`. A call is queued at most once, and queued again
+            // when it ends if the variable changed meanwhile.
+            std::atomic<bool> has_handler{false};
+            std::shared_ptr<const std::function<void()>> handler;
+            bool handler_queued = false;
+            bool handler_running = false;
+            std::chrono::steady_clock::time_point handler_queued_at;
+            HandlerStats handler_stats{};
+
+            // Functions to call on a handler thread at the next change, for
+            // the futures and coroutines waiting for it. Guarded by `lock`.
+            std::vector<std::function<void()>> continuations;
+
+            // Threads in `wait_any` or `wait_all` for this variable, with its
+            // position in their lists. Guarded by `lock`.
+            std::vector<std::pair<Waiter *, size_t>> waiters;
+        };
+
+        /**
+         * Dense variable table, created in one piece once the configuration
+         * file is parsed and indexed by `VarHandle`. Its entries never move.
+         */
+        std::vector<Slot> var_table;
+
+        /**
+         * Maps a variable name to its index in `var_table`.
+         */
+        std::unique_ptr<PerfectHash> var_index;
+
+        /**
+         * Fingerprint of the variables in `var_table`, carried by handles.
+         */
+        uint64_t schema;
+
+        /**
+         * Threads that call change handlers, and the variables whose handlers
+         * are waiting for one of them, guarded by `handlers_m`.
+         */
+        std::mutex handlers_m;
+        std::condition_variable handlers_cv;
+        std::deque<Slot *> handler_queue;
+        std::deque<std::function<void()>> handler_tasks; // Continuations to call, before any handler.
+        std::vector<std::thread> handler_threads;
+        unsigned handler_thread_count;
+        bool handlers_stopping = false;
+
+        /**
+         * Start the handler threads if they are not running yet.
+         * `handlers_m` must be held.
+         */
+        void start_handler_threads();
+
+        /**
+         * Call the change handlers of `handler_queue` until the `State` is
+         * destroyed.
+         */
+        void handler_loop();
+
+        /**
+         * Queue a call of the change handler of a variable, unless one is
+         * queued already.
+         *
+         * @param s Table entry of the variable.
+         */
+        void queue_handler(Slot &s);
+
+        /**
+         * Move the continuations of a variable to `handler_tasks`.
+         * `s.lock` must be held.
+         *
+         * @param s Table entry of the variable.
+         */
+        void queue_continuations(Slot &s);
+
+        /**
+         * Wake the threads waiting for a variable that changed, and queue its
+         * change handler and continuations. `s.lock` must be held.
+         *
+         * @param s Table entry of the variable.
+         */
+        void notify_waiters(Slot &s)
+        {
+            s.cv.notify_all();
+            if (s.has_handler.load(std::memory_order_acquire))
+            {
+                queue_handler(s);
+            }
+            if (!s.continuations.empty())
+            {
+                queue_continuations(s);
+            }
+            for (auto &w : s.waiters)
+            {
+                w.first->notify(w.second);
+            }
+        }
+
+        /**
+         * Have `continuation` called on a handler thread once a variable
+         * changes, the way that `wait` would return.
+         *
+         * @param index Index of the variable.
+         * @param first_value Whether to wait only if `get` would, that is if
+         *                    the value is still to be received from the owner.
+         * @param continuation Function to call.
+         * @return Whether `continuation` will be called; if not, the value
+         *         can be read at once.
+         */
+        bool when_changed(size_t index, bool first_value, std::function<void()> continuation);
+
+        /**
+         * Returns a future that becomes ready once a variable changes.
+         *
+         * @param index Index of the variable.
+         */
+        std::future<void> changed_future_slot(size_t index);
+
+        /**
+         * Variable as declared on a line of the configuration file.
+         */
+        struct Definition
+        {
+            std::string var;
+            Type type;
+            std::string type_name;
+            std::string owner;
+            bool is_array;
+            VarOptions options;
+            size_t struct_size = 0;     // If `STRUCT`, size of the struct.
+            uint64_t struct_layout = 0; // If `STRUCT`, fingerprint of its fields.
+            Type element_type = INT8;   // If `TENSOR`, type of its elements.
+        };
+
+        /**
+         * Create a variable.
+         *
+         * @param s Table entry to create it in.
+         * @param d Definition of the variable.
+         */
+        void create_var(Slot &s, const Definition &d);
+
+        /**
+         * Parse the fields of a `STRUCT` type in the configuration file, such
+         * as `STRUCT{x:DOUBLE,y:DOUBLE,id:UINT8[4]}`, and lay them out as a
+         * C compiler would: each field aligned to the size of its type, and
+         * the struct padded to the largest alignment.
+         *
+         * @param type The type.
+         * @param line Line of the configuration file, for errors.
+         * @param d Definition whose `struct_size` and `struct_layout` to set.
+         */
+        void parse_struct(const std::string &type, int line, Definition &d);
+
+        /**
+         * Parse the comma separated options of a variable in the
+         * configuration file.
+         *
+         * @param options The options.
+         * @param line Line of the configuration file, for errors.
+         * @return The options.
+         */
+        VarOptions parse_options(const std::string &options, int line);
+
+        /**
+         * Queue a message on a connection and have its I/O thread send it.
+         *
+         * @param c The connection.
+         * @param message The message.
+         * @param conflate Whether to replace a queued message of the same
+         *                 kind and variable that has not started to be sent.
+         * @return 0 on success, -1 if the connection is closed.
+         */
+        int enqueue(Connection *c, Outgoing message, bool conflate = false);
+
+        /**
+         * Append the parts of a message to an I/O vector, skipping `skip`
+         * bytes and stopping when the vector is full.
+         *
+         * @param m The message.
+         * @param iov The I/O vector.
+         * @param iovcnt Number of parts in `iov`, updated.
+         * @param skip Number of bytes to skip, updated.
+         */
+        static void gather(const Outgoing &m, struct iovec *iov, int &iovcnt, size_t &skip);
+
+        /**
+         * Send as many queued messages of a connection as the socket takes
+         * without blocking, gathering them into as few system calls as
+         * possible. Only called from the I/O thread of the connection.
+         *
+         * @param c The connection.
+         * @return 0 on success, -1 on failure.
+         */
+        int flush_connection(Connection *c);
+
+        /**
+         * Handle all complete messages in the receive buffer of a connection.
+         *
+         * @param c The connection.
+         * @return 0 on success, -1 on failure.
+         */
+        int handle_messages(Connection *c);
+
+        /**
+         * Check that an update can be applied to a variable, without applying
+         * it. The variable's lock must be held.
+         *
+         * @param c Connection the update came from.
+         * @param s Table entry of the variable.
+         * @param header Header of the message.
+         * @param data Data of the message.
+         * @return 0 if valid, -1 if the message is invalid.
+         */
+        int check_update(Connection *c, const Slot &s, const MessageHeader &header, const char *data);
+
+        /**
+         * Check that the data of a delta encoded update fits a variable.
+         *
+         * @param v The variable.
+         * @param data Data of the message.
+         * @param data_size Size of the data.
+         * @return 0 if valid, -1 if the message is invalid.
+         */
+        int check_delta(const Variable &v, const char *data, size_t data_size);
+
+        /**
+         * Apply an update to a variable, along with its version. The
+         * variable's lock must be held.
+         *
+         * @param c Connection the update came from.
+         * @param s Table entry of the variable.
+         * @param header Header of the message.
+         * @param data Data of the message.
+         * @return 0 if applied, 1 if skipped, -1 if the message is invalid.
+         */
+        int apply_update(Connection *c, Slot &s, const MessageHeader &header, const char *data);
+
+        /**
+         * Apply a delta encoded update to a variable, or ask for it to be
+         * sent in full if it does not fit the current value. The variable's
+         * lock must be held, and the data checked with `check_delta`.
+         *
+         * @param c Connection the update came from.
+         * @param s Table entry of the variable.
+         * @param data Data of the message.
+         * @return 0 if applied, 1 if skipped.
+         */
+        int recv_delta(Connection *c, Slot &s, const char *data);
+
+        /**
+         * Delta encode a message against what was last sent on a connection.
+         * Only called from the I/O thread of the connection.
+         *
+         * @param c The connection.
+         * @param m The message.
+         */
+        void encode_delta(Connection *c, Outgoing &m);
+
+        /**
+         * Compress the data of a message if that makes it smaller.
+         *
+         * @param m The message.
+         */
+        void compress(Outgoing &m);
+
+        /**
+         * Replace the data of a message with its values at the precision of
+         * the variable's `quantize` option, if they fit.
+         *
+         * @param m The message.
+         */
+        void quantize_values(Outgoing &m);
+
+        /**
+         * Reconstruct the values of a message with `ENCODING_QUANTIZED`,
+         * replacing its header and data with those of a raw update.
+         *
+         * @param s The slot of the variable.
+         * @param header Header of the message.
+         * @param data Data of the message.
+         * @param values Where to store the values.
+         * @return 0 on success, -1 if the data is invalid.
+         */
+        int dequantize(const Slot &s, MessageHeader &header, const char *&data, std::vector<char> &values);
+
+        /**
+         * Encode a message, and those in a group, as it is about to be sent on
+         * a connection. Only called from the I/O thread of the connection.
+         *
+         * @param c The connection.
+         * @param m The message.
+         */
+        void encode(Connection *c, Outgoing &m);
+
+        /**
+         * Decompress the data of a message with `ENCODING_LZ`, replacing its
+         * header and data with the original ones.
+         *
+         * @param header Header of the message.
+         * @param data Data of the message.
+         * @param inflated Where to store the decompressed data.
+         * @return 0 on success, -1 if the data is invalid.
+         */
+        int inflate(MessageHeader &header, const char *&data, std::vector<char> &inflated);
+
+        /**
+         * Handle a request for the value of a variable to be sent again, as a
+         * subscriber that failed to apply an update makes. A delta update is
+         * sent in full.
+         *
+         * @param c Connection the message came from.
+         * @param index Index of the variable.
+         * @return 0 on success, -1 on failure.
+         */
+        int recv_resync(Connection *c, size_t index);
+
+        /**
+         * Handle the refusal of our interest in a variable by its owner, and
+         * have whoever waits for its value give up.
+         *
+         * @param c Connection the message came from.
+         * @param index Index of the variable.
+         * @return 0 on success, -1 on failure.
+         */
+        int recv_reject(Connection *c, size_t index);
+
+        /**
+         * Handle a group of updates, applying them all before waking waiters.
+         *
+         * @param c Connection the message came from.
+         * @param data Data of the message.
+         * @param data_size Size of the data.
+         * @return 0 on success, -1 on failure.
+         */
+        int recv_group(Connection *c, const char *data, size_t data_size);
+
+        /**
+         * Handle an update, or a request for one.
+         *
+         * @param c Connection the message came from.
+         * @param header Header of the message.
+         * @param index Index of the variable.
+         * @param data Data of the message.
+         * @return 0 on success, -1 on failure.
+         */
+        int recv_message(Connection *c, const MessageHeader &header, size_t index, const char *data);
+
+        /**
+         * Read the value of a variable from its shared memory segment.
+         *
+         * @param s Table entry of the variable, whose lock must be held.
+         * @param name Name of the segment.
+         * @return 0 on success, -1 on failure.
+         */
+        int recv_shm(Slot &s, const std::string &name);
+
+        /**
+         * Publish the current value of an owned variable to its shared memory
+         * segment, creating or growing the segment as needed.
+         *
+         * @param index Index of the variable, whose lock must be held.
+         * @return 0 on success, -1 on failure.
+         */
+        int publish_shm(size_t index);
+
+        /**
+         * Handle an interest message.
          *
-         * @param var Name of the variable.
-         * @param ret_value Where to store the variable.
+         * @param c Connection the message came from.
+         * @param header Header of the message.
+         * @param index Index of the variable.
+         * @param data Data of the message.
+         * @return 0 on success, -1 on failure.
          */
-        void get(std::string var, std::string &ret_value)
-        {
-            std::vector<char> v;
-            get(var, v);
-            ret_value = std::string(v.begin(), v.end());
-        }
+        int recv_interest(Connection *c, const MessageHeader &header, size_t index, const char *data);
 
         /**
-         * Set the variable stored in the state.
+         * Send an interest message to the owner of a variable.
          *
-         * @tparam T Type of the variable.
-         * @param var Name of the variable.
-         * @param value New value of the variable.
+         * @param s Table entry of the variable, whose lock must be held.
+         * @param shm Whether to ask for updates through shared memory.
+         * @return 0 on success, -1 on failure.
          */
-        template <typename T>
-        void set(std::string var, T value)
-        {
-            std::unique_lock lk(var_locks[var]);
-
-            check_var_type<T>(var);
-
-            // Check if this program owns the variable.
-            if (self != vars[var].owner)
-            {
-                if (request_update(vars[var].owner_socket, var, &value, sizeof(value)) < 0)
-                {
-                    throw std::runtime_error("Owner of '" + var + "', '" + vars[var].owner + "', is no longer connected.");
-                }
-                return;
-            }
-
-            *static_cast<T *>(vars[var].data) = value;
-            vars[var].last_updated = std::chrono::system_clock::now();
-            var_cvs[var].notify_all();
-
-            lk.unlock();
-            notify_subscribers(var);
-        }
+        int send_interest(const Slot &s, bool shm);
 
         /**
-         * Set the variable stored in the state.
+         * Send a request to update a variable to its owner.
          *
-         * @tparam T Type of the variable.
-         * @param var Name of the variable.
-         * @param value New value of the variable.
+         * @param s Table entry of the variable, whose lock must be held.
+         * @param data New data.
+         * @param data_size Size of the new data.
+         * @return 0 on success, -1 on failure.
          */
-        template <typename T>
-        void set(std::string var, std::vector<T> value)
-        {
-            std::unique_lock lk(var_locks[var]);
-
-            check_var_type<std::vector<T>>(var);
-
-            // Check if this program owns the variable.
-            if (self != vars[var].owner)
-            {
-                if (request_update(vars[var].owner_socket, var, value.data(), value.size() * sizeof(T)) < 0)
-                {
-                    throw std::runtime_error("Owner of '" + var + "', '" + vars[var].owner + "', is no longer connected.");
-                }
-                return;
-            }
-
-            free(vars[var].data);
-            vars[var].data = malloc(value.size() * sizeof(T));
-            vars[var].size = value.size();
-            memcpy(vars[var].data, value.data(), value.size() * sizeof(T));
-            vars[var].last_updated = std::chrono::system_clock::now();
-            var_cvs[var].notify_all();
-
-            lk.unlock();
-            notify_subscribers(var);
-        }
+        int request_update(const Slot &s, const void *data, int data_size);
 
         /**
-         * Set the variable stored in the state.
+         * Accept all pending connections.
          *
-         * @param var Name of the variable.
-         * @param value New value of the variable.
+         * @return 0 on success, -1 on failure.
          */
-        void set(std::string var, std::string value)
-        {
-            set(var, std::vector<char>(value.begin(), value.end()));
-        }
+        int accept_connections();
 
         /**
-         * Waits indefinitely until `var` is changed.
+         * Start sending and receiving messages through a socket, on the I/O
+         * thread that the socket number picks.
          *
-         * @param var Name of the variable.
+         * @param socket The socket.
+         * @param to_owner Whether the other program owns variables that we read.
+         * @return The connection, or `nullptr` on failure.
          */
-        void wait(std::string var)
-        {
-            std::unique_lock lk(var_locks[var]);
+        Connection *add_connection(int socket, bool to_owner);
 
-            check_var_exists(var);
+        /**
+         * Close a connection and forget everything that refers to it. It is
+         * freed by `reap_connections`. Only called from the I/O thread of the
+         * connection.
+         *
+         * @param c The connection.
+         */
+        void close_connection(Connection *c);
 
-            // Tell the owner that we are interested in this variable.
-            if (vars[var].owner != self && interested_vars.find(var) == interested_vars.end())
-            {
-                if (send_interest(vars[var].owner_socket, var) < 0)
-                {
-                    throw std::runtime_error("Owner of '" + var + "', '" + vars[var].owner + "', is no longer connected.");
-                }
-                interested_vars.insert(var);
-            }
+        /**
+         * Free the connections closed since the last call. Only called from
+         * `t`.
+         *
+         * @param t The I/O thread.
+         */
+        void reap_connections(IoThread &t);
 
-            var_cvs[var].wait(lk);
-        }
+        /**
+         * Flush the connections in `flush_list`. Only called from `t`.
+         *
+         * @param t The I/O thread.
+         */
+        void flush_connections(IoThread &t);
 
         /**
-         * Waits for `rel_time` or until `var` is changed.
+         * Handle all messages that are ready on a connection.
          *
-         * @param var Name of the variable.
-         * @param rel_time Maximum duration to wait in the same style as
-         *                 `std::condition_variable::wait_for`.
+         * @param c The connection.
+         */
+        void handle_input(Connection *c);
+
+        /**
+         * Loop run by an I/O thread.
          *
-         * @return Whether the variable was changed.
+         * @param t The I/O thread.
          */
-        template <class Rep, class Period>
-        bool wait_for(std::string var, const std::chrono::duration<Rep, Period> &rel_time)
-        {
-            std::unique_lock lk(var_locks[var]);
+        void io_loop(IoThread &t);
 
-            check_var_exists(var);
+        /**
+         * Loop run by an I/O thread when it uses `uring`.
+         *
+         * @param t The I/O thread.
+         */
+        void uring_loop(IoThread &t);
 
-            // Tell the owner that we are interested in this variable.
-            if (vars[var].owner != self && interested_vars.find(var) == interested_vars.end())
-            {
-                if (send_interest(vars[var].owner_socket, var) < 0)
-                {
-                    throw std::runtime_error("Owner of '" + var + "', '" + vars[var].owner + "', is no longer connected.");
-                }
-                interested_vars.insert(var);
-            }
+        /**
+         * Handle a completed `uring` request.
+         *
+         * @param t The I/O thread.
+         * @param data What the request was for.
+         * @param result Result of the request.
+         * @param more Whether the request will complete again.
+         * @param buffer Receive buffer holding the data, or -1.
+         */
+        void uring_complete(IoThread &t, uint64_t data, int result, bool more, int buffer);
 
-            return var_cvs[var].wait_for(lk, rel_time) == std::cv_status::no_timeout;
-        }
+        /**
+         * Send the first messages queued on a connection through `uring`,
+         * unless some are being sent already.
+         *
+         * @param c The connection.
+         * @return 0 on success, -1 on failure.
+         */
+        int uring_send(Connection *c);
 
         /**
-         * Returns when `var` was last updated.
+         * Handle data received on a connection.
+         *
+         * @param c The connection.
+         * @param data The data.
+         * @param size Size of the data.
          */
-        std::chrono::time_point<std::chrono::system_clock> last_updated(std::string var)
-        {
-            std::unique_lock lk(var_locks[var]);
+        void handle_data(Connection *c, const char *data, size_t size);
 
-            check_var_exists(var);
+        /**
+         * Drop the messages that have been sent completely from the queue of
+         * a connection. `tx_m` must be held.
+         *
+         * @param c The connection.
+         * @param bytes Bytes sent since the last call.
+         */
+        void consume_sent(Connection *c, size_t bytes);
 
-            return vars[var].last_updated;
-        }
+        /**
+         * Make an I/O thread look at `flush_list` and `arm_list`.
+         *
+         * @param t The I/O thread.
+         */
+        void wake_io_thread(IoThread &t);
 
-    private:
         /**
-         * Self program name.
+         * Prepare messages carrying the current value of a variable, and
+         * publish it to shared memory if a subscriber that it is `due` for
+         * reads it from there. `subscriber_list_m` must be held.
+         *
+         * @param index Index of the variable.
+         * @param raw Set to a message carrying the data.
+         * @param shm Set to a message naming the shared memory segment.
          */
-        std::string self;
+        void prepare_update(size_t index, Outgoing &raw, Outgoing &shm);
 
         /**
-         * Whether the `recv_thread` is running.
+         * Get the message of an update for a subscriber.
+         *
+         * @param sub The subscriber.
+         * @param raw Message carrying the data, from `prepare_update`.
+         * @param shm Message naming the shared memory segment.
+         * @return The message.
          */
-        std::atomic<bool> recv_thread_running;
+        static Outgoing update_for(const Subscriber &sub, const Outgoing &raw, const Outgoing &shm);
 
         /**
-         * Whether the `accept_thread` is running.
+         * Decide whether a new update goes to a subscriber, is held back by
+         * its rate limit, or is dropped by its deadband, and set `sub.due`
+         * accordingly. `subscriber_list_m` must be held.
+         *
+         * @param sub The subscriber.
+         * @param v The variable.
+         * @param value The new value, if `sub` has a deadband.
+         * @param size Size of the new value in bytes.
+         * @param now The time of the update.
+         * @return Whether the update goes to the subscriber.
          */
-        std::atomic<bool> accept_thread_running;
+        bool admit(Subscriber &sub, const Variable &v, const std::shared_ptr<const Buffer> &value, size_t size,
+                   std::chrono::steady_clock::time_point now);
 
         /**
-         * Whether the `identification_thread` is running.
+         * Check if a value of a variable is outside the deadband of a
+         * subscriber around the value last sent to it.
+         *
+         * @param sub The subscriber.
+         * @param v The variable.
+         * @param value The value.
+         * @param size Size of the value in bytes.
+         * @return Whether the value is to be sent.
          */
-        std::atomic<bool> identification_thread_running;
+        static bool moved(const Subscriber &sub, const Variable &v, const std::shared_ptr<const Buffer> &value, size_t size);
 
         /**
-         * Thread for receiving data from other programs.
+         * Get the current value of a variable, if a subscriber to it has a
+         * deadband to compare it with. `subscriber_list_m` must be held.
+         *
+         * @param index Index of the variable.
+         * @param value Set to the value, or left empty.
+         * @param size Set to the size of the value in bytes.
          */
-        std::thread recv_thread;
+        void deadband_value(size_t index, std::shared_ptr<const Buffer> &value, size_t &size);
 
         /**
-         * Thread for accepting new connections.
+         * Record the value sent to the subscribers with a deadband that an
+         * update was `due` for. `subscriber_list_m` must be held.
+         *
+         * @param index Index of the variable.
+         * @param raw The update, from `prepare_update`.
          */
-        std::thread accept_thread;
+        void mark_sent(size_t index, const Outgoing &raw);
 
         /**
-         * Thread for identifying other programs.
+         * Have the first I/O thread call `send_trailing` by `when`.
          */
-        std::thread identification_thread;
+        void schedule_trailing(std::chrono::steady_clock::time_point when);
 
         /**
-         * Set of variables that this program is interested in.
+         * Send the updates held back by rate limits whose time has come.
          */
-        std::unordered_set<std::string> interested_vars;
+        void send_trailing();
 
         /**
-         * Socket for the server.
+         * Returns how long the first I/O thread may wait before it has to
+         * call `send_trailing`, in milliseconds, or -1 for no limit.
          */
-        int server_socket;
+        int trailing_timeout();
 
         /**
-         * File descriptors for waking up the threads.
+         * Time in nanoseconds of `std::chrono::steady_clock` by which
+         * `send_trailing` must be called, or `INT64_MAX`.
          */
-        int recv_wakeup_fd;
-        int identification_wakeup_fd;
+        std::atomic<int64_t> trailing_deadline{INT64_MAX};
 
         /**
-         * Mutex for the `recv_socket_list` list.
+         * Queue the current value of a variable for all of its subscribers.
+         *
+         * @param index Index of the variable.
+         * @param only If not null, the only subscriber to send it to.
          */
-        std::mutex socket_list_m;
-        std::vector<int> recv_socket_list;
+        void notify_subscribers(size_t index, Connection *only = nullptr);
 
         /**
-         * Mutex for the `client_socket_list` list.
+         * Queue the current values of several variables for their
+         * subscribers, in a single message for each subscriber.
+         *
+         * @param indices Indices of the variables.
          */
-        std::mutex client_socket_list_m;
-        std::vector<int> client_socket_list;
+        void notify_subscribers(const std::vector<size_t> &indices);
 
         /**
-         * Mutex for the `subscriber_list` list.
+         * Find a variable in the variable table.
+         *
+         * @param var Name of the variable.
+         * @return Index of the variable.
          */
-        std::mutex subscriber_list_m;
-        std::unordered_map<std::string, std::vector<int>> subscriber_list;
+        size_t find_var(std::string_view var);
 
         /**
-         * Enumerates the types of variables.
+         * Get the index of the variable of a handle, checking that the handle
+         * was made for the variables of this `State`.
+         *
+         * @param var Handle of the variable.
+         * @return Index of the variable.
          */
-        enum Type : uint8_t
+        template <typename T>
+        size_t index_of(const VarHandle<T> &var) const
         {
-            INT8,
-            INT16,
-            INT32,
-            INT64,
-            UINT8,
-            UINT16,
-            UINT32,
-            UINT64,
-            FLOAT,
-            DOUBLE,
-            STRING,
-        };
+            if (var.schema != schema)
+            {
+                throw std::runtime_error("Invalid variable handle.");
+            }
+            return var.index;
+        }
 
         /**
-         * Get the size of a type.
+         * Get the variable table entry for an index.
          *
-         * @param type Type of variable.
-         * @return Size of the type.
+         * @param index Index of the variable.
+         * @return The table entry.
          */
-        size_t type_size(Type type);
+        Slot &slot(size_t index)
+        {
+            if (index >= var_table.size())
+            {
+                throw std::runtime_error("Invalid variable handle.");
+            }
+            return var_table[index];
+        }
 
         /**
-         * Maps a string to a `Type` enum.
+         * Check if the owner of a variable is known.
+         *
+         * @param s Table entry of the variable.
          */
-        std::unordered_map<std::string, Type> type_map = {
-            {"INT8", INT8},
-            {"INT16", INT16},
-            {"INT32", INT32},
-            {"INT64", INT64},
-            {"UINT8", UINT8},
-            {"UINT16", UINT16},
-            {"UINT32", UINT32},
-            {"UINT64", UINT64},
-            {"FLOAT", FLOAT},
-            {"DOUBLE", DOUBLE},
-            {"STRING", STRING},
-        };
+        void check_owner(const Slot &s);
 
         /**
-         * Structure for storing a variable.
+         * Check that the owner of a variable did not refuse to send it.
+         *
+         * @param s Table entry of the variable.
          */
-        struct Variable
-        {
-            Type type;
-            bool is_array;
-            int size; // If `is_array`, then the number of elements in the array.
-            std::string owner;
-            int owner_socket;
-            void *data;
-            std::chrono::time_point<std::chrono::system_clock> last_updated;
-        };
+        void check_rejected(const Slot &s);
 
         /**
-         * Variable condition variables and locks.
+         * Tell the owner of a variable that we are interested in it, if we
+         * have not done so already. `s.lock` must be held.
+         *
+         * @param s Table entry of the variable.
+         * @return Whether an interest message was sent.
          */
-        std::unordered_map<std::string, std::condition_variable> var_cvs;
-        std::unordered_map<std::string, std::mutex> var_locks;
+        bool register_interest(Slot &s);
 
         /**
-         * Map of variables.
+         * Subscribe to a variable with the given options.
+         *
+         * @param index Index of the variable.
+         * @param options How the owner should send updates.
          */
-        std::unordered_map<std::string, Variable> vars;
+        void subscribe_slot(size_t index, const Subscription &options);
 
         /**
-         * Create a variable.
+         * Set the change handler of a variable.
          *
-         * @param var Name of the variable.
-         * @param type Type of the variable.
-         * @param owner Name of the program that owns the variable.
-         * @param is_array Whether the variable is an array.
+         * @param index Index of the variable.
+         * @param handler Function to call, or empty to remove the handler.
          */
-        void create_var(std::string var, Type type, std::string owner, bool is_array);
+        void on_change_slot(size_t index, std::function<void()> handler);
 
         /**
-         * Receive a message from a socket.
+         * Returns how the change handler of a variable has been called so far.
          *
-         * @param socket Socket to receive from.
-         * @return 0 on success, -1 on failure.
+         * @param index Index of the variable.
          */
-        int recv_message(int socket);
+        HandlerStats handler_stats_slot(size_t index);
 
         /**
-         * Send a message to a socket.
+         * Waits indefinitely until a variable is changed.
          *
-         * @param socket Socket to send to.
-         * @param var Name of the variable.
-         * @return 0 on success, -1 on failure.
+         * @param index Index of the variable.
          */
-        int send_message(int socket, std::string var);
+        void wait_slot(size_t index);
 
         /**
-         * Receive an interest message from a socket.
+         * Waits for `rel_time` or until a variable is changed.
          *
-         * @param socket Socket to receive from.
-         * @return 0 on success, -1 on failure.
+         * @param index Index of the variable.
+         * @param rel_time Maximum duration to wait.
+         * @return Whether the variable was changed.
          */
-        int recv_interest(int socket);
+        template <class Rep, class Period>
+        bool wait_for_slot(size_t index, const std::chrono::duration<Rep, Period> &rel_time)
+        {
+            Slot &s = slot(index);
+            std::unique_lock lk(s.lock);
+
+            register_interest(s);
+
+            uint64_t version = s.var.version;
+            bool received = s.var.received;
+            return s.cv.wait_for(lk, rel_time, [&] { return s.var.version != version || s.var.received != received; });
+        }
 
         /**
-         * Send an interest message to a socket.
+         * Waits until `deadline` or until the version of a variable is
+         * greater than `version`.
          *
-         * @param socket Socket to send to.
-         * @param var Name of the variable.
-         * @return 0 on success, -1 on failure.
+         * @param index Index of the variable.
+         * @param version Version of the value last seen.
+         * @param deadline Time at which to give up.
+         * @return The version now.
          */
-        int send_interest(int socket, std::string var);
+        uint64_t wait_newer_than_slot(size_t index, uint64_t version, std::chrono::steady_clock::time_point deadline);
 
         /**
-         * Send a request to update a variable.
+         * Find the variables of `wait_any` or `wait_all`.
          *
-         * @param socket Socket to send to.
-         * @param var Name of the variable.
-         * @param data New data.
-         * @param data_size Size of the new data.
-         * @return 0 on success, -1 on failure.
+         * @param vars Names or handles of the variables.
+         * @return Their indices.
+         */
+        std::vector<size_t> resolve(const std::vector<VarRef> &vars);
+
+        /**
+         * Returns the time point of `std::chrono::steady_clock` that is
+         * `rel_time` from now.
          */
-        int request_update(int socket, std::string var, void *data, int data_size);
+        template <class Rep, class Period>
+        static std::chrono::steady_clock::time_point deadline_after(const std::chrono::duration<Rep, Period> &rel_time)
+        {
+            return std::chrono::steady_clock::now() + std::chrono::ceil<std::chrono::steady_clock::duration>(rel_time);
+        }
 
         /**
-         * Accept a connection.
+         * Waits until `deadline` or until any, or each, of several variables
+         * is changed, registering a single `Waiter` with all of them.
          *
-         * @return 0 on success, -1 on failure.
+         * @param indices Indices of the variables.
+         * @param all Whether to wait for each of them rather than any.
+         * @param deadline Time at which to give up.
+         * @return Positions in `indices` of the variables that changed.
          */
-        int accept_connection();
+        std::vector<size_t> wait_slots(const std::vector<size_t> &indices, bool all,
+                                       std::chrono::steady_clock::time_point deadline);
 
         /**
-         * Wake up a thread.
+         * Returns when a variable was last updated.
          *
-         * @param m Mutex to lock.
-         * @param fd File descriptor to write to.
-         * @param action Action to perform after writing to the file descriptor.
+         * @param index Index of the variable.
          */
-        void wakeup_thread(std::mutex &m, int fd, std::function<void()> action);
+        std::chrono::time_point<std::chrono::system_clock> last_updated_slot(size_t index);
 
         /**
-         * Receive loop for the server.
+         * Returns how the buffers of a variable have been obtained so far.
+         *
+         * @param index Index of the variable.
          */
-        void recv_loop();
+        BufferStats buffer_stats_slot(size_t index);
 
         /**
-         * Accept loop for the server.
+         * Read the value of a variable. `s.lock` must be held.
+         *
+         * @tparam T Type of the variable.
+         * @param s Table entry of the variable.
+         * @param ret_value Where to store the value.
          */
-        void accept_loop();
+        template <typename T>
+        void read_value(Slot &s, T &ret_value)
+        {
+            if constexpr (is_vector<T>::value)
+            {
+                using E = typename T::value_type;
+                ret_value.assign(static_cast<E *>(s.var.data->bytes), static_cast<E *>(s.var.data->bytes) + s.var.size);
+            }
+            else if constexpr (std::is_same_v<T, std::string>)
+            {
+                ret_value.assign(static_cast<char *>(s.var.data->bytes), s.var.size);
+            }
+            else if constexpr (is_tensor<T>::value)
+            {
+                ret_value = T();
+                if (s.var.size > 0)
+                {
+                    ret_value.buffer = std::make_shared<Buffer>(s.var.size);
+                    memcpy(ret_value.buffer->bytes, s.var.data->bytes, s.var.size);
+                }
+            }
+            else
+            {
+                memcpy(&ret_value, s.var.data->bytes, sizeof(T));
+                if (s.var.scalar)
+                {
+                    s.var.scalar->readable.store(true, std::memory_order_release);
+                }
+            }
+        }
 
         /**
-         * Identification loop for the server.
+         * Tell the owner of a variable that we are interested in it, if we
+         * have not done so already, and wait for the value that it sends in
+         * reply. `s.lock` must be held, by `lk`.
+         *
+         * @param s Table entry of the variable.
+         * @param lk Lock of `s.lock`.
          */
-        void identification_loop();
+        void wait_first_value(Slot &s, std::unique_lock<std::mutex> &lk)
+        {
+            // The first value may be the one the owner never set, of version
+            // 0, so wait for it to arrive rather than for a version change.
+            register_interest(s);
+            s.cv.wait(lk, [&] { return s.owned || s.var.received || s.rejected; });
+            check_rejected(s);
+        }
 
         /**
-         * Send a message to all subscribers of a variable.
+         * Describe the data of a value of a variable.
          *
-         * @param var Name of the variable.
+         * @tparam T Type of the variable.
+         * @param value The value.
+         * @param data Set to the start of the data.
+         * @param data_size Set to the size of the data.
+         * @param count Set to the number of elements in the data.
          */
-        void notify_subscribers(std::string var);
+        template <typename T>
+        static void describe(const T &value, const void *&data, int &data_size, int &count)
+        {
+            if constexpr (is_vector<T>::value)
+            {
+                data = value.data();
+                count = value.size();
+                data_size = value.size() * sizeof(typename T::value_type);
+            }
+            else if constexpr (std::is_same_v<T, std::string>)
+            {
+                data = value.data();
+                count = value.size();
+                data_size = value.size();
+            }
+            else if constexpr (is_tensor<T>::value)
+            {
+                data = value.buffer ? value.buffer->bytes : nullptr;
+                data_size = value.buffer ? sizeof(TensorHeader) + value.size() : 0;
+                count = data_size;
+            }
+            else
+            {
+                data = &value;
+                count = 1;
+                data_size = sizeof(T);
+            }
+        }
 
         /**
-         * Check if a variable exists.
+         * Check if a variable in the table is of the correct type.
          *
-         * @param var Name of the variable.
+         * @tparam T Type to check for.
+         * @param state The state.
+         * @param index Index of the variable.
          */
-        void check_var_exists(std::string var);
+        template <typename T>
+        static void check_slot_type(State &state, size_t index)
+        {
+            Slot &s = state.var_table[index];
+            if constexpr (std::is_same_v<T, std::string>)
+            {
+                state.check_var_type<std::vector<char>>(s.name, s.var);
+            }
+            else
+            {
+                state.check_var_type<T>(s.name, s.var);
+            }
+        }
 
         /**
-         * Check if a variable exists and is of the correct type.
+         * Check if a variable is of the correct type.
          *
          * @tparam T Type to check for.
          * @param var Name of the variable.
+         * @param v The variable.
          */
         template <typename T>
-        void check_var_type(std::string var)
+        void check_var_type(const std::string &var, const Variable &v)
         {
-            check_var_exists(var);
-
-            Variable v = vars[var];
-
             switch (v.type)
             {
             case INT8:
@@ -658,6 +2878,30 @@ namespace dsml
                 if (!std::is_same_v<T, std::vector<char>>)
                     throw std::runtime_error("Variable '" + var + "' is of type std::string.");
                 break;
+            case TENSOR:
+                if constexpr (is_tensor<T>::value)
+                {
+                    if (tensor_dtype<typename T::value_type>() == v.element_type)
+                        break;
+                }
+                throw std::runtime_error("Variable '" + var + "' is a dsml::Tensor of another type.");
+            case STRUCT:
+                if (v.is_array)
+                {
+                    if constexpr (is_vector<T>::value)
+                    {
+                        using E = typename T::value_type;
+                        if (std::is_trivially_copyable_v<E> && !std::is_arithmetic_v<E> && sizeof(E) == v.element_size)
+                            break;
+                    }
+                    throw std::runtime_error("Variable '" + var + "' is a std::vector of a struct of " + std::to_string(v.element_size) + " bytes.");
+                }
+                else
+                {
+                    if (!std::is_trivially_copyable_v<T> || std::is_arithmetic_v<T> || is_vector<T>::value || sizeof(T) != v.element_size)
+                        throw std::runtime_error("Variable '" + var + "' is a struct of " + std::to_string(v.element_size) + " bytes.");
+                }
+                break;
             default:
                 break;
             }
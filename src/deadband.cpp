@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+#include "deadband.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define DEADBAND_X86
+    #define AVX __attribute__((target("avx")))
+#endif
+
+using namespace dsml;
+
+#ifdef DEADBAND_X86
+
+static bool has_avx()
+{
+    static const bool supported = __builtin_cpu_supports("avx");
+    return supported;
+}
+
+// Each returns how many values it checked, and stops early at a vector of
+// them in which one has moved.
+
+AVX static size_t moved_avx(const float *values, const float *sent, size_t count, double absolute, double relative, bool &any)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 va = _mm256_set1_ps(absolute);
+    const __m256 vr = _mm256_set1_ps(relative);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 old = _mm256_loadu_ps(sent + i);
+        __m256 diff = _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(values + i), old));
+        __m256 threshold = _mm256_max_ps(va, _mm256_mul_ps(vr, _mm256_andnot_ps(sign, old)));
+        if (_mm256_movemask_ps(_mm256_cmp_ps(diff, threshold, _CMP_NLE_UQ)))
+        {
+            any = true;
+            break;
+        }
+    }
+    return i;
+}
+
+AVX static size_t moved_avx(const double *values, const double *sent, size_t count, double absolute, double relative, bool &any)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d va = _mm256_set1_pd(absolute);
+    const __m256d vr = _mm256_set1_pd(relative);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d old = _mm256_loadu_pd(sent + i);
+        __m256d diff = _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(values + i), old));
+        __m256d threshold = _mm256_max_pd(va, _mm256_mul_pd(vr, _mm256_andnot_pd(sign, old)));
+        if (_mm256_movemask_pd(_mm256_cmp_pd(diff, threshold, _CMP_NLE_UQ)))
+        {
+            any = true;
+            break;
+        }
+    }
+    return i;
+}
+
+#endif
+
+// Portable version, which also finishes off what does not fill a vector.
+
+template <typename T>
+bool deadband::moved(const T *values, const T *sent, size_t count, double absolute, double relative)
+{
+    size_t i = 0;
+#ifdef DEADBAND_X86
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        bool any = false;
+        if (has_avx())
+        {
+            i = moved_avx(values, sent, count, absolute, relative, any);
+        }
+        if (any)
+        {
+            return true;
+        }
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        double diff = std::fabs((double)values[i] - (double)sent[i]);
+        if (!(diff <= std::max(absolute, relative * std::fabs((double)sent[i]))))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+template bool deadband::moved(const int8_t *, const int8_t *, size_t, double, double);
+template bool deadband::moved(const int16_t *, const int16_t *, size_t, double, double);
+template bool deadband::moved(const int32_t *, const int32_t *, size_t, double, double);
+template bool deadband::moved(const int64_t *, const int64_t *, size_t, double, double);
+template bool deadband::moved(const uint8_t *, const uint8_t *, size_t, double, double);
+template bool deadband::moved(const uint16_t *, const uint16_t *, size_t, double, double);
+template bool deadband::moved(const uint32_t *, const uint32_t *, size_t, double, double);
+template bool deadband::moved(const uint64_t *, const uint64_t *, size_t, double, double);
+template bool deadband::moved(const float *, const float *, size_t, double, double);
+template bool deadband::moved(const double *, const double *, size_t, double, double);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+
+namespace dsml
+{
+    /**
+     * Comparison of numeric values against the values last sent, for
+     * subscriptions with a deadband. It uses AVX when the processor has it.
+     */
+    namespace deadband
+    {
+        /**
+         * Check if any value differs from the one sent before it by more than
+         * the larger of `absolute` and `relative` times the magnitude of the
+         * one sent. A value that is or was not a number always counts.
+         *
+         * @tparam T Type of the values, which is an arithmetic type.
+         * @param values Values to check.
+         * @param sent Values last sent.
+         * @param count Number of values.
+         * @param absolute Largest difference that is ignored.
+         * @param relative Largest difference that is ignored, relative to the
+         *                 value sent.
+         * @return Whether any value has moved.
+         */
+        template <typename T>
+        bool moved(const T *values, const T *sent, size_t count, double absolute, double relative);
+    }
+}
@@ -1,25 +1,126 @@
+#include <cfloat>
+#include <cmath>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <unordered_set>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <dsml.hpp>
 
-// MAC and Linux have different names for telling the OS that you have more
-// data to send.
-#ifdef __linux__
-    #define MSG_HAVEMORE MSG_MORE
-#endif
+#include "deadband.hpp"
+#include "lz.hpp"
+#include "perfect_hash.hpp"
+#include "quantize.hpp"
+#include "reactor.hpp"
+#include "shm.hpp"
+#include "uring.hpp"
 
 using namespace dsml;
 
-State::State(std::string config, std::string program_name, int port) : self(program_name)
+// Initial size of the receive buffer of a connection. It grows to fit the
+// largest message received.
+#define CONNECTION_BUFFER_SIZE 65536
+
+// Most queued messages, and parts of them, that are gathered into a single
+// `sendmsg`.
+#define FLUSH_BATCH 64
+#define FLUSH_IOV (4 * FLUSH_BATCH)
+
+// Granularity at which delta encoding compares values. Unchanged blocks are
+// left out, and neighbouring changed ones are sent as a single run.
+#define DELTA_BLOCK 64
+
+// Requests that may be queued on `uring` at once.
+#define URING_ENTRIES 256
+
+// What a `uring` request is for, kept in the low bits of its data next to the
+// connection, or `server_socket`, that it is on.
+#define URING_RECV 0
+#define URING_SEND 1
+#define URING_ACCEPT 2
+#define URING_OP_MASK 3
+
+// Smallest update of a variable with the `compress` option that is compressed.
+// Below this the saving does not make up for the work.
+#define COMPRESS_THRESHOLD 4096
+
+// Source of `State::instance`.
+static std::atomic<unsigned> instance_count = 0;
+
+// The `State::IoThread` that the calling thread is, if any.
+static thread_local const void *current_io_thread = nullptr;
+
+/**
+ * Check whether both ends of a socket are on the same host.
+ *
+ * @param socket The socket.
+ * @return Whether the peer is on this host.
+ */
+static bool same_host(int socket)
+{
+    struct sockaddr_storage local, peer;
+    socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+
+    if (getsockname(socket, (struct sockaddr *)&local, &local_len) < 0 ||
+        getpeername(socket, (struct sockaddr *)&peer, &peer_len) < 0 ||
+        local.ss_family != peer.ss_family)
+    {
+        return false;
+    }
+
+    switch (local.ss_family)
+    {
+    case AF_INET:
+        return ((struct sockaddr_in *)&local)->sin_addr.s_addr == ((struct sockaddr_in *)&peer)->sin_addr.s_addr;
+    case AF_INET6:
+        return memcmp(&((struct sockaddr_in6 *)&local)->sin6_addr, &((struct sockaddr_in6 *)&peer)->sin6_addr, sizeof(struct in6_addr)) == 0;
+    case AF_UNIX:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Describe the other end of a socket.
+ *
+ * @param socket The socket.
+ * @return Address of the peer, as "ip:port".
+ */
+static std::string peer_address(int socket)
+{
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(socket, (struct sockaddr *)&peer, &peer_len) < 0)
+    {
+        return "";
+    }
+
+    char host[INET6_ADDRSTRLEN];
+    switch (peer.ss_family)
+    {
+    case AF_INET:
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&peer)->sin_addr, host, sizeof(host));
+        return std::string(host) + ":" + std::to_string(ntohs(((struct sockaddr_in *)&peer)->sin_port));
+    case AF_INET6:
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&peer)->sin6_addr, host, sizeof(host));
+        return "[" + std::string(host) + "]:" + std::to_string(ntohs(((struct sockaddr_in6 *)&peer)->sin6_port));
+    default:
+        return "local";
+    }
+}
+
+State::State(std::string config, std::string program_name, int port, IoBackend backend, unsigned io_threads,
+             unsigned handler_threads)
+    : self(program_name), instance(instance_count++), handler_thread_count(handler_threads)
 {
     // Check if configuration file exists.
     if (!std::filesystem::exists(config))
@@ -27,7 +128,12 @@ State::State(std::string config, std::string program_name, int port) : self(prog
         throw std::runtime_error("Configuration file does not exist.");
     }
 
-    bool needs_socket = false, needs_recv = false;
+    bool needs_socket = false;
+
+    // Collect the variables first, so that the table can be created at its
+    // final size.
+    std::vector<Definition> definitions;
+    std::unordered_set<std::string> names;
 
     std::ifstream config_file(config);
     std::string line;
@@ -43,7 +149,7 @@ State::State(std::string config, std::string program_name, int port) : self(prog
 
         // Parse line.
         std::istringstream iss(line);
-        std::string var, type, owner, is_array;
+        std::string var, type, owner, is_array, options;
 
         if (!(iss >> var >> type >> owner >> is_array))
         {
@@ -53,51 +159,99 @@ State::State(std::string config, std::string program_name, int port) : self(prog
         {
             throw std::runtime_error("Invalid array specification in configuration file on line " + std::to_string(i));
         }
-        if (type_map.find(type) == type_map.end())
+        bool is_struct = type.rfind("STRUCT{", 0) == 0;
+        bool is_tensor = type.rfind("TENSOR{", 0) == 0;
+        if (!is_struct && !is_tensor && type_map.find(type) == type_map.end())
         {
             throw std::runtime_error("Invalid type in configuration file on line " + std::to_string(i));
         }
+        iss >> options;
 
         if (owner == self)
         {
             needs_socket = true;
         }
-        else
+
+        if (!names.insert(var).second)
         {
-            needs_recv = true;
+            throw std::runtime_error("Invalid line in configuration file. Variable '" + var + "' is defined twice.");
         }
 
-        create_var(var, type_map[type], owner, is_array == "true");
+        Definition d{var, is_struct ? STRUCT : is_tensor ? TENSOR : type_map[type], type, owner, is_array == "true", parse_options(options, i)};
+        if (is_struct)
+        {
+            parse_struct(type, i, d);
+        }
+        if (is_tensor)
+        {
+            // The type of the elements is given between the braces.
+            auto it = type_map.find(type.substr(strlen("TENSOR{"), type.size() - strlen("TENSOR{}")));
+            if (type.back() != '}' || it == type_map.end() || it->second == STRING)
+            {
+                throw std::runtime_error("Invalid type in configuration file on line " + std::to_string(i));
+            }
+            d.element_type = it->second;
+        }
+        definitions.push_back(std::move(d));
         ++i;
     }
 
-    // Create wakeup pipes.
-    int pipefd[2];
-    if (pipe(pipefd) < 0)
+    var_table = std::vector<Slot>(definitions.size());
+    subscriber_list.resize(definitions.size());
+    std::vector<std::string> keys;
+    std::string fingerprinted;
+    for (size_t k = 0; k < definitions.size(); ++k)
     {
-        perror("pipe()");
-        throw std::runtime_error("Failed to create wakeup pipe.");
+        Definition &d = definitions[k];
+        create_var(var_table[k], d);
+        keys.push_back(d.var);
+        fingerprinted += d.var + " " + d.type_name + " " + d.owner + " " + (d.is_array ? "true" : "false") + "\n";
     }
+    var_index = std::make_unique<PerfectHash>(std::move(keys));
+    schema = schema_fingerprint(fingerprinted.c_str());
 
-    recv_socket_list.push_back(pipefd[0]);
-    recv_wakeup_fd = pipefd[1];
-    if (pipe(pipefd) < 0)
+    if (io_threads == 0)
     {
-        perror("pipe()");
-        throw std::runtime_error("Failed to create wakeup pipe.");
+        throw std::runtime_error("Need at least one I/O thread.");
     }
-
-    client_socket_list.push_back(pipefd[0]);
-    identification_wakeup_fd = pipefd[1];
-    server_socket = -1;
-
-    // Handle `needs_recv`.
-    if (needs_recv)
+    if (handler_threads == 0)
     {
-        recv_thread_running = true;
-        recv_thread = std::thread(&State::recv_loop, this);
-        recv_thread.detach();
+        throw std::runtime_error("Need at least one handler thread.");
     }
+    for (unsigned i = 0; i < io_threads; ++i)
+    {
+        this->io_threads.push_back(std::make_unique<IoThread>());
+    }
+    // Every thread uses the same backend, so if any ring can't be set up,
+    // those already set up are torn down and all threads use the reactor.
+    if (backend == IO_URING)
+    {
+        try
+        {
+            for (auto &t : this->io_threads)
+            {
+                t->uring = std::make_unique<Uring>(URING_ENTRIES);
+            }
+        }
+        catch (const std::runtime_error &e)
+        {
+            std::cerr << e.what() << " Using the reactor instead." << std::endl;
+            for (auto &t : this->io_threads)
+            {
+                t->uring.reset();
+            }
+            backend = IO_REACTOR;
+        }
+    }
+    if (backend == IO_REACTOR)
+    {
+        for (auto &t : this->io_threads)
+        {
+            t->reactor = std::make_unique<Reactor>();
+        }
+    }
+    IoThread &acceptor = *this->io_threads[0];
+    server_socket = -1;
 
     // Handle `needs_socket`.
     if (needs_socket)
@@ -131,587 +285,2953 @@ State::State(std::string config, std::string program_name, int port) : self(prog
             throw std::runtime_error("Could not bind socket.");
         }
 
-        ret = listen(server_socket, 5);
+        ret = listen(server_socket, SOMAXCONN);
         if (ret < 0)
         {
             perror("listen()");
             throw std::runtime_error("Could not listen on socket.");
         }
 
-        accept_thread_running = true;
-        accept_thread = std::thread(&State::accept_loop, this);
-        accept_thread.detach();
+        // Connections are accepted by the first I/O thread until none are
+        // pending, so the socket must not block once they run out.
+        bool watched = acceptor.uring ? acceptor.uring->poll(server_socket, (uint64_t)&server_socket | URING_ACCEPT) == 0
+                                      : acceptor.reactor->add(server_socket, &server_socket) == 0;
+        if (fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK) < 0 || !watched)
+        {
+            throw std::runtime_error("Could not watch socket.");
+        }
+    }
 
-        identification_thread_running = true;
-        identification_thread = std::thread(&State::identification_loop, this);
-        identification_thread.detach();
+    io_thread_running = true;
+    for (auto &t : this->io_threads)
+    {
+        t->thread = std::thread(t->uring ? &State::uring_loop : &State::io_loop, this, std::ref(*t));
     }
 }
 
-void State::recv_loop()
+void State::io_loop(IoThread &t)
 {
-    while (recv_thread_running)
-    {
-        std::unique_lock lk(socket_list_m);
+    current_io_thread = &t;
+    Reactor::Event events[64];
 
-        // Set up poll structures.
-        pollfd pfds[recv_socket_list.size()];
-        for (int i = 0; i < recv_socket_list.size(); ++i)
+    while (io_thread_running)
+    {
+        // The first thread also sends the updates held back by rate limits.
+        bool first = &t == io_threads[0].get();
+        int n = t.reactor->wait(events, 64, first ? trailing_timeout() : -1);
+        if (n < 0)
         {
-            pfds[i].fd = recv_socket_list[i];
-            pfds[i].events = POLLIN;
+            perror("Reactor::wait()");
+            return;
         }
 
-        int ret = poll(pfds, recv_socket_list.size(), -1);
-
-        for (int i = 0; i < recv_socket_list.size(); ++i)
+        for (int i = 0; i < n; ++i)
         {
-            if (pfds[i].revents & POLLIN)
+            if (events[i].data == &server_socket)
             {
-                if (i == 0)
-                {
-                    char buf[1];
-                    read(pfds[i].fd, buf, 1);
-                }
-                else
-                {
-                    if (recv_message(pfds[i].fd) < 0)
-                    {
-                        close(pfds[i].fd);
-                        recv_socket_list.erase(recv_socket_list.begin() + i);
-                    }
-                }
+                accept_connections();
+                continue;
+            }
+
+            Connection *c = static_cast<Connection *>(events[i].data);
+            if (events[i].readable && !c->closed)
+            {
+                handle_input(c);
+            }
+            if (events[i].writable && !c->closed && flush_connection(c) < 0)
+            {
+                close_connection(c);
             }
         }
-    }
-}
 
-void State::accept_loop()
-{
-    while (accept_thread_running)
-    {
-        accept_connection();
+        if (first)
+        {
+            send_trailing();
+        }
+        flush_connections(t);
+        reap_connections(t);
     }
+
+    // Hand what has been queued to the kernel before the sockets are closed.
+    flush_connections(t);
+    reap_connections(t);
 }
 
-void State::identification_loop()
+void State::uring_loop(IoThread &t)
 {
-    while (identification_thread_running)
-    {
-        std::unique_lock lk(client_socket_list_m);
+    current_io_thread = &t;
+    Uring &uring = *t.uring;
+    Uring::Completion completions[64];
 
-        // Set up poll structures.
-        pollfd pfds[client_socket_list.size()];
-        for (int i = 0; i < client_socket_list.size(); ++i)
+    while (io_thread_running)
+    {
+        // Start receiving on new connections, and sending what was queued.
+        std::vector<Connection *> added;
+        {
+            std::unique_lock lk(t.flush_m);
+            added.swap(t.arm_list);
+        }
+        for (Connection *c : added)
         {
-            pfds[i].fd = client_socket_list[i];
-            pfds[i].events = POLLIN;
+            if (uring.recv(c->socket, (uint64_t)c | URING_RECV) < 0)
+            {
+                close_connection(c);
+                continue;
+            }
+            ++c->uring_requests;
         }
+        flush_connections(t);
 
-        int ret = poll(pfds, client_socket_list.size(), -1);
+        // Hand all of that to the kernel at once, and wait for something to
+        // happen. The first thread also sends the updates held back by rate
+        // limits.
+        bool first = &t == io_threads[0].get();
+        if (uring.submit(1, first ? trailing_timeout() : -1) < 0)
+        {
+            return;
+        }
 
-        for (int i = 0; i < client_socket_list.size(); ++i)
+        int n;
+        while ((n = uring.complete(completions, 64)) > 0)
         {
-            if (pfds[i].revents & POLLIN)
+            for (int i = 0; i < n; ++i)
             {
-                if (i == 0)
-                {
-                    char buf[1];
-                    read(pfds[i].fd, buf, 1);
-                }
-                else
-                {
-                    if (recv_interest(pfds[i].fd) < 0)
-                    {
-                        close(pfds[i].fd);
-                        client_socket_list.erase(client_socket_list.begin() + i);
-                    }
-                }
+                uring_complete(t, completions[i].data, completions[i].result, completions[i].more, completions[i].buffer);
             }
         }
+
+        if (first)
+        {
+            send_trailing();
+        }
+        reap_connections(t);
     }
-}
 
-void State::wakeup_thread(std::mutex &m, int fd, std::function<void()> action)
-{
-    std::mutex cv_m;
-    std::condition_variable cv;
-    std::atomic<bool> acquired = false, through = false;
-    std::thread t([&]()
+    // Hand what has been queued to the kernel, then cancel what it could not
+    // send right away so that nothing refers to the connections any more.
+    flush_connections(t);
+    uring.submit(0, -1);
+    auto pending = [this, &t]()
     {
-        m.lock();
-        acquired = true;
-        std::unique_lock lk(cv_m);
-        cv.wait(lk);
-        through = true;
-        m.unlock();
-    });
-    while (!acquired)
+        std::unique_lock lk(connections_m);
+        return std::any_of(connections.begin(), connections.end(), [&t](const auto &entry)
+        {
+            return entry.second->io == &t && entry.second->uring_requests > 0;
+        });
+    };
     {
-        write(fd, "a", 1);
+        std::unique_lock lk(connections_m);
+        for (auto &entry : connections)
+        {
+            if (entry.second->io == &t)
+            {
+                uring.cancel(entry.first);
+            }
+        }
     }
-    action();
-    while (!through)
+    for (int tries = 0; tries < 10 && pending(); ++tries)
     {
-        cv.notify_all();
+        uring.submit(1, 100);
+        int n = uring.complete(completions, 64);
+        for (int i = 0; i < n; ++i)
+        {
+            Connection *c = (Connection *)(completions[i].data & ~(uint64_t)URING_OP_MASK);
+            if ((completions[i].data & URING_OP_MASK) == URING_ACCEPT)
+            {
+                continue;
+            }
+            if (completions[i].buffer >= 0)
+            {
+                uring.recycle(completions[i].buffer);
+            }
+            if (!completions[i].more)
+            {
+                --c->uring_requests;
+            }
+        }
     }
-    t.join();
+    reap_connections(t);
 }
 
-int State::accept_connection()
+void State::uring_complete(IoThread &t, uint64_t data, int result, bool more, int buffer)
 {
-    struct sockaddr_in addr;
-    size_t addr_len = sizeof(addr);
-
-    // Accept connection.
-    int new_socket = accept(server_socket, (struct sockaddr *)&addr, (socklen_t *)&addr_len);
-    if (new_socket < 0)
+    if ((data & URING_OP_MASK) == URING_ACCEPT)
     {
-        perror("accept()");
-        return new_socket;
+        accept_connections();
+        if (!more)
+        {
+            t.uring->poll(server_socket, data);
+        }
+        return;
     }
 
-    // Enable TCP KeepAlive to ensure that we are notified if the leader goes down.
-    int enable = 1;
-    if (setsockopt(new_socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(int)) < 0)
+    Connection *c = (Connection *)(data & ~(uint64_t)URING_OP_MASK);
+    if (!more)
     {
-        perror("setsockopt()");
-        return -1;
+        --c->uring_requests;
     }
 
-    struct linger lo = {1, 0};
-    if (setsockopt(new_socket, SOL_SOCKET, SO_LINGER, &lo, sizeof(lo)) < 0)
+    if ((data & URING_OP_MASK) == URING_SEND)
     {
-        perror("setsockopt()");
-        return -1;
+        --c->tx_inflight;
+        if (result > 0)
+        {
+            c->tx_done += result;
+        }
+        else
+        {
+            c->tx_failed = true;
+        }
+        if (c->tx_inflight > 0)
+        {
+            return;
+        }
+
+        {
+            std::unique_lock lk(c->tx_m);
+            consume_sent(c, c->tx_done);
+        }
+        if (!c->closed && (c->tx_failed || uring_send(c) < 0))
+        {
+            close_connection(c);
+        }
+        return;
     }
 
-#ifdef __APPLE__
-    if (setsockopt(new_socket, SOL_SOCKET, SO_NOSIGPIPE, (void *)&enable, sizeof(int)) < 0)
+    if (buffer >= 0)
     {
-        perror("setsockopt()");
-        return -1;
+        if (!c->closed && result > 0)
+        {
+            handle_data(c, t.uring->buffer(buffer), result);
+        }
+        t.uring->recycle(buffer);
     }
-#endif
-
-    wakeup_thread(client_socket_list_m, identification_wakeup_fd, [this, new_socket]()
+    if (c->closed || more)
     {
-        client_socket_list.push_back(new_socket);
-    });
+        return;
+    }
 
-    return 0;
+    // The receive stops when the buffers run out, until some are recycled.
+    if (result > 0 || result == -ENOBUFS)
+    {
+        if (t.uring->recv(c->socket, data) < 0)
+        {
+            close_connection(c);
+            return;
+        }
+        ++c->uring_requests;
+        return;
+    }
+    close_connection(c);
 }
 
-State::~State()
+int State::uring_send(Connection *c)
 {
-    recv_thread_running = false;
-    accept_thread_running = false;
-    identification_thread_running = false;
-
-    write(identification_wakeup_fd, "a", 1);
-    write(recv_wakeup_fd, "a", 1);
-
-    close(identification_wakeup_fd);
-    close(recv_wakeup_fd);
-    close(server_socket);
-
-    for (auto socket : recv_socket_list)
+    if (c->tx_inflight > 0)
     {
-        close(socket);
+        return 0;
     }
 
-    for (auto socket : client_socket_list)
+    std::unique_lock lk(c->tx_m);
+    if (c->tx.empty())
     {
-        close(socket);
+        c->tx_scheduled = false;
+        return 0;
     }
 
-    for (auto &var : vars)
+    // Take a batch of messages, as `flush_connection` does.
+    Outgoing *batch[FLUSH_BATCH];
+    size_t count = std::min<size_t>(c->tx.size(), FLUSH_BATCH);
+    for (size_t i = 0; i < count; ++i)
     {
-        free(var.second.data);
+        batch[i] = &c->tx[i];
     }
-}
+    size_t frozen = c->tx_frozen;
+    c->tx_frozen = std::max(frozen, count);
+    size_t skip = c->tx_offset;
+    lk.unlock();
 
-int State::register_owner(std::string variable_owner, int socket)
-{
-    wakeup_thread(socket_list_m, recv_wakeup_fd, [this, socket]()
+    size_t before = 0, after = 0;
+    for (size_t i = frozen; i < count; ++i)
     {
-        recv_socket_list.push_back(socket);
-    });
+        before += message_length(batch[i]->header);
+        encode(c, *batch[i]);
+        after += message_length(batch[i]->header);
+    }
 
-    for (auto &var : vars)
+    // Gather each message into a request of its own.
+    int iovcnt = 0;
+    size_t frames = 0;
+    for (size_t i = 0; i < count && iovcnt < FLUSH_IOV; ++i)
     {
-        if (var.second.owner == variable_owner)
+        int first = iovcnt;
+        gather(*batch[i], c->tx_iov.data(), iovcnt, skip);
+        if (iovcnt > first)
         {
-            var.second.owner_socket = socket;
+            struct msghdr &msg = c->tx_msgs[frames++];
+            msg = {};
+            msg.msg_iov = &c->tx_iov[first];
+            msg.msg_iovlen = iovcnt - first;
         }
     }
-    return 0;
-}
 
-int State::register_owner(std::string variable_owner, std::string owner_ip, int owner_port)
-{
-    // Connect to IP/port.
-    int sock;
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    // Link the requests so that each starts once the one before has sent
+    // everything. They must all be submitted together for that.
+    Uring &uring = *c->io->uring;
+    int ret = uring.reserve(frames);
+    for (size_t i = 0; i < frames && ret == 0; ++i)
     {
-        perror("socket()");
-        return sock;
+        ret = uring.sendmsg(c->socket, &c->tx_msgs[i], i + 1 < frames, (uint64_t)c | URING_SEND);
     }
 
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(owner_port);
-
-    int ret;
-    if ((ret = inet_pton(AF_INET, owner_ip.c_str(), &serv_addr.sin_addr)) <= 0)
+    lk.lock();
+    c->tx_bytes = c->tx_bytes - before + after;
+    if (ret < 0)
     {
-        perror("inet_pton()");
-        return ret;
+        return -1;
     }
+    c->tx_inflight = frames;
+    c->tx_done = 0;
+    c->tx_failed = false;
+    c->uring_requests += frames;
 
-    if ((ret = connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr))) < 0)
+    return 0;
+}
+
+void State::handle_data(Connection *c, const char *data, size_t size)
+{
+    // Make room at the end of the buffer.
+    if (c->rx.size() - c->rx_end < size)
     {
-        perror("connect()");
-        return ret;
+        memmove(c->rx.data(), c->rx.data() + c->rx_start, c->rx_end - c->rx_start);
+        c->rx_end -= c->rx_start;
+        c->rx_start = 0;
+        if (c->rx.size() - c->rx_end < size)
+        {
+            c->rx.resize(c->rx_end + size);
+        }
     }
 
-    return register_owner(variable_owner, sock);
+    memcpy(c->rx.data() + c->rx_end, data, size);
+    c->rx_end += size;
+
+    if (handle_messages(c) < 0)
+    {
+        close_connection(c);
+    }
 }
 
-void State::create_var(std::string var, Type type, std::string owner, bool is_array)
+void State::wake_io_thread(IoThread &t)
 {
-    Variable v = {type, is_array, 1, owner, -1, nullptr, std::chrono::system_clock::now()};
+    // An I/O thread looks at the lists before it waits again, so it need not
+    // wake itself.
+    if (current_io_thread == &t)
+    {
+        return;
+    }
 
-    if (!is_array)
+    if (t.uring)
     {
-        v.data = malloc(type_size(type));
+        t.uring->wake();
     }
     else
     {
-        if (v.type == STRING)
-        {
-            throw std::runtime_error("Invalid line in configuration file. Cannot have array of strings.");
-        }
-
-        v.data = nullptr;
+        t.reactor->wake();
     }
-
-    vars[var] = v;
 }
 
-size_t State::type_size(Type type)
+void State::flush_connections(IoThread &t)
 {
-    switch (type)
     {
-    case INT8:
-        return sizeof(int8_t);
-    case INT16:
-        return sizeof(int16_t);
-    case INT32:
-        return sizeof(int32_t);
-    case INT64:
-        return sizeof(int64_t);
-    case UINT8:
-        return sizeof(uint8_t);
-    case UINT16:
-        return sizeof(uint16_t);
-    case UINT32:
-        return sizeof(uint32_t);
-    case UINT64:
-        return sizeof(uint64_t);
-    case FLOAT:
-        return sizeof(float);
-    case DOUBLE:
-        return sizeof(double);
-    case STRING:
-        return sizeof(char);
-    default:
-        throw std::runtime_error("Invalid type.");
+        std::unique_lock lk(t.flush_m);
+        t.flushing.swap(t.flush_list);
     }
-}
-
-void State::notify_subscribers(std::string var)
-{
-    std::unique_lock lk(subscriber_list_m);
 
-    // Send the message to all subscribers.
-    for (int i = subscriber_list[var].size() - 1; i >= 0; --i)
+    for (Connection *c : t.flushing)
     {
-        int socket = subscriber_list[var][i];
-        int ret = send_message(socket, var);
-        if (ret < 0)
+        if (!c->closed && flush_connection(c) < 0)
         {
-            subscriber_list[var].erase(subscriber_list[var].begin() + i);
-            wakeup_thread(client_socket_list_m, identification_wakeup_fd, [this, socket]()
-            {
-                client_socket_list.erase(std::remove(client_socket_list.begin(), client_socket_list.end(), socket), client_socket_list.end());
-            });
-            close(socket);
+            close_connection(c);
         }
     }
+    t.flushing.clear();
 }
 
-int read_all_bytes(int socket, void *buf, size_t size)
+void State::reap_connections(IoThread &t)
 {
-    size_t bytes_read = 0;
-    while (bytes_read < size)
+    // Connections that `uring` still has requests for are kept until these
+    // complete.
+    std::vector<Connection *> busy;
+    for (Connection *c : t.closed_connections)
     {
-        int ret = read(socket, (char *)buf + bytes_read, size - bytes_read);
-        if (ret < 0)
+        if (c->uring_requests > 0)
         {
-            return ret;
+            busy.push_back(c);
+            continue;
         }
-        bytes_read += ret;
-    }
-    return bytes_read;
-}
 
-int State::recv_message(int socket)
-{
-    int var_name_size, var_data_size;
-    int err;
-
-    // Read the size of the variable name.
-    if ((err = read_all_bytes(socket, &var_name_size, sizeof(var_name_size))) <= 0)
-    {
-        return (err == 0) ? -1 : err;
-    }
+        {
+            std::unique_lock lk(t.flush_m);
+            t.flush_list.erase(std::remove(t.flush_list.begin(), t.flush_list.end(), c), t.flush_list.end());
+        }
 
-    // Read the variable name.
-    std::string var(var_name_size, 0);
-    if ((err = read_all_bytes(socket, &var[0], var_name_size)) < 0)
-    {
-        return err;
+        // Forget the connection before closing its socket, so that a new
+        // connection that gets the same socket number is left alone.
+        int socket = c->socket;
+        std::unique_ptr<Connection> entry;
+        {
+            std::unique_lock lk(connections_m);
+            auto it = connections.find(socket);
+            entry = std::move(it->second);
+            connections.erase(it);
+        }
+        close(socket);
     }
+    t.closed_connections.swap(busy);
+}
 
-    // Check if the variable exists.
-    if (vars.find(var) == vars.end())
+State::Connection *State::add_connection(int socket, bool to_owner)
+{
+    // Messages are queued and sent by the I/O thread as the socket takes
+    // them.
+    if (fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK) < 0)
     {
-        return -1;
+        perror("fcntl()");
+        return nullptr;
     }
 
-    std::unique_lock lk(var_locks[var]);
-
-    // Read the size of the data.
-    if ((err = read_all_bytes(socket, &var_data_size, sizeof(var_data_size))) < 0)
+    IoThread &t = *io_threads[socket % io_threads.size()];
+    Connection *c;
     {
-        return err;
+        std::unique_lock lk(connections_m);
+        auto &entry = connections[socket];
+        entry = std::make_unique<Connection>();
+        entry->io = &t;
+        entry->socket = socket;
+        entry->to_owner = to_owner;
+        entry->peer = peer_address(socket);
+        entry->rx.resize(CONNECTION_BUFFER_SIZE);
+        entry->sent.resize(var_table.size());
+        if (t.uring)
+        {
+            entry->tx_iov.resize(FLUSH_IOV);
+            entry->tx_msgs.resize(FLUSH_BATCH);
+        }
+        c = entry.get();
     }
 
-    // Free the old data.
-    free(vars[var].data);
-
-    // Allocate memory for the new data.
-    vars[var].data = malloc(var_data_size);
-    if (vars[var].data == nullptr)
+    if (t.uring)
     {
-        perror("malloc()");
-        return -1;
+        bool wake;
+        {
+            std::unique_lock lk(t.flush_m);
+            wake = t.arm_list.empty();
+            t.arm_list.push_back(c);
+        }
+        if (wake)
+        {
+            wake_io_thread(t);
+        }
     }
-
-    // Read the data.
-    if ((err = read_all_bytes(socket, vars[var].data, var_data_size)) < 0)
+    else if (t.reactor->add(socket, c) < 0)
     {
-        return err;
+        std::unique_lock lk(connections_m);
+        connections.erase(socket);
+        return nullptr;
     }
 
-    // Update the size of the variable.
-    vars[var].size = var_data_size / type_size(vars[var].type);
-    vars[var].last_updated = std::chrono::system_clock::now();
-
-    var_cvs[var].notify_all();
-
-    return 0;
+    return c;
 }
 
-int State::send_message(int socket, std::string var)
+void State::close_connection(Connection *c)
 {
-    std::unique_lock lk(var_locks[var]);
-    int var_name_size = var.size(),
-        var_data_size = vars[var].size * type_size(vars[var].type);
-    int err;
-
-    // Send the size of the variable name.
-    if ((err = send(socket, &var_name_size, sizeof(var_name_size), MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
+    if (c->io->uring)
     {
-        return err;
+        c->io->uring->cancel(c->socket);
     }
-
-    // Send the variable name.
-    if ((err = send(socket, &var[0], var_name_size, MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
+    else
     {
-        return err;
+        c->io->reactor->remove(c->socket);
     }
 
-    // Send the size of the data.
-    if ((err = send(socket, &var_data_size, sizeof(var_data_size), MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
     {
-        return err;
+        std::unique_lock lk(c->tx_m);
+        c->closed = true;
     }
 
-    // Send the data.
-    if ((err = send(socket, vars[var].data, var_data_size, MSG_NOSIGNAL)) < 0)
+    // Make sure that nothing refers to the connection once it is freed.
+    if (c->to_owner)
     {
-        return err;
-    }
-
-    return 0;
-}
+        for (auto &s : var_table)
+        {
+            std::unique_lock lk(s.lock);
+            if (s.var.owner_connection == c)
+            {
+                s.var.owner_connection = nullptr;
 
-int State::recv_interest(int socket)
+                // Have `get` take the lock again, and find the owner gone.
+                if (s.var.scalar)
+                {
+                    s.var.scalar->readable.store(false, std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+    else
+    {
+        std::unique_lock lk(subscriber_list_m);
+        for (auto &subscribers : subscriber_list)
+        {
+            subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), [c](const Subscriber &sub)
+            {
+                return sub.connection == c;
+            }), subscribers.end());
+        }
+    }
+
+    c->io->closed_connections.push_back(c);
+}
+
+int State::accept_connections()
+{
+    while (true)
+    {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+
+        // Accept connection.
+        int new_socket = accept(server_socket, (struct sockaddr *)&addr, &addr_len);
+        if (new_socket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            perror("accept()");
+            return new_socket;
+        }
+
+        // Enable TCP KeepAlive to ensure that we are notified if the leader goes down.
+        int enable = 1;
+        if (setsockopt(new_socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(int)) < 0)
+        {
+            perror("setsockopt()");
+            close(new_socket);
+            continue;
+        }
+
+        struct linger lo = {1, 0};
+        if (setsockopt(new_socket, SOL_SOCKET, SO_LINGER, &lo, sizeof(lo)) < 0)
+        {
+            perror("setsockopt()");
+            close(new_socket);
+            continue;
+        }
+
+#ifdef __APPLE__
+        if (setsockopt(new_socket, SOL_SOCKET, SO_NOSIGPIPE, (void *)&enable, sizeof(int)) < 0)
+        {
+            perror("setsockopt()");
+            close(new_socket);
+            continue;
+        }
+#endif
+
+        if (add_connection(new_socket, false) == nullptr)
+        {
+            close(new_socket);
+        }
+    }
+}
+
+State::~State()
+{
+    // The I/O threads send what they can of the queued messages before they
+    // exit.
+    io_thread_running = false;
+    for (auto &t : io_threads)
+    {
+        wake_io_thread(*t);
+    }
+    for (auto &t : io_threads)
+    {
+        t->thread.join();
+        t->uring.reset();
+    }
+
+    // Calls and continuations still queued are dropped, which breaks the
+    // promises of their futures, but those running are waited for.
+    {
+        std::unique_lock lk(handlers_m);
+        handlers_stopping = true;
+    }
+    handlers_cv.notify_all();
+    for (auto &t : handler_threads)
+    {
+        t.join();
+    }
+
+    if (server_socket >= 0)
+    {
+        close(server_socket);
+    }
+
+    for (auto &c : connections)
+    {
+        shutdown(c.first, SHUT_RDWR);
+        close(c.first);
+    }
+}
+
+int State::register_owner(std::string variable_owner, int socket)
+{
+    Connection *c = add_connection(socket, true);
+    if (c == nullptr)
+    {
+        return -1;
+    }
+
+    for (auto &s : var_table)
+    {
+        if (s.var.owner == variable_owner)
+        {
+            std::unique_lock lk(s.lock);
+            s.var.owner_connection = c;
+
+            // An owner that started again numbers its values from the start.
+            s.var.version = 0;
+        }
+    }
+    return 0;
+}
+
+int State::register_owner(std::string variable_owner, std::string owner_ip, int owner_port)
+{
+    // Connect to IP/port.
+    int sock;
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("socket()");
+        return sock;
+    }
+
+    struct sockaddr_in serv_addr;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(owner_port);
+
+    int ret;
+    if ((ret = inet_pton(AF_INET, owner_ip.c_str(), &serv_addr.sin_addr)) <= 0)
+    {
+        perror("inet_pton()");
+        return ret;
+    }
+
+    if ((ret = connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr))) < 0)
+    {
+        perror("connect()");
+        return ret;
+    }
+
+    return register_owner(variable_owner, sock);
+}
+
+State::VarOptions State::parse_options(const std::string &options, int line)
+{
+    VarOptions result;
+
+    std::istringstream iss(options);
+    std::string option;
+    while (std::getline(iss, option, ','))
+    {
+        if (option == "compress")
+        {
+            result.compress = true;
+        }
+        else if (option == "quantize=f16")
+        {
+            result.quantize = QUANTIZE_F16;
+        }
+        else if (option == "quantize=bf16")
+        {
+            result.quantize = QUANTIZE_BF16;
+        }
+        else if (option.rfind("quantize=i16:", 0) == 0)
+        {
+            // The largest error allowed follows the format.
+            char *end;
+            const char *error = option.c_str() + strlen("quantize=i16:");
+            result.quantize = QUANTIZE_I16;
+            result.max_error = strtod(error, &end);
+            if (end == error || *end != '\0' || !(result.max_error > 0))
+            {
+                throw std::runtime_error("Invalid error bound in option '" + option + "' in configuration file on line " + std::to_string(line));
+            }
+        }
+        else
+        {
+            throw std::runtime_error("Invalid option '" + option + "' in configuration file on line " + std::to_string(line));
+        }
+    }
+
+    return result;
+}
+
+void State::parse_struct(const std::string &type, int line, Definition &d)
+{
+    auto invalid = [&](const std::string &what)
+    {
+        return std::runtime_error("Invalid " + what + " in configuration file on line " + std::to_string(line));
+    };
+
+    if (type.size() < strlen("STRUCT{}") || type.back() != '}')
+    {
+        throw invalid("struct");
+    }
+
+    std::istringstream iss(type.substr(strlen("STRUCT{"), type.size() - strlen("STRUCT{}")));
+    std::string field;
+    std::unordered_set<std::string> names;
+    size_t size = 0, alignment = 1;
+    while (std::getline(iss, field, ','))
+    {
+        // Parse `name:TYPE` or `name:TYPE[count]`, where the name can be used
+        // in C++.
+        size_t colon = field.find(':');
+        size_t bracket = field.find('[');
+        std::string name = field.substr(0, colon);
+        bool identifier = !name.empty() && !isdigit((unsigned char)name[0]) && std::all_of(name.begin(), name.end(), [](unsigned char c)
+        {
+            return isalnum(c) || c == '_';
+        });
+        if (colon == std::string::npos || !identifier || !names.insert(name).second)
+        {
+            throw invalid("struct field '" + field + "'");
+        }
+        std::string field_type = field.substr(colon + 1, bracket == std::string::npos ? std::string::npos : bracket - colon - 1);
+        auto it = type_map.find(field_type);
+        if (it == type_map.end() || it->second == STRING)
+        {
+            throw invalid("struct field '" + field + "'");
+        }
+
+        size_t count = 1;
+        if (bracket != std::string::npos)
+        {
+            char *end;
+            const char *start = field.c_str() + bracket + 1;
+            count = strtoul(start, &end, 10);
+            if (end == start || count == 0 || *end != ']' || end[1] != '\0')
+            {
+                throw invalid("struct field '" + field + "'");
+            }
+        }
+
+        size_t field_size = type_size(it->second);
+        size = (size + field_size - 1) / field_size * field_size + field_size * count;
+        alignment = std::max(alignment, field_size);
+    }
+    if (names.empty())
+    {
+        throw invalid("struct");
+    }
+
+    d.struct_size = (size + alignment - 1) / alignment * alignment;
+    d.struct_layout = schema_fingerprint(type.c_str());
+}
+
+void State::create_var(Slot &s, const Definition &d)
+{
+    Variable &v = s.var;
+    v.type = d.type;
+    v.is_array = d.is_array;
+    v.size = (d.is_array || d.type == STRING || d.type == TENSOR) ? 0 : 1;
+    v.element_size = d.type == STRUCT ? d.struct_size : d.type == TENSOR ? 1 : type_size(d.type);
+    v.layout = d.struct_layout;
+    v.element_type = d.element_type;
+    v.owner = d.owner;
+    v.owner_connection = nullptr;
+    v.last_updated = std::chrono::system_clock::now();
+    v.buffer_stats = {0, 0};
+    v.options = d.options;
+    if (d.options.quantize != QUANTIZE_NONE && (!d.is_array || (d.type != FLOAT && d.type != DOUBLE)))
+    {
+        throw std::runtime_error("Invalid line in configuration file. Only arrays of FLOAT or DOUBLE can be quantized.");
+    }
+
+    if (!d.is_array)
+    {
+        v.data = std::make_shared<Buffer>(v.element_size);
+        memset(v.data->bytes, 0, v.element_size);
+    }
+    else
+    {
+        if (v.type == STRING || v.type == TENSOR)
+        {
+            throw std::runtime_error("Invalid line in configuration file. Cannot have array of strings or tensors.");
+        }
+
+        v.data = std::make_shared<Buffer>(0);
+    }
+
+    // An owned scalar can be read without the lock from the start, and
+    // others once `get` has waited for a value.
+    if (!v.resizable() && v.element_size <= sizeof(s.scalar.bits))
+    {
+        v.scalar = &s.scalar;
+        v.scalar->readable = d.owner == self;
+    }
+
+    s.name = d.var;
+    s.owned = d.owner == self;
+}
+
+std::shared_ptr<Buffer> State::acquire_buffer(Variable &v, size_t size, bool in_place)
+{
+    // Nothing else can take a reference to a buffer of `v` while its lock is
+    // held, so a use count of 1 means the buffer is free to be overwritten.
+    if (in_place && v.data.use_count() == 1 && v.data->capacity >= size)
+    {
+        ++v.buffer_stats.reuses;
+        return v.data;
+    }
+
+    for (auto it = v.spare_buffers.begin(); it != v.spare_buffers.end(); ++it)
+    {
+        if (it->use_count() == 1 && (*it)->capacity >= size)
+        {
+            std::shared_ptr<Buffer> buffer = std::move(*it);
+            v.spare_buffers.erase(it);
+            ++v.buffer_stats.reuses;
+            return buffer;
+        }
+    }
+
+    ++v.buffer_stats.allocations;
+    return std::make_shared<Buffer>(size);
+}
+
+void State::publish_buffer(Variable &v, std::shared_ptr<Buffer> buffer)
+{
+    if (buffer == v.data)
+    {
+        return;
+    }
+
+    v.spare_buffers.push_back(std::move(v.data));
+    v.data = std::move(buffer);
+
+    // Prefer dropping a buffer that is still leased, since it cannot be
+    // reused until the lease is released anyway.
+    if (v.spare_buffers.size() > max_spare_buffers)
+    {
+        auto it = std::find_if(v.spare_buffers.begin(), v.spare_buffers.end(), [](const std::shared_ptr<Buffer> &b)
+        {
+            return b.use_count() > 1;
+        });
+        if (it == v.spare_buffers.end())
+        {
+            it = v.spare_buffers.begin();
+        }
+        v.spare_buffers.erase(it);
+    }
+}
+
+void State::store(Variable &v, const void *data, int data_size, int count)
+{
+    bool resize = v.resizable();
+    size_t size = resize ? data_size : v.element_size;
+
+    std::shared_ptr<Buffer> buffer = acquire_buffer(v, size, true);
+
+    // A scalar may be set from a narrower type, which only overwrites its
+    // low bytes, so carry the rest over from the current value.
+    if (!resize && buffer != v.data)
+    {
+        memcpy(buffer->bytes, v.data->bytes, size);
+    }
+
+    memcpy(buffer->bytes, data, data_size);
+    publish_buffer(v, std::move(buffer));
+    ++v.version;
+
+    if (v.scalar)
+    {
+        uint64_t bits = 0;
+        memcpy(&bits, v.data->bytes, size);
+        v.scalar->bits.store(bits, std::memory_order_release);
+    }
+
+    if (resize)
+    {
+        v.size = count;
+    }
+}
+
+size_t State::type_size(Type type)
+{
+    switch (type)
+    {
+    case INT8:
+        return sizeof(int8_t);
+    case INT16:
+        return sizeof(int16_t);
+    case INT32:
+        return sizeof(int32_t);
+    case INT64:
+        return sizeof(int64_t);
+    case UINT8:
+        return sizeof(uint8_t);
+    case UINT16:
+        return sizeof(uint16_t);
+    case UINT32:
+        return sizeof(uint32_t);
+    case UINT64:
+        return sizeof(uint64_t);
+    case FLOAT:
+        return sizeof(float);
+    case DOUBLE:
+        return sizeof(double);
+    case STRING:
+        return sizeof(char);
+    default:
+        throw std::runtime_error("Invalid type.");
+    }
+}
+
+bool State::valid_tensor(const Variable &v, const void *data, size_t size)
+{
+    static_assert(INT8 == tensor_dtype<int8_t>() && DOUBLE == tensor_dtype<double>(), "Tensor types must match variable types.");
+
+    if (size == 0)
+    {
+        return true;
+    }
+
+    TensorHeader header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.dtype != v.element_type || header.rank > TENSOR_MAX_RANK || header.size != size - sizeof(header))
+    {
+        return false;
+    }
+
+    // A tensor without elements is valid whatever its strides.
+    for (int i = 0; i < header.rank; ++i)
+    {
+        if (header.shape[i] == 0)
+        {
+            return true;
+        }
+    }
+
+    // Add up the offset of the last element, without overflowing.
+    size_t element_size = type_size(v.element_type);
+    size_t extent = element_size;
+    if (extent > header.size)
+    {
+        return false;
+    }
+    for (int i = 0; i < header.rank; ++i)
+    {
+        uint64_t stride = header.strides[i];
+        if (stride % element_size != 0 || (stride > 0 && header.shape[i] - 1 > (header.size - extent) / stride))
+        {
+            return false;
+        }
+        extent += (header.shape[i] - 1) * stride;
+    }
+
+    return true;
+}
+
+int State::publish_shm(size_t index)
+{
+    Slot &s = var_table[index];
+    size_t size = s.var.size * s.var.element_size;
+
+    // Replace the segment with a larger one if the data no longer fits.
+    // Subscribers may still be about to open the old one, so it stays linked.
+    if (!s.var.shm || s.var.shm->capacity() < size)
+    {
+        size_t capacity = std::max<size_t>(size, 4096);
+        if (s.var.shm)
+        {
+            capacity = std::max(capacity, 2 * s.var.shm->capacity());
+            s.var.retired_shm.push_back(s.var.shm);
+        }
+
+        std::string name = "/dsml." + std::to_string(getpid()) + "." + std::to_string(instance) + "." +
+                           std::to_string(index) + "." + std::to_string(s.var.retired_shm.size());
+        s.var.shm = ShmSegment::create(name, capacity);
+        if (!s.var.shm)
+        {
+            return -1;
+        }
+    }
+
+    s.var.shm->write(s.var.data->bytes, size, s.var.version);
+
+    return 0;
+}
+
+void State::prepare_update(size_t index, Outgoing &raw, Outgoing &shm)
+{
+    Slot &s = var_table[index];
+    std::vector<Subscriber> &subscribers = subscriber_list[index];
+
+    raw = {};
+    raw.header = {MESSAGE_UPDATE, ENCODING_RAW, (uint16_t)s.name.size(), 0};
+    raw.name = &s.name;
+    shm = raw;
+
+    std::unique_lock lk(s.lock);
+
+    // Publish to shared memory once for all subscribers on this host. Fall
+    // back to sending the data over their sockets if that is not possible.
+    bool use_shm = std::any_of(subscribers.begin(), subscribers.end(), [](const Subscriber &sub)
+    {
+        return sub.shm && sub.due;
+    });
+    if (use_shm && publish_shm(index) < 0)
+    {
+        for (auto &sub : subscribers)
+        {
+            sub.shm = false;
+        }
+    }
+    else if (use_shm)
+    {
+        shm.header.encoding = ENCODING_SHM;
+        shm.small_data = s.var.shm->name();
+        shm.header.data_size = shm.small_data.size();
+    }
+
+    // The buffer is not written to again while the queues refer to it, so
+    // it is sent as is rather than copied.
+    raw.data = s.var.data;
+    raw.header.data_size = s.var.size * s.var.element_size;
+    raw.index = index;
+    raw.header.version = shm.header.version = s.var.version;
+
+    // Subscribers that want the data compressed or quantized share the work.
+    if (s.var.options.compress && raw.header.data_size >= COMPRESS_THRESHOLD)
+    {
+        raw.compressed = std::make_shared<Compressed>();
+    }
+    if (s.var.options.quantize != QUANTIZE_NONE)
+    {
+        raw.quantized = std::make_shared<Quantized>();
+        if (s.var.options.compress)
+        {
+            raw.quantized->compressed = std::make_shared<Compressed>();
+        }
+    }
+}
+
+State::Outgoing State::update_for(const Subscriber &sub, const Outgoing &raw, const Outgoing &shm)
+{
+    Outgoing message = sub.shm ? shm : raw;
+    message.delta = sub.delta;
+    message.compress = sub.compress;
+    message.quantize = sub.quantize;
+    return message;
+}
+
+bool State::admit(Subscriber &sub, const Variable &v, const std::shared_ptr<const Buffer> &value, size_t size,
+                  std::chrono::steady_clock::time_point now)
+{
+    // An update within the deadband is dropped. One held back before it is
+    // still sent, if its value is not by then.
+    sub.due = moved(sub, v, value, size);
+    if (!sub.due)
+    {
+        return false;
+    }
+
+    auto since_update = now - sub.last_update;
+    sub.last_update = now;
+    ++sub.held;
+
+    sub.due = now - sub.last_sent >= sub.min_interval && sub.held >= sub.decimation;
+    if (sub.due)
+    {
+        sub.last_sent = now;
+        sub.held = 0;
+        sub.trailing = false;
+        return true;
+    }
+
+    // Send this update later if no other one is sent by then.
+    sub.trailing = true;
+    sub.trailing_at = sub.last_sent + sub.min_interval;
+    if (sub.decimation > 1)
+    {
+        sub.trailing_at = std::max(sub.trailing_at, now + since_update * sub.decimation);
+    }
+    schedule_trailing(sub.trailing_at);
+    return false;
+}
+
+bool State::moved(const Subscriber &sub, const Variable &v, const std::shared_ptr<const Buffer> &value, size_t size)
+{
+    if ((sub.deadband <= 0 && sub.relative_deadband <= 0) || !sub.has_sent || !value || size != sub.sent.size())
+    {
+        return true;
+    }
+
+    size_t count = size / v.element_size;
+    const void *values = value->bytes;
+    const void *sent = sub.sent.data();
+    switch (v.type)
+    {
+    case INT8:
+        return deadband::moved((const int8_t *)values, (const int8_t *)sent, count, sub.deadband, sub.relative_deadband);
+    case INT16:
+        return deadband::moved((const int16_t *)values, (const int16_t *)sent, count, sub.deadband, sub.relative_deadband);
+    case INT32:
+        return deadband::moved((const int32_t *)values, (const int32_t *)sent, count, sub.deadband, sub.relative_deadband);
+    case INT64:
+        return deadband::moved((const int64_t *)values, (const int64_t *)sent, count, sub.deadband, sub.relative_deadband);
+    case UINT8:
+        return deadband::moved((const uint8_t *)values, (const uint8_t *)sent, count, sub.deadband, sub.relative_deadband);
+    case UINT16:
+        return deadband::moved((const uint16_t *)values, (const uint16_t *)sent, count, sub.deadband, sub.relative_deadband);
+    case UINT32:
+        return deadband::moved((const uint32_t *)values, (const uint32_t *)sent, count, sub.deadband, sub.relative_deadband);
+    case UINT64:
+        return deadband::moved((const uint64_t *)values, (const uint64_t *)sent, count, sub.deadband, sub.relative_deadband);
+    case FLOAT:
+        return deadband::moved((const float *)values, (const float *)sent, count, sub.deadband, sub.relative_deadband);
+    case DOUBLE:
+        return deadband::moved((const double *)values, (const double *)sent, count, sub.deadband, sub.relative_deadband);
+    default:
+        return true;
+    }
+}
+
+void State::deadband_value(size_t index, std::shared_ptr<const Buffer> &value, size_t &size)
+{
+    const std::vector<Subscriber> &subscribers = subscriber_list[index];
+    bool any = std::any_of(subscribers.begin(), subscribers.end(), [](const Subscriber &sub)
+    {
+        return sub.deadband > 0 || sub.relative_deadband > 0;
+    });
+    if (!any)
+    {
+        return;
+    }
+
+    Slot &s = var_table[index];
+    std::unique_lock lk(s.lock);
+    value = s.var.data;
+    size = s.var.size * s.var.element_size;
+}
+
+void State::mark_sent(size_t index, const Outgoing &raw)
+{
+    for (auto &sub : subscriber_list[index])
+    {
+        if (sub.due && (sub.deadband > 0 || sub.relative_deadband > 0))
+        {
+            const char *bytes = raw.data ? static_cast<const char *>(raw.data->bytes) : nullptr;
+            sub.sent.assign(bytes, bytes + raw.header.data_size);
+            sub.has_sent = true;
+        }
+    }
+}
+
+void State::schedule_trailing(std::chrono::steady_clock::time_point when)
+{
+    int64_t deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+    int64_t current = trailing_deadline.load(std::memory_order_relaxed);
+    while (deadline < current)
+    {
+        if (trailing_deadline.compare_exchange_weak(current, deadline))
+        {
+            // Have the first I/O thread wait no longer than that.
+            wake_io_thread(*io_threads[0]);
+            return;
+        }
+    }
+}
+
+int State::trailing_timeout()
+{
+    int64_t deadline = trailing_deadline.load(std::memory_order_relaxed);
+    if (deadline == INT64_MAX)
+    {
+        return -1;
+    }
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    return deadline <= now ? 0 : (deadline - now + 999999) / 1000000;
+}
+
+void State::send_trailing()
+{
+    if (trailing_timeout() != 0)
+    {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    std::unique_lock lk(subscriber_list_m);
+    trailing_deadline = INT64_MAX;
+
+    for (size_t index = 0; index < subscriber_list.size(); ++index)
+    {
+        std::vector<Subscriber> &subscribers = subscriber_list[index];
+        bool any = false;
+        for (auto &sub : subscribers)
+        {
+            sub.due = sub.trailing && sub.trailing_at <= now;
+            any = any || sub.due;
+            if (sub.trailing && !sub.due)
+            {
+                schedule_trailing(sub.trailing_at);
+            }
+        }
+        if (!any)
+        {
+            continue;
+        }
+
+        // The value may have gone back into the deadband since it was held.
+        std::shared_ptr<const Buffer> value;
+        size_t size = 0;
+        deadband_value(index, value, size);
+        any = false;
+        for (auto &sub : subscribers)
+        {
+            if (sub.due && !moved(sub, var_table[index].var, value, size))
+            {
+                sub.due = sub.trailing = false;
+            }
+            any = any || sub.due;
+        }
+        if (!any)
+        {
+            continue;
+        }
+
+        Outgoing raw, shm;
+        prepare_update(index, raw, shm);
+        mark_sent(index, raw);
+        for (auto &sub : subscribers)
+        {
+            if (sub.due)
+            {
+                sub.last_sent = now;
+                sub.held = 0;
+                sub.trailing = false;
+                enqueue(sub.connection, update_for(sub, raw, shm), sub.conflate);
+            }
+        }
+    }
+}
+
+void State::notify_subscribers(size_t index, Connection *only)
+{
+    std::unique_lock lk(subscriber_list_m);
+    std::vector<Subscriber> &subscribers = subscriber_list[index];
+
+    // Leave out the subscribers that the update is held back from, and skip
+    // preparing it if that is all of them.
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<const Buffer> value;
+    size_t size = 0;
+    if (only == nullptr)
+    {
+        deadband_value(index, value, size);
+    }
+    bool any = false;
+    for (auto &sub : subscribers)
+    {
+        if (only != nullptr)
+        {
+            sub.due = sub.connection == only;
+            if (sub.due)
+            {
+                sub.last_sent = sub.last_update = now;
+                sub.held = 0;
+                sub.trailing = false;
+            }
+        }
+        else
+        {
+            admit(sub, var_table[index].var, value, size, now);
+        }
+        any = any || sub.due;
+    }
+    if (!any)
+    {
+        return;
+    }
+
+    Outgoing raw, shm;
+    prepare_update(index, raw, shm);
+    mark_sent(index, raw);
+
+    for (auto &sub : subscribers)
+    {
+        if (sub.due)
+        {
+            enqueue(sub.connection, update_for(sub, raw, shm), sub.conflate);
+        }
+    }
+}
+
+void State::notify_subscribers(const std::vector<size_t> &indices)
+{
+    struct Pending
+    {
+        Connection *connection;
+        bool conflate; // Of the only update, if there is just one.
+        Outgoing group;
+    };
+    std::vector<Pending> pending;
+
+    std::unique_lock lk(subscriber_list_m);
+
+    // Gather the updates for each subscriber into a group. A rate limit
+    // holds back the update of a variable on its own.
+    auto now = std::chrono::steady_clock::now();
+    for (size_t index : indices)
+    {
+        std::vector<Subscriber> &subscribers = subscriber_list[index];
+        std::shared_ptr<const Buffer> value;
+        size_t size = 0;
+        deadband_value(index, value, size);
+        bool any = false;
+        for (auto &sub : subscribers)
+        {
+            any = admit(sub, var_table[index].var, value, size, now) || any;
+        }
+        if (!any)
+        {
+            continue;
+        }
+
+        Outgoing raw, shm;
+        prepare_update(index, raw, shm);
+        mark_sent(index, raw);
+
+        for (auto &sub : subscribers)
+        {
+            if (!sub.due)
+            {
+                continue;
+            }
+
+            auto it = std::find_if(pending.begin(), pending.end(), [&sub](const Pending &p)
+            {
+                return p.connection == sub.connection;
+            });
+            if (it == pending.end())
+            {
+                it = pending.insert(pending.end(), {sub.connection, sub.conflate, {}});
+                it->group.header = {MESSAGE_GROUP, ENCODING_RAW, 0, 0};
+            }
+
+            Outgoing &member = it->group.members.emplace_back(update_for(sub, raw, shm));
+            it->group.header.data_size += message_length(member.header);
+        }
+    }
+
+    // A group of one is sent as a plain update.
+    for (auto &p : pending)
+    {
+        if (p.group.members.size() == 1)
+        {
+            enqueue(p.connection, std::move(p.group.members[0]), p.conflate);
+        }
+        else
+        {
+            enqueue(p.connection, std::move(p.group));
+        }
+    }
+}
+
+size_t State::message_length(const MessageHeader &header)
+{
+    return sizeof(header) + header.name_size + header.data_size;
+}
+
+int State::enqueue(Connection *c, Outgoing message, bool conflate)
+{
+    {
+        std::unique_lock lk(c->tx_m);
+        if (c->closed)
+        {
+            return -1;
+        }
+
+        // Messages that the I/O thread has taken to send must stay as they
+        // are. Nor may an update move ahead of a group with an older value
+        // of the same variable, which would then take it back.
+        for (size_t i = c->tx.size(); conflate && i > c->tx_frozen; --i)
+        {
+            Outgoing &queued = c->tx[i - 1];
+            bool in_group = std::any_of(queued.members.begin(), queued.members.end(), [&message](const Outgoing &m)
+            {
+                return m.name == message.name;
+            });
+            if (in_group)
+            {
+                break;
+            }
+            if (queued.name == message.name && queued.header.kind == message.header.kind)
+            {
+                c->tx_bytes -= message_length(queued.header);
+                c->tx_bytes += message_length(message.header);
+                queued = std::move(message);
+                return 0;
+            }
+        }
+
+        c->tx_bytes += message_length(message.header);
+        c->tx.push_back(std::move(message));
+
+        if (c->tx_scheduled)
+        {
+            return 0;
+        }
+        c->tx_scheduled = true;
+    }
+
+    IoThread &t = *c->io;
+    bool wake;
+    {
+        std::unique_lock lk(t.flush_m);
+        wake = t.flush_list.empty();
+        t.flush_list.push_back(c);
+    }
+    if (wake)
+    {
+        wake_io_thread(t);
+    }
+
+    return 0;
+}
+
+void State::gather(const Outgoing &m, struct iovec *iov, int &iovcnt, size_t &skip)
+{
+    struct iovec parts[4] = {
+        {(void *)&m.header, sizeof(m.header)},
+        {m.name ? (void *)m.name->data() : nullptr, m.header.name_size},
+        {(void *)m.small_data.data(), m.small_data.size()},
+        {m.data ? m.data->bytes : nullptr, m.data && m.members.empty() ? m.header.data_size - m.small_data.size() : 0},
+    };
+    for (auto &part : parts)
+    {
+        if (iovcnt == FLUSH_IOV)
+        {
+            return;
+        }
+        if (skip >= part.iov_len)
+        {
+            skip -= part.iov_len;
+            continue;
+        }
+        iov[iovcnt].iov_base = (char *)part.iov_base + skip;
+        iov[iovcnt].iov_len = part.iov_len - skip;
+        skip = 0;
+        ++iovcnt;
+    }
+
+    for (auto &member : m.members)
+    {
+        gather(member, iov, iovcnt, skip);
+    }
+}
+
+void State::encode_delta(Connection *c, Outgoing &m)
+{
+    Connection::Sent &base = c->sent[m.index];
+    std::shared_ptr<const Buffer> value = m.data;
+    const char *data = static_cast<const char *>(value->bytes);
+    size_t size = m.header.data_size;
+
+    DeltaHeader header = {0, m.header.version, (uint32_t)size, 0};
+    std::string encoded(sizeof(header), '\0');
+
+    // Collect the runs of blocks that changed, unless that would come to more
+    // than the whole value.
+    if (base.data && base.size == size && base.version != 0)
+    {
+        const char *old = static_cast<const char *>(base.data->bytes);
+        DeltaRun run = {0, 0};
+        auto append = [&]()
+        {
+            encoded.append((const char *)&run, sizeof(run));
+            encoded.append(data + run.offset, run.length);
+            ++header.runs;
+        };
+
+        for (size_t offset = 0; offset < size && encoded.size() < size; offset += DELTA_BLOCK)
+        {
+            size_t length = std::min<size_t>(DELTA_BLOCK, size - offset);
+            if (memcmp(old + offset, data + offset, length) == 0)
+            {
+                continue;
+            }
+            if (run.length > 0 && run.offset + run.length == offset)
+            {
+                run.length += length;
+                continue;
+            }
+            if (run.length > 0)
+            {
+                append();
+            }
+            run = {(uint32_t)offset, (uint32_t)length};
+        }
+        if (run.length > 0)
+        {
+            append();
+        }
+
+        header.base_version = base.version;
+    }
+
+    if (header.base_version == 0 || encoded.size() >= size)
+    {
+        // Send the whole value as a single run, straight from its buffer.
+        DeltaRun run = {0, (uint32_t)size};
+        header.base_version = 0;
+        header.runs = 1;
+        encoded.resize(sizeof(header));
+        encoded.append((const char *)&run, sizeof(run));
+    }
+    else
+    {
+        m.data = nullptr;
+    }
+    memcpy(encoded.data(), &header, sizeof(header));
+
+    base = {std::move(value), size, m.header.version};
+
+    m.header.encoding = ENCODING_DELTA;
+    m.header.data_size = encoded.size() + (m.data ? size : 0);
+    m.small_data = std::move(encoded);
+}
+
+void State::compress(Outgoing &m)
+{
+    // The headers at the start of the data are left as they are, and only
+    // the rest is compressed.
+    const std::string prefix = m.data ? m.small_data : std::string();
+    const char *body = m.data ? static_cast<const char *>(m.data->bytes) : m.small_data.data();
+    size_t body_size = m.header.data_size - prefix.size();
+    if (body_size < COMPRESS_THRESHOLD)
+    {
+        return;
+    }
+
+    // Only bother if it saves at least an eighth.
+    auto deflate = [body, body_size](Compressed &result)
+    {
+        size_t capacity = body_size - body_size / 8;
+        result.data = std::make_shared<Buffer>(capacity);
+        result.size = result.data->bytes ? lz::compress(body, body_size, result.data->bytes, capacity) : 0;
+        if (result.size == 0)
+        {
+            result.data = nullptr;
+        }
+    };
+
+    // The value itself is compressed once for all subscribers, whereas the
+    // changes sent to one are compressed for it alone.
+    Compressed own;
+    Compressed *compressed = &own;
+    if (m.data && m.compressed)
+    {
+        compressed = m.compressed.get();
+        std::call_once(compressed->once, deflate, *compressed);
+    }
+    else
+    {
+        deflate(own);
+    }
+    if (!compressed->data)
+    {
+        return;
+    }
+
+    LzHeader header = {m.header.encoding, {}, (uint32_t)prefix.size(), m.header.data_size};
+    m.small_data.assign((const char *)&header, sizeof(header));
+    m.small_data += prefix;
+    m.data = compressed->data;
+    m.header.encoding = ENCODING_LZ;
+    m.header.data_size = m.small_data.size() + compressed->size;
+}
+
+void State::quantize_values(Outgoing &m)
+{
+    if (!m.data || !m.quantized)
+    {
+        return;
+    }
+
+    Quantized &q = *m.quantized;
+    std::call_once(q.once, [this, &m, &q]()
+    {
+        const Variable &v = var_table[m.index].var;
+        size_t count = m.header.data_size / v.element_size;
+
+        auto convert = [&](const auto *values)
+        {
+            q.header.format = v.options.quantize;
+
+            // Check that the values fit the format, which for `QUANTIZE_I16`
+            // also decides what the steps are counted from.
+            double min = INFINITY, max = -INFINITY;
+            bool finite = true;
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (!std::isfinite(values[i]))
+                {
+                    finite = false;
+                    continue;
+                }
+                min = std::min<double>(min, values[i]);
+                max = std::max<double>(max, values[i]);
+            }
+            switch (q.header.format)
+            {
+            case QUANTIZE_F16:
+                if (std::max(-min, max) > 65504)
+                {
+                    return;
+                }
+                break;
+            case QUANTIZE_BF16:
+                if (std::max(-min, max) > FLT_MAX)
+                {
+                    return;
+                }
+                break;
+            case QUANTIZE_I16:
+                q.header.step = 2 * v.options.max_error;
+                q.header.offset = count > 0 ? min + (max - min) / 2 : 0;
+                if (!finite || (max - min) / q.header.step > 65534)
+                {
+                    return;
+                }
+                break;
+            default:
+                return;
+            }
+
+            auto buffer = std::make_shared<Buffer>(count * sizeof(uint16_t));
+            if (buffer->bytes == nullptr && count > 0)
+            {
+                return;
+            }
+            switch (q.header.format)
+            {
+            case QUANTIZE_F16:
+                quantize::to_f16(values, count, static_cast<uint16_t *>(buffer->bytes));
+                break;
+            case QUANTIZE_BF16:
+                quantize::to_bf16(values, count, static_cast<uint16_t *>(buffer->bytes));
+                break;
+            default:
+                quantize::to_i16(values, count, q.header.offset, q.header.step, static_cast<int16_t *>(buffer->bytes));
+                break;
+            }
+            q.data = std::move(buffer);
+        };
+
+        if (v.type == FLOAT)
+        {
+            convert(static_cast<const float *>(m.data->bytes));
+        }
+        else
+        {
+            convert(static_cast<const double *>(m.data->bytes));
+        }
+    });
+
+    // Values that do not fit are sent as they are.
+    if (!q.data)
+    {
+        return;
+    }
+
+    size_t count = m.header.data_size / var_table[m.index].var.element_size;
+    m.small_data.assign((const char *)&q.header, sizeof(q.header));
+    m.data = q.data;
+    m.compressed = q.compressed;
+    m.header.encoding = ENCODING_QUANTIZED;
+    m.header.data_size = sizeof(q.header) + count * sizeof(uint16_t);
+}
+
+int State::dequantize(const Slot &s, MessageHeader &header, const char *&data, std::vector<char> &values)
+{
+    QuantizedHeader q;
+    if (!s.var.is_array || (s.var.type != FLOAT && s.var.type != DOUBLE) || header.data_size < sizeof(q) ||
+        (header.data_size - sizeof(q)) % sizeof(uint16_t) != 0)
+    {
+        return -1;
+    }
+    memcpy(&q, data, sizeof(q));
+
+    // The values follow a name of any length, so they may need aligning.
+    size_t count = (header.data_size - sizeof(q)) / sizeof(uint16_t);
+    const char *in = data + sizeof(q);
+    std::vector<uint16_t> aligned;
+    if ((uintptr_t)in % alignof(uint16_t) != 0)
+    {
+        aligned.resize(count);
+        memcpy(aligned.data(), in, count * sizeof(uint16_t));
+        in = (const char *)aligned.data();
+    }
+
+    values.resize(count * s.var.element_size);
+    auto convert = [&](auto *out) -> int
+    {
+        switch (q.format)
+        {
+        case QUANTIZE_F16:
+            quantize::from_f16((const uint16_t *)in, count, out);
+            return 0;
+        case QUANTIZE_BF16:
+            quantize::from_bf16((const uint16_t *)in, count, out);
+            return 0;
+        case QUANTIZE_I16:
+            quantize::from_i16((const int16_t *)in, count, q.offset, q.step, out);
+            return 0;
+        default:
+            return -1;
+        }
+    };
+    int ret = s.var.type == FLOAT ? convert((float *)values.data()) : convert((double *)values.data());
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    header.encoding = ENCODING_RAW;
+    header.data_size = values.size();
+    data = values.data();
+    return 0;
+}
+
+void State::encode(Connection *c, Outgoing &m)
+{
+    if (!m.members.empty())
+    {
+        m.header.data_size = 0;
+        for (auto &member : m.members)
+        {
+            encode(c, member);
+            m.header.data_size += message_length(member.header);
+        }
+        return;
+    }
+
+    // Deltas are exact, so they take precedence over quantization.
+    if (m.delta)
+    {
+        m.delta = false;
+        encode_delta(c, m);
+    }
+    else if (m.quantize)
+    {
+        m.quantize = false;
+        quantize_values(m);
+    }
+    if (m.compress)
+    {
+        m.compress = false;
+        compress(m);
+    }
+    m.compressed = nullptr;
+    m.quantized = nullptr;
+}
+
+int State::inflate(MessageHeader &header, const char *&data, std::vector<char> &inflated)
+{
+    LzHeader lz;
+    if (header.data_size < sizeof(lz))
+    {
+        return -1;
+    }
+    memcpy(&lz, data, sizeof(lz));
+    if (lz.encoding == ENCODING_LZ || lz.prefix_size > header.data_size - sizeof(lz) || lz.prefix_size > lz.size)
+    {
+        return -1;
+    }
+
+    inflated.resize(lz.size);
+    const char *prefix = data + sizeof(lz);
+    memcpy(inflated.data(), prefix, lz.prefix_size);
+
+    size_t compressed_size = header.data_size - sizeof(lz) - lz.prefix_size;
+    size_t body_size = lz.size - lz.prefix_size;
+    if (lz::decompress(prefix + lz.prefix_size, compressed_size, inflated.data() + lz.prefix_size, body_size) != (ssize_t)body_size)
+    {
+        return -1;
+    }
+
+    header.encoding = lz.encoding;
+    header.data_size = lz.size;
+    data = inflated.data();
+    return 0;
+}
+
+int State::flush_connection(Connection *c)
+{
+    if (c->io->uring)
+    {
+        return uring_send(c);
+    }
+
+    std::unique_lock lk(c->tx_m);
+
+    while (!c->tx.empty())
+    {
+        // Take a batch of messages to send. Once taken they are neither
+        // replaced nor removed by others, so they may be used without `tx_m`
+        // while others queue more.
+        Outgoing *batch[FLUSH_BATCH];
+        size_t count = std::min<size_t>(c->tx.size(), FLUSH_BATCH);
+        for (size_t i = 0; i < count; ++i)
+        {
+            batch[i] = &c->tx[i];
+        }
+        size_t frozen = c->tx_frozen;
+        c->tx_frozen = std::max(frozen, count);
+        size_t skip = c->tx_offset;
+        lk.unlock();
+
+        // Encode the messages that were just taken, which may change their
+        // size.
+        size_t before = 0, after = 0;
+        for (size_t i = frozen; i < count; ++i)
+        {
+            before += message_length(batch[i]->header);
+            encode(c, *batch[i]);
+            after += message_length(batch[i]->header);
+        }
+
+        // Gather the messages, skipping what has been sent already.
+        struct iovec iov[FLUSH_IOV];
+        int iovcnt = 0;
+        for (size_t i = 0; i < count && iovcnt < FLUSH_IOV; ++i)
+        {
+            gather(*batch[i], iov, iovcnt, skip);
+        }
+
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t ret = sendmsg(c->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        lk.lock();
+        c->tx_bytes = c->tx_bytes - before + after;
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Carry on once the other program has made room; the
+                // connection stays scheduled until then.
+                if (!c->tx_waiting)
+                {
+                    c->tx_waiting = true;
+                    return c->io->reactor->watch_output(c->socket, true);
+                }
+                return 0;
+            }
+            return -1;
+        }
+
+        consume_sent(c, ret);
+    }
+
+    c->tx_scheduled = false;
+    if (c->tx_waiting)
+    {
+        c->tx_waiting = false;
+        return c->io->reactor->watch_output(c->socket, false);
+    }
+
+    return 0;
+}
+
+void State::consume_sent(Connection *c, size_t bytes)
+{
+    c->tx_bytes -= bytes;
+    c->tx_total += bytes;
+    size_t sent = c->tx_offset + bytes;
+    while (!c->tx.empty() && sent >= message_length(c->tx.front().header))
+    {
+        sent -= message_length(c->tx.front().header);
+        c->tx.pop_front();
+        --c->tx_frozen;
+    }
+    c->tx_offset = sent;
+}
+
+void State::handle_input(Connection *c)
+{
+    // The reactor only reports new input, so keep reading until the socket
+    // runs dry.
+    while (true)
+    {
+        // Make room at the end of the buffer.
+        if (c->rx_end == c->rx.size())
+        {
+            if (c->rx_start > 0)
+            {
+                memmove(c->rx.data(), c->rx.data() + c->rx_start, c->rx_end - c->rx_start);
+                c->rx_end -= c->rx_start;
+                c->rx_start = 0;
+            }
+            else
+            {
+                c->rx.resize(2 * c->rx.size());
+            }
+        }
+
+        ssize_t n = recv(c->socket, c->rx.data() + c->rx_end, c->rx.size() - c->rx_end, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (n <= 0)
+        {
+            close_connection(c);
+            return;
+        }
+        c->rx_end += n;
+
+        if (handle_messages(c) < 0)
+        {
+            close_connection(c);
+            return;
+        }
+    }
+}
+
+int State::handle_messages(Connection *c)
+{
+    while (c->rx_end - c->rx_start >= sizeof(MessageHeader))
+    {
+        MessageHeader header;
+        memcpy(&header, c->rx.data() + c->rx_start, sizeof(header));
+
+        // Wait for the rest of the message, making sure that it will fit.
+        size_t length = sizeof(header) + header.name_size + header.data_size;
+        if (c->rx_end - c->rx_start < length)
+        {
+            if (c->rx.size() - c->rx_start < length)
+            {
+                memmove(c->rx.data(), c->rx.data() + c->rx_start, c->rx_end - c->rx_start);
+                c->rx_end -= c->rx_start;
+                c->rx_start = 0;
+                if (c->rx.size() < length)
+                {
+                    c->rx.resize(length);
+                }
+            }
+            return 0;
+        }
+
+        const char *name = c->rx.data() + c->rx_start + sizeof(header);
+        const char *data = name + header.name_size;
+        c->rx_start += length;
+
+        // A group has no name of its own.
+        if (header.kind == MESSAGE_GROUP)
+        {
+            if (recv_group(c, data, header.data_size) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        // Check if the variable exists.
+        size_t index = var_index->find(std::string_view(name, header.name_size));
+        if (index == SIZE_MAX)
+        {
+            return -1;
+        }
+
+        // Decode before taking any lock.
+        if (header.encoding == ENCODING_LZ && inflate(header, data, c->inflated) < 0)
+        {
+            return -1;
+        }
+        if (header.encoding == ENCODING_QUANTIZED && dequantize(var_table[index], header, data, c->dequantized) < 0)
+        {
+            return -1;
+        }
+
+        int ret;
+        switch (header.kind)
+        {
+        case MESSAGE_UPDATE:
+        case MESSAGE_REQUEST:
+            ret = recv_message(c, header, index, data);
+            break;
+        case MESSAGE_INTEREST:
+            ret = recv_interest(c, header, index, data);
+            break;
+        case MESSAGE_RESYNC:
+            ret = recv_resync(c, index);
+            break;
+        case MESSAGE_REJECT:
+            ret = recv_reject(c, index);
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    if (c->rx_start == c->rx_end)
+    {
+        c->rx_start = c->rx_end = 0;
+    }
+
+    return 0;
+}
+
+int State::recv_message(Connection *c, const MessageHeader &header, size_t index, const char *data)
+{
+    Slot &s = var_table[index];
+
+    // Only the owner may send updates, and only others may request them.
+    if ((header.kind == MESSAGE_UPDATE) == s.owned)
+    {
+        return -1;
+    }
+
+    std::unique_lock lk(s.lock);
+
+    int ret = apply_update(c, s, header, data);
+    if (ret != 0)
+    {
+        return ret < 0 ? ret : 0;
+    }
+
+    s.var.last_updated = std::chrono::system_clock::now();
+    notify_waiters(s);
+
+    // Pass requested updates on to our subscribers.
+    if (header.kind == MESSAGE_REQUEST)
+    {
+        lk.unlock();
+        notify_subscribers(index);
+    }
+
+    return 0;
+}
+
+int State::check_update(Connection *c, const Slot &s, const MessageHeader &header, const char *data)
+{
+    if (header.encoding == ENCODING_SHM)
+    {
+        // Only the owner may tell us where to read its variable from, or
+        // anyone could point it at a segment of their own.
+        if (header.kind != MESSAGE_UPDATE || s.owned || c != s.var.owner_connection)
+        {
+            return -1;
+        }
+        return 0;
+    }
+    if (header.encoding == ENCODING_DELTA)
+    {
+        return check_delta(s.var, data, header.data_size);
+    }
+
+    // A scalar may be set from a narrower type, but never a wider one, and
+    // a struct only as a whole.
+    if (!s.var.resizable() && header.data_size > s.var.element_size)
+    {
+        return -1;
+    }
+    if (s.var.type == STRUCT && header.data_size % s.var.element_size != 0)
+    {
+        return -1;
+    }
+    if (s.var.type == TENSOR && !valid_tensor(s.var, data, header.data_size))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int State::check_delta(const Variable &v, const char *data, size_t data_size)
+{
+    DeltaHeader header;
+    if (data_size < sizeof(header))
+    {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (header.size % v.element_size != 0 || (!v.resizable() && header.size != v.element_size))
+    {
+        return -1;
+    }
+
+    const char *end = data + data_size;
+    const char *p = data + sizeof(header);
+    for (uint32_t i = 0; i < header.runs; ++i)
+    {
+        DeltaRun run;
+        if ((size_t)(end - p) < sizeof(run))
+        {
+            return -1;
+        }
+        memcpy(&run, p, sizeof(run));
+        p += sizeof(run);
+        if (run.offset > header.size || run.length > header.size - run.offset || (size_t)(end - p) < run.length)
+        {
+            return -1;
+        }
+        p += run.length;
+    }
+
+    return 0;
+}
+
+int State::apply_update(Connection *c, Slot &s, const MessageHeader &header, const char *data)
 {
-    int var_name_size, var_data_size;
-    bool is_request;
-    int err;
+    if (check_update(c, s, header, data) < 0)
+    {
+        return -1;
+    }
+
+    if (header.encoding == ENCODING_SHM)
+    {
+        if (recv_shm(s, std::string(data, header.data_size)) < 0)
+        {
+            // Rather than keep a stale value until the next update, which
+            // may never come, ask the owner to send this one again. Only ask
+            // once until a read succeeds, in case the segment cannot be read
+            // at all.
+            if (!s.var.resync)
+            {
+                s.var.resync = true;
+                Outgoing resync = {};
+                resync.header = {MESSAGE_RESYNC, ENCODING_RAW, (uint16_t)s.name.size(), 0};
+                resync.name = &s.name;
+                enqueue(c, std::move(resync));
+            }
+            return 1;
+        }
+        s.var.resync = false;
+        return 0;
+    }
+
+    // Should an update arrive after a newer one, keep the newer value. Shared
+    // memory is left out, as it is read at its latest whatever the message.
+    if (header.kind == MESSAGE_UPDATE && header.version < s.var.version)
+    {
+        return 1;
+    }
+    if (header.encoding == ENCODING_DELTA)
+    {
+        return recv_delta(c, s, data);
+    }
+
+    store(s.var, data, header.data_size, header.data_size / s.var.element_size);
+
+    // Updates keep the version of the owner, while the owner numbers the
+    // values that it is asked for itself.
+    if (header.kind == MESSAGE_UPDATE)
+    {
+        s.var.version = header.version;
+        s.var.received = true;
+    }
+
+    return 0;
+}
+
+int State::recv_delta(Connection *c, Slot &s, const char *data)
+{
+    Variable &v = s.var;
+
+    DeltaHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t element_size = v.element_size;
+
+    // A delta only applies to the value it was made from. Otherwise ask for
+    // the value in full, and ignore deltas until it arrives.
+    if (header.base_version != 0 && (v.resync || header.base_version != v.version || header.size != v.size * element_size))
+    {
+        if (!v.resync)
+        {
+            v.resync = true;
+            Outgoing resync = {};
+            resync.header = {MESSAGE_RESYNC, ENCODING_RAW, (uint16_t)s.name.size(), 0};
+            resync.name = &s.name;
+            enqueue(c, std::move(resync));
+        }
+        return 1;
+    }
+
+    std::shared_ptr<Buffer> buffer = acquire_buffer(v, header.size, true);
+    if (header.base_version != 0 && buffer != v.data)
+    {
+        memcpy(buffer->bytes, v.data->bytes, header.size);
+    }
 
-    // Check if this is an interest message or an update request.
-    if ((err = read_all_bytes(socket, &is_request, 1)) <= 0)
+    const char *p = data + sizeof(header);
+    for (uint32_t i = 0; i < header.runs; ++i)
     {
-        return (err == 0) ? -1 : err;
+        DeltaRun run;
+        memcpy(&run, p, sizeof(run));
+        memcpy(static_cast<char *>(buffer->bytes) + run.offset, p + sizeof(run), run.length);
+        p += sizeof(run) + run.length;
     }
 
-    // Read the size of the variable name.
-    if ((err = read_all_bytes(socket, &var_name_size, sizeof(var_name_size))) < 0)
+    publish_buffer(v, std::move(buffer));
+    v.size = header.size / element_size;
+    v.version = header.version;
+
+    // A small struct is also read without the lock, from its bits.
+    if (v.scalar)
     {
-        return err;
+        uint64_t bits = 0;
+        memcpy(&bits, v.data->bytes, header.size);
+        v.scalar->bits.store(bits, std::memory_order_release);
     }
+    v.received = true;
+    v.resync = false;
+
+    return 0;
+}
 
-    // Read the variable name.
-    std::string var(var_name_size, 0);
-    if ((err = read_all_bytes(socket, &var[0], var_name_size)) < 0)
+int State::recv_resync(Connection *c, size_t index)
+{
+    if (!var_table[index].owned)
     {
-        return err;
+        return -1;
     }
 
-    // Check if the variable exists.
-    if (vars.find(var) == vars.end())
+    // Forget what was sent, so that the next update is sent in full.
+    c->sent[index] = {};
+    notify_subscribers(index, c);
+
+    return 0;
+}
+
+int State::recv_reject(Connection *c, size_t index)
+{
+    Slot &s = var_table[index];
+    std::unique_lock lk(s.lock);
+    if (s.owned || c != s.var.owner_connection)
     {
         return -1;
     }
 
-    std::unique_lock lk(var_locks[var]);
+    s.rejected = true;
+    notify_waiters(s);
 
-    // Update request.
-    if (is_request)
+    return 0;
+}
+
+int State::recv_group(Connection *c, const char *data, size_t data_size)
+{
+    struct Member
     {
-        // Read the size of the data.
-        if ((err = read_all_bytes(socket, &var_data_size, sizeof(var_data_size))) < 0)
+        size_t index;
+        MessageHeader header;
+        const char *data;
+    };
+
+    // Check and decode the whole group before applying any of it.
+    std::vector<Member> members;
+    std::vector<std::vector<char>> decoded;
+    size_t offset = 0;
+    while (offset < data_size)
+    {
+        Member m;
+        if (data_size - offset < sizeof(m.header))
+        {
+            return -1;
+        }
+        memcpy(&m.header, data + offset, sizeof(m.header));
+        if (data_size - offset < message_length(m.header) || m.header.kind != MESSAGE_UPDATE)
+        {
+            return -1;
+        }
+
+        const char *name = data + offset + sizeof(m.header);
+        size_t index = var_index->find(std::string_view(name, m.header.name_size));
+        if (index == SIZE_MAX || var_table[index].owned)
         {
-            return err;
+            return -1;
+        }
+
+        m.index = index;
+        m.data = name + m.header.name_size;
+        offset += message_length(m.header);
+        if (m.header.encoding == ENCODING_LZ && inflate(m.header, m.data, decoded.emplace_back()) < 0)
+        {
+            return -1;
+        }
+        if (m.header.encoding == ENCODING_QUANTIZED && dequantize(var_table[m.index], m.header, m.data, decoded.emplace_back()) < 0)
+        {
+            return -1;
         }
+        members.push_back(m);
+    }
 
-        // Free the old data.
-        free(vars[var].data);
+    // Lock the variables in table order, as `publish` does.
+    std::sort(members.begin(), members.end(), [](const Member &a, const Member &b)
+    {
+        return a.index < b.index;
+    });
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+        if (i > 0 && members[i].index == members[i - 1].index)
+        {
+            return -1;
+        }
+        locks.emplace_back(var_table[members[i].index].lock);
+    }
 
-        // Allocate memory for the new data.
-        vars[var].data = malloc(var_data_size);
-        if (vars[var].data == nullptr)
+    // Check every member before applying any, so that a group is applied
+    // as a whole or not at all.
+    for (auto &m : members)
+    {
+        if (check_update(c, var_table[m.index], m.header, m.data) < 0)
         {
-            perror("malloc()");
             return -1;
         }
+    }
 
-        // Read the data.
-        if ((err = read_all_bytes(socket, vars[var].data, var_data_size)) < 0)
+    // A member may still be skipped, such as a delta that does not fit the
+    // current value, in which case the variable is left as it was.
+    auto now = std::chrono::system_clock::now();
+    std::vector<Slot *> applied;
+    for (auto &m : members)
+    {
+        Slot &s = var_table[m.index];
+        if (apply_update(c, s, m.header, m.data) == 0)
         {
-            return err;
+            s.var.last_updated = now;
+            applied.push_back(&s);
         }
+    }
+
+    for (Slot *s : applied)
+    {
+        notify_waiters(*s);
+    }
+
+    return 0;
+}
 
-        // Update the size of the variable.
-        vars[var].size = var_data_size / type_size(vars[var].type);
-        vars[var].last_updated = std::chrono::system_clock::now();
+int State::recv_shm(Slot &s, const std::string &name)
+{
+    // The owner moves to a new segment when the data outgrows the old one.
+    if (!s.var.shm || s.var.shm->name() != name)
+    {
+        s.var.shm = ShmSegment::open(name);
+    }
 
-        var_cvs[var].notify_all();
+    // Fail if the segment cannot be read, so that the value is asked for
+    // again.
+    std::shared_ptr<Buffer> data;
+    ssize_t size = -1;
+    uint64_t version = 0;
+    if (s.var.shm)
+    {
+        size = s.var.shm->read([&](size_t size) -> void *
+        {
+            if (!data || data->capacity < size)
+            {
+                data = acquire_buffer(s.var, size, false);
+            }
+            return (data->bytes != nullptr || size == 0) ? data->bytes : nullptr;
+        }, version);
     }
-    // Interest message.
-    else
+    if (size < 0)
+    {
+        return -1;
+    }
+    publish_buffer(s.var, std::move(data));
+
+    // The slot read may hold a newer value than the message named, so its
+    // version comes from the slot as well.
+    s.var.version = version;
+    s.var.received = true;
+
+    // Update the size of the variable.
+    s.var.size = size / s.var.element_size;
+
+    return 0;
+}
+
+int State::recv_interest(Connection *c, const MessageHeader &header, size_t index, const char *data)
+{
+    Slot &s = var_table[index];
+
+    InterestData options;
+    memcpy(&options, data, std::min<size_t>(header.data_size, sizeof(options)));
+
+    // A subscriber that lays the struct out differently would misread it,
+    // so it is told that it gets no updates.
+    if (s.var.type == STRUCT && options.layout != s.var.layout)
+    {
+        std::cerr << "Rejecting interest in '" << s.name << "' from " << peer_address(c->socket)
+                  << ", which has a different layout of the struct." << std::endl;
+        Outgoing reject = {};
+        reject.header = {MESSAGE_REJECT, ENCODING_RAW, (uint16_t)s.name.size(), 0};
+        reject.name = &s.name;
+        enqueue(c, std::move(reject));
+        return 0;
+    }
+
+    // Shared memory is only possible if the subscriber is on this host.
+    bool shm = options.shm && (s.var.is_array || s.var.type == TENSOR) && same_host(c->socket);
+    bool delta = options.delta && (s.var.resizable() || s.var.type == STRUCT);
+
+    // Add the connection to the subscriber list, or update its options if it
+    // subscribed before.
     {
-        // Add the socket to the subscriber list.
         std::unique_lock lk(subscriber_list_m);
-        subscriber_list[var].push_back(socket);
+        std::vector<Subscriber> &subscribers = subscriber_list[index];
+        auto it = std::find_if(subscribers.begin(), subscribers.end(), [c](const Subscriber &sub)
+        {
+            return sub.connection == c;
+        });
+        if (it == subscribers.end())
+        {
+            it = subscribers.insert(subscribers.end(), Subscriber());
+            it->connection = c;
+        }
+        it->shm = shm;
+        it->conflate = options.conflate;
+        it->delta = delta && !shm;
+        it->compress = options.compress && s.var.options.compress;
+        it->quantize = options.quantize && s.var.options.quantize != QUANTIZE_NONE;
+        it->min_interval = std::chrono::microseconds(options.min_interval);
+        it->decimation = std::max<uint32_t>(options.decimation, 1);
+        it->trailing = false;
+
+        // Only numbers have a deadband.
+        bool numeric = s.var.type <= DOUBLE;
+        it->deadband = numeric ? options.deadband : 0;
+        it->relative_deadband = numeric ? options.relative_deadband : 0;
+        it->has_sent = false;
     }
 
-    lk.unlock();
-    notify_subscribers(var);
+    // Bring the new subscriber up to date.
+    notify_subscribers(index, c);
 
     return 0;
 }
 
-int State::send_interest(int socket, std::string var)
+int State::send_interest(const Slot &s, bool shm)
+{
+    InterestData options;
+    options.shm = shm;
+    options.conflate = s.subscription.conflate;
+    options.delta = s.subscription.delta;
+    options.compress = 1;
+    options.quantize = 1;
+    options.layout = s.var.layout;
+    options.min_interval = std::min<int64_t>(s.subscription.min_interval.count(), UINT32_MAX);
+    options.decimation = s.subscription.decimation;
+    options.deadband = s.subscription.deadband;
+    options.relative_deadband = s.subscription.relative_deadband;
+
+    Outgoing message = {};
+    message.header = {MESSAGE_INTEREST, ENCODING_RAW, (uint16_t)s.name.size(), sizeof(options)};
+    message.name = &s.name;
+    message.small_data = std::string((const char *)&options, sizeof(options));
+    return enqueue(s.var.owner_connection, std::move(message));
+}
+
+int State::request_update(const Slot &s, const void *data, int data_size)
+{
+    // The caller's data may change as soon as we return, so it is copied.
+    auto buffer = std::make_shared<Buffer>(data_size);
+    memcpy(buffer->bytes, data, data_size);
+
+    Outgoing message = {};
+    message.header = {MESSAGE_REQUEST, ENCODING_RAW, (uint16_t)s.name.size(), (uint32_t)data_size};
+    message.name = &s.name;
+    message.data = std::move(buffer);
+    return enqueue(s.var.owner_connection, std::move(message));
+}
+
+size_t State::find_var(std::string_view var)
 {
-    int var_name_size = var.size();
-    int err;
+    size_t index = var_index->find(var);
+    if (index == SIZE_MAX)
+    {
+        throw std::runtime_error("Variable " + std::string(var) + " does not exist.");
+    }
+
+    return index;
+}
 
-    // Send our interest value.
-    bool request = false;
-    if ((err = send(socket, &request, 1, MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
+void State::check_owner(const Slot &s)
+{
+    if (!s.owned && s.var.owner_connection == nullptr)
     {
-        return err;
+        throw std::runtime_error("Variable " + s.name + " has no owner registered.");
     }
+}
 
-    // Send the size of the variable name.
-    if ((err = send(socket, &var_name_size, sizeof(var_name_size), MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
+void State::check_rejected(const Slot &s)
+{
+    if (s.rejected)
     {
-        return err;
+        throw std::runtime_error("Owner of '" + s.name + "', '" + s.var.owner +
+                                 "', refused to send it, as it lays the struct out differently.");
     }
+}
+
+bool State::register_interest(Slot &s)
+{
+    check_owner(s);
+    check_rejected(s);
 
-    // Send the variable name.
-    if ((err = send(socket, &var[0], var_name_size, MSG_NOSIGNAL)) < 0)
+    if (s.owned || s.interested)
     {
-        return err;
+        return false;
     }
 
-    return 0;
+    // Large values are best read from shared memory when the owner is on this
+    // host; the owner falls back to the socket if it cannot provide it.
+    bool shm = (s.var.is_array || s.var.type == TENSOR) && !s.subscription.delta && same_host(s.var.owner_connection->socket);
+    if (send_interest(s, shm) < 0)
+    {
+        throw std::runtime_error("Owner of '" + s.name + "', '" + s.var.owner + "', is no longer connected.");
+    }
+    s.interested = true;
+
+    return true;
 }
 
-int State::request_update(int socket, std::string var, void *data, int data_size)
+void State::publish(const std::vector<Update> &updates)
 {
-    int var_name_size = var.size();
-    int err;
+    std::vector<std::pair<size_t, const Update *>> entries;
+    for (auto &u : updates)
+    {
+        size_t index = u.index;
+        if (index == SIZE_MAX)
+        {
+            index = find_var(u.var);
+            u.check(*this, index);
+        }
+        else if (u.schema != schema)
+        {
+            throw std::runtime_error("Invalid variable handle.");
+        }
 
-    // Send request value;
-    bool request = true;
-    if ((err = send(socket, &request, 1, MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
+        Slot &s = slot(index);
+        if (!s.owned)
+        {
+            throw std::runtime_error("Variable " + s.name + " is not owned by this program.");
+        }
+        entries.push_back({index, &u});
+    }
+
+    // Lock the variables in table order, so that concurrent groups cannot
+    // deadlock.
+    std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b)
+    {
+        return a.first < b.first;
+    });
+    std::vector<std::unique_lock<std::mutex>> locks;
+    std::vector<size_t> indices;
+    for (auto &e : entries)
+    {
+        if (!indices.empty() && indices.back() == e.first)
+        {
+            throw std::runtime_error("Variable " + var_table[e.first].name + " is published twice.");
+        }
+        indices.push_back(e.first);
+    }
+    for (size_t index : indices)
     {
-        return err;
+        locks.emplace_back(var_table[index].lock);
     }
 
-    // Send the size of the variable name.
-    if ((err = send(socket, &var_name_size, sizeof(var_name_size), MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
+    auto now = std::chrono::system_clock::now();
+    for (auto &e : entries)
     {
-        return err;
+        Slot &s = var_table[e.first];
+        store(s.var, e.second->data, e.second->data_size, e.second->count);
+        s.var.last_updated = now;
     }
 
-    // Send the variable name.
-    if ((err = send(socket, &var[0], var_name_size, MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
+    for (size_t index : indices)
     {
-        return err;
+        notify_waiters(var_table[index]);
     }
+    locks.clear();
+
+    notify_subscribers(indices);
+}
 
-    // Send the size of the data.
-    if ((err = send(socket, &data_size, sizeof(data_size), MSG_HAVEMORE | MSG_NOSIGNAL)) < 0)
+void State::subscribe_slot(size_t index, const Subscription &options)
+{
+    Slot &s = slot(index);
+    std::unique_lock lk(s.lock);
+
+    // Send the options even if we are subscribed already.
+    s.subscription = options;
+    s.interested = false;
+    s.rejected = false;
+    register_interest(s);
+}
+
+void State::on_change_slot(size_t index, std::function<void()> handler)
+{
+    Slot &s = slot(index);
+    bool subscribe = handler != nullptr;
     {
-        return err;
+        std::unique_lock lk(handlers_m);
+        if (subscribe)
+        {
+            start_handler_threads();
+        }
+
+        // A call that is queued or running keeps the handler it started with.
+        s.handler = subscribe ? std::make_shared<const std::function<void()>>(std::move(handler)) : nullptr;
+        s.has_handler.store(subscribe, std::memory_order_release);
     }
 
-    // Send the data.
-    if ((err = send(socket, data, data_size, MSG_NOSIGNAL)) < 0)
+    // The handler is in place first, so that it is called for the value that
+    // the owner sends in reply.
+    if (subscribe)
     {
-        return err;
+        std::unique_lock lk(s.lock);
+        register_interest(s);
     }
+}
 
-    return 0;
+void State::start_handler_threads()
+{
+    if (handler_threads.empty())
+    {
+        for (unsigned i = 0; i < handler_thread_count; ++i)
+        {
+            handler_threads.emplace_back(&State::handler_loop, this);
+        }
+    }
+}
+
+bool State::when_changed(size_t index, bool first_value, std::function<void()> continuation)
+{
+    Slot &s = slot(index);
+    {
+        std::unique_lock lk(handlers_m);
+        start_handler_threads();
+    }
+
+    std::unique_lock lk(s.lock);
+
+    // As in `get`, wait for the first value unless it is there. If the owner
+    // refused to send it, `get` is left to throw.
+    if (first_value && s.rejected)
+    {
+        return false;
+    }
+    register_interest(s);
+    if (first_value && (s.owned || s.var.received))
+    {
+        return false;
+    }
+    s.continuations.push_back(std::move(continuation));
+    return true;
+}
+
+std::future<void> State::changed_future_slot(size_t index)
+{
+    auto promise = std::make_shared<std::promise<void>>();
+    std::future<void> future = promise->get_future();
+    when_changed(index, false, [promise] { promise->set_value(); });
+    return future;
+}
+
+void State::queue_continuations(Slot &s)
+{
+    std::unique_lock lk(handlers_m);
+    for (auto &c : s.continuations)
+    {
+        handler_tasks.push_back(std::move(c));
+    }
+    s.continuations.clear();
+    lk.unlock();
+    handlers_cv.notify_all();
+}
+
+HandlerStats State::handler_stats_slot(size_t index)
+{
+    Slot &s = slot(index);
+    std::unique_lock lk(handlers_m);
+
+    return s.handler_stats;
+}
+
+void State::queue_handler(Slot &s)
+{
+    std::unique_lock lk(handlers_m);
+    if (!s.handler)
+    {
+        return;
+    }
+
+    if (s.handler_queued)
+    {
+        ++s.handler_stats.coalesced;
+        return;
+    }
+    s.handler_queued = true;
+    s.handler_queued_at = std::chrono::steady_clock::now();
+
+    // A running call queues the next one itself when it ends, which keeps the
+    // calls for a variable in order.
+    if (!s.handler_running)
+    {
+        handler_queue.push_back(&s);
+        lk.unlock();
+        handlers_cv.notify_one();
+    }
+}
+
+void State::handler_loop()
+{
+    std::unique_lock lk(handlers_m);
+    while (true)
+    {
+        handlers_cv.wait(lk, [this] { return handlers_stopping || !handler_queue.empty() || !handler_tasks.empty(); });
+        if (handlers_stopping)
+        {
+            return;
+        }
+
+        if (!handler_tasks.empty())
+        {
+            std::function<void()> task = std::move(handler_tasks.front());
+            handler_tasks.pop_front();
+            lk.unlock();
+            try
+            {
+                task();
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Continuation failed: " << e.what() << std::endl;
+            }
+            lk.lock();
+            continue;
+        }
+
+        Slot &s = *handler_queue.front();
+        handler_queue.pop_front();
+        s.handler_queued = false;
+        std::shared_ptr<const std::function<void()>> handler = s.handler;
+        if (!handler)
+        {
+            continue;
+        }
+
+        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - s.handler_queued_at);
+        HandlerStats &stats = s.handler_stats;
+        ++stats.calls;
+        stats.total_latency += latency;
+        stats.max_latency = std::max(stats.max_latency, latency);
+        s.handler_running = true;
+
+        lk.unlock();
+        try
+        {
+            (*handler)();
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Change handler of '" << s.name << "' failed: " << e.what() << std::endl;
+        }
+        lk.lock();
+
+        s.handler_running = false;
+        if (s.handler_queued)
+        {
+            handler_queue.push_back(&s);
+        }
+    }
+}
+
+void State::wait_slot(size_t index)
+{
+    Slot &s = slot(index);
+    std::unique_lock lk(s.lock);
+
+    register_interest(s);
+
+    // The first value counts as a change, even if the owner never set it.
+    uint64_t version = s.var.version;
+    bool received = s.var.received;
+    s.cv.wait(lk, [&] { return s.var.version != version || s.var.received != received; });
+}
+
+uint64_t State::wait_newer_than_slot(size_t index, uint64_t version, std::chrono::steady_clock::time_point deadline)
+{
+    Slot &s = slot(index);
+    std::unique_lock lk(s.lock);
+
+    register_interest(s);
+
+    auto newer = [&] { return s.var.version > version; };
+    if (deadline == std::chrono::steady_clock::time_point::max())
+    {
+        s.cv.wait(lk, newer);
+    }
+    else
+    {
+        s.cv.wait_until(lk, deadline, newer);
+    }
+    return s.var.version;
 }
 
-void State::check_var_exists(std::string var)
+std::vector<size_t> State::resolve(const std::vector<VarRef> &vars)
 {
-    if (vars.find(var) == vars.end())
+    std::vector<size_t> indices;
+    indices.reserve(vars.size());
+    for (auto &v : vars)
+    {
+        if (v.index == SIZE_MAX)
+        {
+            indices.push_back(find_var(v.var));
+        }
+        else if (v.schema != schema)
+        {
+            throw std::runtime_error("Invalid variable handle.");
+        }
+        else
+        {
+            indices.push_back(v.index);
+        }
+    }
+    return indices;
+}
+
+std::vector<size_t> State::wait_slots(const std::vector<size_t> &indices, bool all,
+                                      std::chrono::steady_clock::time_point deadline)
+{
+    Waiter w;
+    w.changed.assign(indices.size(), false);
+
+    auto unregister = [&](size_t registered)
+    {
+        for (size_t i = 0; i < registered; ++i)
+        {
+            Slot &s = var_table[indices[i]];
+            std::unique_lock lk(s.lock);
+            s.waiters.erase(std::find(s.waiters.begin(), s.waiters.end(), std::make_pair(&w, i)));
+        }
+    };
+
+    size_t registered = 0;
+    try
+    {
+        for (; registered < indices.size(); ++registered)
+        {
+            Slot &s = slot(indices[registered]);
+            std::unique_lock lk(s.lock);
+            register_interest(s);
+            s.waiters.emplace_back(&w, registered);
+        }
+    }
+    catch (...)
+    {
+        unregister(registered);
+        throw;
+    }
+
     {
-        throw std::runtime_error("Variable " + var + " does not exist.");
+        std::unique_lock lk(w.m);
+        w.cv.wait_until(lk, deadline, [&]
+        {
+            return all ? w.count == indices.size() : w.count > 0;
+        });
+    }
+
+    // Variables updated together by a group are all marked by the time their
+    // locks are free, so none of them is left out.
+    unregister(indices.size());
+
+    std::vector<size_t> changed;
+    for (size_t i = 0; i < indices.size(); ++i)
+    {
+        if (w.changed[i])
+        {
+            changed.push_back(i);
+        }
     }
+    return changed;
+}
 
-    if (vars[var].owner_socket < 0 && vars[var].owner != self)
+BufferStats State::buffer_stats_slot(size_t index)
+{
+    Slot &s = slot(index);
+    std::unique_lock lk(s.lock);
+
+    return s.var.buffer_stats;
+}
+
+std::chrono::time_point<std::chrono::system_clock> State::last_updated_slot(size_t index)
+{
+    Slot &s = slot(index);
+    std::unique_lock lk(s.lock);
+
+    check_owner(s);
+
+    return s.var.last_updated;
+}
+
+std::vector<QueueStats> State::queue_stats()
+{
+    std::vector<QueueStats> stats;
+
+    std::unique_lock lk(connections_m);
+    for (auto &entry : connections)
     {
-        throw std::runtime_error("Variable " + var + " has no owner registered.");
+        Connection *c = entry.second.get();
+        if (c->to_owner)
+        {
+            continue;
+        }
+
+        std::unique_lock tx_lk(c->tx_m);
+        stats.push_back({c->peer, c->tx.size(), c->tx_bytes, c->tx_total});
     }
+
+    return stats;
 }
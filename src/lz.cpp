@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "lz.hpp"
+
+using namespace dsml;
+
+// Number of bits of the hash of 4 bytes that indexes the match table.
+#define LZ_HASH_BITS 14
+
+// Shortest match that is worth a sequence, and the farthest one back.
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Append the continuation of a length that did not fit its nibble.
+ *
+ * @return Whether it fit.
+ */
+static bool write_length(uint8_t *&out, uint8_t *out_end, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (out == out_end)
+        {
+            return false;
+        }
+        *out++ = 255;
+    }
+    if (out == out_end)
+    {
+        return false;
+    }
+    *out++ = length;
+    return true;
+}
+
+/**
+ * Append a sequence. A `match` of 0 means that there is none.
+ *
+ * @return Whether it fit.
+ */
+static bool write_sequence(uint8_t *&out, uint8_t *out_end, const uint8_t *literals, size_t literal_length, size_t offset, size_t match)
+{
+    size_t match_length = match > 0 ? match - LZ_MIN_MATCH : 0;
+
+    if (out == out_end)
+    {
+        return false;
+    }
+    *out++ = (std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_length, 15);
+
+    if (literal_length >= 15 && !write_length(out, out_end, literal_length - 15))
+    {
+        return false;
+    }
+    if ((size_t)(out_end - out) < literal_length)
+    {
+        return false;
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+
+    if (match == 0)
+    {
+        return true;
+    }
+
+    if (out_end - out < 2)
+    {
+        return false;
+    }
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+
+    return match_length < 15 || write_length(out, out_end, match_length - 15);
+}
+
+size_t lz::compress(const void *src, size_t size, void *dst, size_t capacity)
+{
+    const uint8_t *begin = static_cast<const uint8_t *>(src);
+    const uint8_t *end = begin + size;
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    uint8_t *out_end = out + capacity;
+
+    // Positions of recent 4 byte sequences, by hash. Entries that were never
+    // set point at the start, which is checked like any other candidate.
+    std::vector<uint32_t> table(1 << LZ_HASH_BITS, 0);
+
+    const uint8_t *anchor = begin;
+    const uint8_t *p = begin + 1;
+    while (size >= 8 && p <= end - 8)
+    {
+        uint32_t sequence = read32(p);
+        uint32_t &entry = table[hash(sequence)];
+        const uint8_t *ref = begin + entry;
+        entry = p - begin;
+
+        if (p - ref > LZ_MAX_OFFSET || read32(ref) != sequence)
+        {
+            // Skip ahead faster the longer nothing has matched, so that data
+            // that does not compress passes through quickly.
+            p += 1 + ((p - anchor) >> 6);
+            continue;
+        }
+
+        // Extend the match 8 bytes at a time.
+        const uint8_t *m = p + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+        uint64_t diff = 0;
+        while (m <= end - 8 && (diff = read64(m) ^ read64(r)) == 0)
+        {
+            m += 8;
+            r += 8;
+        }
+        if (diff != 0)
+        {
+            m += __builtin_ctzll(diff) / 8;
+        }
+        else
+        {
+            while (m < end && *m == *r)
+            {
+                ++m;
+                ++r;
+            }
+        }
+
+        if (!write_sequence(out, out_end, anchor, p - anchor, p - ref, m - p))
+        {
+            return 0;
+        }
+        anchor = p = m;
+    }
+
+    if (!write_sequence(out, out_end, anchor, end - anchor, 0, 0))
+    {
+        return 0;
+    }
+
+    return out - static_cast<uint8_t *>(dst);
+}
+
+/**
+ * Read the continuation of a length that did not fit its nibble.
+ *
+ * @return Whether it was complete.
+ */
+static bool read_length(const uint8_t *&in, const uint8_t *in_end, size_t &length)
+{
+    uint8_t byte;
+    do
+    {
+        if (in == in_end)
+        {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+ssize_t lz::decompress(const void *src, size_t size, void *dst, size_t capacity)
+{
+    const uint8_t *in = static_cast<const uint8_t *>(src);
+    const uint8_t *in_end = in + size;
+    uint8_t *begin = static_cast<uint8_t *>(dst);
+    uint8_t *out = begin;
+    uint8_t *out_end = begin + capacity;
+
+    while (in < in_end)
+    {
+        uint8_t token = *in++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !read_length(in, in_end, literal_length))
+        {
+            return -1;
+        }
+        if ((size_t)(in_end - in) < literal_length || (size_t)(out_end - out) < literal_length)
+        {
+            return -1;
+        }
+        memcpy(out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+
+        // The last sequence has no match.
+        if (in == in_end)
+        {
+            break;
+        }
+
+        if (in_end - in < 2)
+        {
+            return -1;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        size_t match = token & 15;
+        if (match == 15 && !read_length(in, in_end, match))
+        {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(out - begin) || (size_t)(out_end - out) < match)
+        {
+            return -1;
+        }
+
+        // The match may overlap what it produces, in which case it repeats.
+        const uint8_t *ref = out - offset;
+        if (offset >= match)
+        {
+            memcpy(out, ref, match);
+            out += match;
+        }
+        else
+        {
+            for (size_t i = 0; i < match; ++i)
+            {
+                *out++ = *ref++;
+            }
+        }
+    }
+
+    return out - begin;
+}
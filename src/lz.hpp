@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+
+#include <sys/types.h>
+
+namespace dsml
+{
+    /**
+     * Fast lossless compression in the style of LZ4: a stream of sequences,
+     * each a run of literal bytes followed by a copy of earlier output.
+     *
+     * Each sequence starts with a token byte holding the literal length in its
+     * high and the match length minus 4 in its low nibble. A nibble of 15 is
+     * continued by bytes that are added to it until one is not 255. The
+     * literals follow, then the match offset as 2 bytes, little endian, and
+     * then the match length continuation. The last sequence has no match.
+     */
+    namespace lz
+    {
+        /**
+         * Compress data.
+         *
+         * @param src Data to compress.
+         * @param size Size of the data.
+         * @param dst Where to store the compressed data.
+         * @param capacity Size of `dst`.
+         * @return Size of the compressed data, or 0 if it does not fit.
+         */
+        size_t compress(const void *src, size_t size, void *dst, size_t capacity);
+
+        /**
+         * Decompress data.
+         *
+         * @param src Data to decompress.
+         * @param size Size of the compressed data.
+         * @param dst Where to store the decompressed data.
+         * @param capacity Size of `dst`.
+         * @return Size of the decompressed data, or -1 if `src` is invalid or
+         *         does not fit.
+         */
+        ssize_t decompress(const void *src, size_t size, void *dst, size_t capacity);
+    }
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+#include "perfect_hash.hpp"
+
+using namespace dsml;
+
+// Average number of keys per bucket. Fewer means more seeds to store, more
+// means longer searches for them.
+#define KEYS_PER_BUCKET 4
+
+// Seeds tried for a bucket before the table is made larger.
+#define MAX_SEED 65536
+
+/**
+ * Hash a key with FNV-1a, finished off so that all of the bits depend on
+ * all of the input.
+ */
+static uint64_t hash(std::string_view key)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (unsigned char c : key)
+    {
+        h = (h ^ c) * 0x100000001b3;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Derive the position hash of a key for a seed from its hash.
+ */
+static uint64_t rehash(uint64_t h, uint32_t seed)
+{
+    h ^= seed * 0x9e3779b97f4a7c15;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9;
+    h ^= h >> 32;
+    return h;
+}
+
+PerfectHash::PerfectHash(std::vector<std::string> keys) : keys(std::move(keys))
+{
+    size_t count = this->keys.size();
+    for (size_t size = std::max<size_t>(1, count + count / 4); !build(size); size *= 2)
+    {
+    }
+}
+
+bool PerfectHash::build(size_t size)
+{
+    size_t count = keys.size();
+    seeds.assign(std::max<size_t>(1, count / KEYS_PER_BUCKET), 0);
+    positions.assign(size, UINT32_MAX);
+
+    std::vector<uint64_t> hashes(count);
+    std::vector<std::vector<uint32_t>> buckets(seeds.size());
+    for (size_t i = 0; i < count; ++i)
+    {
+        hashes[i] = hash(keys[i]);
+        buckets[(hashes[i] >> 32) % seeds.size()].push_back(i);
+    }
+
+    // Place the largest buckets first, while the table is emptiest.
+    std::vector<size_t> order(buckets.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    std::vector<size_t> placed;
+    for (size_t b : order)
+    {
+        const std::vector<uint32_t> &members = buckets[b];
+        if (members.empty())
+        {
+            break;
+        }
+
+        uint32_t seed = 0;
+        for (; seed < MAX_SEED; ++seed)
+        {
+            placed.clear();
+            for (uint32_t i : members)
+            {
+                size_t p = rehash(hashes[i], seed) % size;
+                if (positions[p] != UINT32_MAX || std::find(placed.begin(), placed.end(), p) != placed.end())
+                {
+                    break;
+                }
+                placed.push_back(p);
+            }
+            if (placed.size() == members.size())
+            {
+                break;
+            }
+        }
+        if (seed == MAX_SEED)
+        {
+            // Equal keys collide under every seed, so check for them before
+            // trying a larger table.
+            for (size_t i = 0; i < members.size(); ++i)
+            {
+                for (size_t j = i + 1; j < members.size(); ++j)
+                {
+                    if (keys[members[i]] == keys[members[j]])
+                    {
+                        throw std::runtime_error("Key '" + keys[members[i]] + "' is given twice.");
+                    }
+                }
+            }
+            return false;
+        }
+
+        seeds[b] = seed;
+        for (size_t k = 0; k < members.size(); ++k)
+        {
+            positions[placed[k]] = members[k];
+        }
+    }
+
+    return true;
+}
+
+size_t PerfectHash::find(std::string_view key) const
+{
+    uint64_t h = hash(key);
+    uint32_t seed = seeds[(h >> 32) % seeds.size()];
+    uint32_t i = positions[rehash(h, seed) % positions.size()];
+    if (i == UINT32_MAX || keys[i] != key)
+    {
+        return SIZE_MAX;
+    }
+    return i;
+}
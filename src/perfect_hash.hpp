@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dsml
+{
+    /**
+     * Collision-free map from a fixed set of strings to their indices, built
+     * once with the hash-and-displace method.
+     *
+     * Keys are hashed into buckets, and each bucket gets a seed under which
+     * its keys land on free positions of the table. A lookup therefore hashes
+     * the key once, reads one seed and one position, and compares one key,
+     * without allocating.
+     */
+    class PerfectHash
+    {
+    public:
+        /**
+         * Build the map. Throws if a key is given twice.
+         *
+         * @param keys The keys, which are numbered in this order.
+         */
+        explicit PerfectHash(std::vector<std::string> keys);
+
+        /**
+         * Look up a key.
+         *
+         * @param key The key.
+         * @return Index of the key, or `SIZE_MAX` if it is not in the map.
+         */
+        size_t find(std::string_view key) const;
+
+    private:
+        /**
+         * Try to place all keys in a table of `size` positions.
+         *
+         * @param size Number of positions.
+         * @return Whether every bucket found a seed.
+         */
+        bool build(size_t size);
+
+        std::vector<std::string> keys;
+        std::vector<uint32_t> seeds;     // Seed of each bucket.
+        std::vector<uint32_t> positions; // Index of the key at each position, or `UINT32_MAX`.
+    };
+}
@@ -0,0 +1,393 @@
+#include <cmath>
+#include <cstring>
+
+#include "quantize.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define QUANTIZE_X86
+    #define AVX2 __attribute__((target("avx2,f16c")))
+#endif
+
+using namespace dsml;
+
+static uint32_t float_bits(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static float bits_float(uint32_t bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint16_t float_to_half(float f)
+{
+    uint32_t bits = float_bits(f);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+
+    // Too large, infinite or not a number.
+    if (bits >= (127 + 16) << 23)
+    {
+        return sign | (bits > 0x7f800000 ? 0x7e00 : 0x7c00);
+    }
+
+    // Subnormal: adding 0.5 lines the mantissa up with that of a half, and
+    // lets the addition do the rounding.
+    if (bits < (127 - 14) << 23)
+    {
+        return sign | (float_bits(bits_float(bits) + 0.5f) - float_bits(0.5f));
+    }
+
+    // Normal: rebias the exponent and round the mantissa to nearest even. A
+    // carry out of the mantissa correctly bumps the exponent.
+    uint32_t odd = (bits >> 13) & 1;
+    bits += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+    return sign | (bits >> 13);
+}
+
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+
+    if (exponent == 0)
+    {
+        float value = std::ldexp((float)mantissa, -24);
+        return sign ? -value : value;
+    }
+    if (exponent == 31)
+    {
+        return bits_float(sign | 0x7f800000 | (mantissa << 13));
+    }
+    return bits_float(sign | ((exponent + 127 - 15) << 23) | (mantissa << 13));
+}
+
+static uint16_t float_to_bfloat(float f)
+{
+    uint32_t bits = float_bits(f);
+    if ((bits & 0x7fffffff) > 0x7f800000)
+    {
+        // Keep it a quiet NaN rather than rounding it to infinity.
+        return (bits >> 16) | 0x40;
+    }
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+
+static float bfloat_to_float(uint16_t b)
+{
+    return bits_float((uint32_t)b << 16);
+}
+
+#ifdef QUANTIZE_X86
+
+static bool has_avx2()
+{
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+    return supported;
+}
+
+// Loads and stores of 8 values as floats, and of 4 as doubles.
+
+AVX2 static __m256 load8(const float *p)
+{
+    return _mm256_loadu_ps(p);
+}
+
+AVX2 static __m256 load8(const double *p)
+{
+    return _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(p + 4)), _mm256_cvtpd_ps(_mm256_loadu_pd(p)));
+}
+
+AVX2 static void store8(float *p, __m256 v)
+{
+    _mm256_storeu_ps(p, v);
+}
+
+AVX2 static void store8(double *p, __m256 v)
+{
+    _mm256_storeu_pd(p, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+    _mm256_storeu_pd(p + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+AVX2 static __m256d load4d(const float *p)
+{
+    return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+AVX2 static __m256d load4d(const double *p)
+{
+    return _mm256_loadu_pd(p);
+}
+
+AVX2 static void store4d(float *p, __m256d v)
+{
+    _mm_storeu_ps(p, _mm256_cvtpd_ps(v));
+}
+
+AVX2 static void store4d(double *p, __m256d v)
+{
+    _mm256_storeu_pd(p, v);
+}
+
+// Each of these converts as many values as fit in whole vectors, and returns
+// how many that was.
+
+template <typename T>
+AVX2 static size_t to_f16_avx2(const T *in, size_t count, uint16_t *out)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm_storeu_si128((__m128i *)(out + i), _mm256_cvtps_ph(load8(in + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    return i;
+}
+
+template <typename T>
+AVX2 static size_t from_f16_avx2(const uint16_t *in, size_t count, T *out)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        store8(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + i))));
+    }
+    return i;
+}
+
+template <typename T>
+AVX2 static size_t to_bf16_avx2(const T *in, size_t count, uint16_t *out)
+{
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i bias = _mm256_set1_epi32(0x7fff);
+    const __m256i quiet = _mm256_set1_epi32(0x40);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 v = load8(in + i);
+        __m256i bits = _mm256_castps_si256(v);
+        __m256i high = _mm256_srli_epi32(bits, 16);
+        __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(bias, _mm256_and_si256(high, one))), 16);
+        __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+        __m256i result = _mm256_blendv_epi8(rounded, _mm256_or_si256(high, quiet), nan);
+
+        // Pack to 16 bits, which works within 128-bit lanes, and then bring
+        // the halves of both lanes together.
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(result, result), 0xd8);
+        _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(packed));
+    }
+    return i;
+}
+
+template <typename T>
+AVX2 static size_t from_bf16_avx2(const uint16_t *in, size_t count, T *out)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + i))), 16);
+        store8(out + i, _mm256_castsi256_ps(bits));
+    }
+    return i;
+}
+
+template <typename T>
+AVX2 static size_t to_i16_avx2(const T *in, size_t count, double offset, double step, int16_t *out)
+{
+    const __m256d vo = _mm256_set1_pd(offset);
+    const __m256d vs = _mm256_set1_pd(1 / step);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i lo = _mm256_cvtpd_epi32(_mm256_mul_pd(_mm256_sub_pd(load4d(in + i), vo), vs));
+        __m128i hi = _mm256_cvtpd_epi32(_mm256_mul_pd(_mm256_sub_pd(load4d(in + i + 4), vo), vs));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+    }
+    return i;
+}
+
+template <typename T>
+AVX2 static size_t from_i16_avx2(const int16_t *in, size_t count, double offset, double step, T *out)
+{
+    const __m256d vo = _mm256_set1_pd(offset);
+    const __m256d vs = _mm256_set1_pd(step);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i q = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+        __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(q));
+        __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(q, 1));
+        store4d(out + i, _mm256_add_pd(vo, _mm256_mul_pd(lo, vs)));
+        store4d(out + i + 4, _mm256_add_pd(vo, _mm256_mul_pd(hi, vs)));
+    }
+    return i;
+}
+
+#endif
+
+// Portable versions, which also finish off what does not fill a vector.
+
+template <typename T>
+static void to_f16(const T *in, size_t count, uint16_t *out)
+{
+    size_t i = 0;
+#ifdef QUANTIZE_X86
+    if (has_avx2())
+    {
+        i = to_f16_avx2(in, count, out);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = float_to_half(in[i]);
+    }
+}
+
+template <typename T>
+static void from_f16(const uint16_t *in, size_t count, T *out)
+{
+    size_t i = 0;
+#ifdef QUANTIZE_X86
+    if (has_avx2())
+    {
+        i = from_f16_avx2(in, count, out);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = half_to_float(in[i]);
+    }
+}
+
+template <typename T>
+static void to_bf16(const T *in, size_t count, uint16_t *out)
+{
+    size_t i = 0;
+#ifdef QUANTIZE_X86
+    if (has_avx2())
+    {
+        i = to_bf16_avx2(in, count, out);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = float_to_bfloat(in[i]);
+    }
+}
+
+template <typename T>
+static void from_bf16(const uint16_t *in, size_t count, T *out)
+{
+    size_t i = 0;
+#ifdef QUANTIZE_X86
+    if (has_avx2())
+    {
+        i = from_bf16_avx2(in, count, out);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = bfloat_to_float(in[i]);
+    }
+}
+
+template <typename T>
+static void to_i16(const T *in, size_t count, double offset, double step, int16_t *out)
+{
+    size_t i = 0;
+#ifdef QUANTIZE_X86
+    if (has_avx2())
+    {
+        i = to_i16_avx2(in, count, offset, step, out);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = std::nearbyint((in[i] - offset) * (1 / step));
+    }
+}
+
+template <typename T>
+static void from_i16(const int16_t *in, size_t count, double offset, double step, T *out)
+{
+    size_t i = 0;
+#ifdef QUANTIZE_X86
+    if (has_avx2())
+    {
+        i = from_i16_avx2(in, count, offset, step, out);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = offset + in[i] * step;
+    }
+}
+
+void quantize::to_f16(const float *in, size_t count, uint16_t *out)
+{
+    ::to_f16(in, count, out);
+}
+
+void quantize::to_f16(const double *in, size_t count, uint16_t *out)
+{
+    ::to_f16(in, count, out);
+}
+
+void quantize::from_f16(const uint16_t *in, size_t count, float *out)
+{
+    ::from_f16(in, count, out);
+}
+
+void quantize::from_f16(const uint16_t *in, size_t count, double *out)
+{
+    ::from_f16(in, count, out);
+}
+
+void quantize::to_bf16(const float *in, size_t count, uint16_t *out)
+{
+    ::to_bf16(in, count, out);
+}
+
+void quantize::to_bf16(const double *in, size_t count, uint16_t *out)
+{
+    ::to_bf16(in, count, out);
+}
+
+void quantize::from_bf16(const uint16_t *in, size_t count, float *out)
+{
+    ::from_bf16(in, count, out);
+}
+
+void quantize::from_bf16(const uint16_t *in, size_t count, double *out)
+{
+    ::from_bf16(in, count, out);
+}
+
+void quantize::to_i16(const float *in, size_t count, double offset, double step, int16_t *out)
+{
+    ::to_i16(in, count, offset, step, out);
+}
+
+void quantize::to_i16(const double *in, size_t count, double offset, double step, int16_t *out)
+{
+    ::to_i16(in, count, offset, step, out);
+}
+
+void quantize::from_i16(const int16_t *in, size_t count, double offset, double step, float *out)
+{
+    ::from_i16(in, count, offset, step, out);
+}
+
+void quantize::from_i16(const int16_t *in, size_t count, double offset, double step, double *out)
+{
+    ::from_i16(in, count, offset, step, out);
+}
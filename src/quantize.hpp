@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dsml
+{
+    /**
+     * Conversions between floating point arrays and 16-bit representations of
+     * them. They use AVX2 and F16C when the processor has them.
+     */
+    namespace quantize
+    {
+        /**
+         * Convert values to IEEE half precision, rounding to nearest even.
+         * Values beyond its range become infinite.
+         *
+         * @param in Values to convert.
+         * @param count Number of values.
+         * @param out Where to store the converted values.
+         */
+        void to_f16(const float *in, size_t count, uint16_t *out);
+        void to_f16(const double *in, size_t count, uint16_t *out);
+
+        /**
+         * Convert IEEE half precision values back.
+         *
+         * @param in Values to convert.
+         * @param count Number of values.
+         * @param out Where to store the converted values.
+         */
+        void from_f16(const uint16_t *in, size_t count, float *out);
+        void from_f16(const uint16_t *in, size_t count, double *out);
+
+        /**
+         * Convert values to bfloat16, the upper half of a float, rounding to
+         * nearest even.
+         *
+         * @param in Values to convert.
+         * @param count Number of values.
+         * @param out Where to store the converted values.
+         */
+        void to_bf16(const float *in, size_t count, uint16_t *out);
+        void to_bf16(const double *in, size_t count, uint16_t *out);
+
+        /**
+         * Convert bfloat16 values back.
+         *
+         * @param in Values to convert.
+         * @param count Number of values.
+         * @param out Where to store the converted values.
+         */
+        void from_bf16(const uint16_t *in, size_t count, float *out);
+        void from_bf16(const uint16_t *in, size_t count, double *out);
+
+        /**
+         * Convert values to the nearest multiples of `step` away from
+         * `offset`. The caller makes sure that these fit in an `int16_t`.
+         *
+         * @param in Values to convert.
+         * @param count Number of values.
+         * @param offset Value that maps to 0.
+         * @param step Difference between consecutive values.
+         * @param out Where to store the converted values.
+         */
+        void to_i16(const float *in, size_t count, double offset, double step, int16_t *out);
+        void to_i16(const double *in, size_t count, double offset, double step, int16_t *out);
+
+        /**
+         * Convert values made by `to_i16` back.
+         *
+         * @param in Values to convert.
+         * @param count Number of values.
+         * @param offset Value that maps to 0.
+         * @param step Difference between consecutive values.
+         * @param out Where to store the converted values.
+         */
+        void from_i16(const int16_t *in, size_t count, double offset, double step, float *out);
+        void from_i16(const int16_t *in, size_t count, double offset, double step, double *out);
+    }
+}
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+#else
+    #include <fcntl.h>
+    #include <poll.h>
+#endif
+
+#include "reactor.hpp"
+
+using namespace dsml;
+
+#ifdef __linux__
+
+// Events taken from epoll per call of `wait`; the rest are left for the next.
+#define REACTOR_MAX_EVENTS 64
+
+Reactor::Reactor()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create1()");
+        throw std::runtime_error("Failed to create epoll instance.");
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+    {
+        perror("eventfd()");
+        close(epoll_fd);
+        throw std::runtime_error("Failed to create wakeup eventfd.");
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = this;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) < 0)
+    {
+        perror("epoll_ctl()");
+        close(wakeup_fd);
+        close(epoll_fd);
+        throw std::runtime_error("Failed to watch wakeup eventfd.");
+    }
+}
+
+Reactor::~Reactor()
+{
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+int Reactor::add(int fd, void *data)
+{
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = data;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        perror("epoll_ctl()");
+        return -1;
+    }
+    return 0;
+}
+
+int Reactor::remove(int fd)
+{
+    return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int Reactor::watch_output(int, bool)
+{
+    return 0;
+}
+
+void Reactor::wake()
+{
+    uint64_t one = 1;
+    write(wakeup_fd, &one, sizeof(one));
+}
+
+int Reactor::wait(Event *events, int max_events, int timeout)
+{
+    std::array<struct epoll_event, REACTOR_MAX_EVENTS> evs;
+    int n = epoll_wait(epoll_fd, evs.data(), std::min<int>(max_events, evs.size()), timeout);
+    if (n < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (evs[i].data.ptr == this)
+        {
+            uint64_t value;
+            read(wakeup_fd, &value, sizeof(value));
+            continue;
+        }
+        events[count].data = evs[i].data.ptr;
+        events[count].readable = evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+        events[count].writable = evs[i].events & EPOLLOUT;
+        ++count;
+    }
+    return count;
+}
+
+#else
+
+Reactor::Reactor()
+{
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+    {
+        perror("pipe()");
+        throw std::runtime_error("Failed to create wakeup pipe.");
+    }
+
+    wakeup_read_fd = pipefd[0];
+    wakeup_fd = pipefd[1];
+    fcntl(wakeup_read_fd, F_SETFL, O_NONBLOCK);
+    fcntl(wakeup_fd, F_SETFL, O_NONBLOCK);
+}
+
+Reactor::~Reactor()
+{
+    close(wakeup_read_fd);
+    close(wakeup_fd);
+}
+
+int Reactor::add(int fd, void *data)
+{
+    {
+        std::unique_lock lk(fds_m);
+        fds[fd] = {data, false};
+    }
+    wake();
+    return 0;
+}
+
+int Reactor::remove(int fd)
+{
+    {
+        std::unique_lock lk(fds_m);
+        fds.erase(fd);
+    }
+    wake();
+    return 0;
+}
+
+int Reactor::watch_output(int fd, bool enable)
+{
+    {
+        std::unique_lock lk(fds_m);
+        auto it = fds.find(fd);
+        if (it == fds.end())
+        {
+            return -1;
+        }
+        it->second.output = enable;
+    }
+    wake();
+    return 0;
+}
+
+void Reactor::wake()
+{
+    write(wakeup_fd, "a", 1);
+}
+
+int Reactor::wait(Event *events, int max_events, int timeout)
+{
+    std::vector<pollfd> pfds;
+    std::vector<void *> data;
+    {
+        std::unique_lock lk(fds_m);
+        pfds.push_back({wakeup_read_fd, POLLIN, 0});
+        data.push_back(nullptr);
+        for (auto &fd : fds)
+        {
+            pfds.push_back({fd.first, (short)(POLLIN | (fd.second.output ? POLLOUT : 0)), 0});
+            data.push_back(fd.second.data);
+        }
+    }
+
+    int n = poll(pfds.data(), pfds.size(), timeout);
+    if (n < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    if (pfds[0].revents & POLLIN)
+    {
+        char buf[64];
+        while (read(wakeup_read_fd, buf, sizeof(buf)) > 0)
+        {
+        }
+    }
+
+    int count = 0;
+    for (size_t i = 1; i < pfds.size() && count < max_events; ++i)
+    {
+        if (pfds[i].revents)
+        {
+            events[count].data = data[i];
+            events[count].readable = pfds[i].revents & ~POLLOUT;
+            events[count].writable = pfds[i].revents & POLLOUT;
+            ++count;
+        }
+    }
+    return count;
+}
+
+#endif
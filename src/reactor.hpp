@@ -0,0 +1,104 @@
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace dsml
+{
+    /**
+     * Waits for input and output readiness on a set of file descriptors.
+     *
+     * On Linux this is an edge-triggered epoll instance with an eventfd for
+     * wakeups, so adding or removing a file descriptor is a single system call
+     * that may be made from any thread while another thread is waiting. Users
+     * must therefore read each ready file descriptor until it would block, and
+     * write to it until it would block before waiting for it to be writable.
+     * Elsewhere it falls back to `poll` with a self-pipe.
+     */
+    class Reactor
+    {
+    public:
+        /**
+         * Readiness of a file descriptor.
+         */
+        struct Event
+        {
+            void *data; // As passed to `add`.
+            bool readable;
+            bool writable;
+        };
+
+        Reactor();
+        ~Reactor();
+
+        Reactor(const Reactor &) = delete;
+        Reactor &operator=(const Reactor &) = delete;
+
+        /**
+         * Start watching a file descriptor for input.
+         *
+         * @param fd File descriptor to watch.
+         * @param data Reported back in the `Event` when `fd` is ready.
+         * @return 0 on success, -1 on failure.
+         */
+        int add(int fd, void *data);
+
+        /**
+         * Stop watching a file descriptor.
+         *
+         * @param fd File descriptor to stop watching.
+         * @return 0 on success, -1 on failure.
+         */
+        int remove(int fd);
+
+        /**
+         * Set whether to report when a watched file descriptor becomes
+         * writable. With epoll this is always reported, once per transition,
+         * so this only matters for the `poll` fallback.
+         *
+         * @param fd Watched file descriptor.
+         * @param enable Whether to report it.
+         * @return 0 on success, -1 on failure.
+         */
+        int watch_output(int fd, bool enable);
+
+        /**
+         * Make a concurrent or the next call to `wait` return.
+         */
+        void wake();
+
+        /**
+         * Wait until file descriptors are ready or `wake` is called.
+         *
+         * @param events Where to store the ready file descriptors.
+         * @param max_events Size of `events`.
+         * @param timeout Maximum time to wait in milliseconds, or -1.
+         * @return Number of events stored, or -1 on failure.
+         */
+        int wait(Event *events, int max_events, int timeout);
+
+    private:
+        /**
+         * File descriptor that `wake` writes to.
+         */
+        int wakeup_fd;
+
+#ifdef __linux__
+        int epoll_fd;
+#else
+        int wakeup_read_fd;
+
+        /**
+         * Watched file descriptors, copied out before each `poll`.
+         */
+        struct Watch
+        {
+            void *data;
+            bool output;
+        };
+        std::mutex fds_m;
+        std::unordered_map<int, Watch> fds;
+#endif
+    };
+}
@@ -0,0 +1,199 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm.hpp"
+
+using namespace dsml;
+
+// Number of times a reader retries at once on a slot that keeps being
+// overwritten.
+#define SHM_READ_SPINS 16
+
+// Number of times a reader then retries after waiting, from 1 µs doubling
+// each time, before giving up.
+#define SHM_READ_BACKOFFS 12
+
+struct ShmSegment::Header
+{
+    struct alignas(64) SlotHeader
+    {
+        std::atomic<uint64_t> seq; // Odd while the slot is being written.
+        std::atomic<uint64_t> size;
+        std::atomic<uint64_t> version;
+    };
+
+    uint64_t capacity;
+    std::atomic<uint32_t> latest;
+    SlotHeader slots[2];
+};
+
+// Offset of the first slot, and the stride between slots, rounded up so
+// that slot data is cache line aligned.
+static size_t align_up(size_t n)
+{
+    return (n + 63) & ~size_t(63);
+}
+
+std::shared_ptr<ShmSegment> ShmSegment::create(const std::string &name, size_t capacity)
+{
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+    {
+        perror("shm_open()");
+        return nullptr;
+    }
+
+    size_t length = align_up(sizeof(Header)) + 2 * align_up(capacity);
+    if (ftruncate(fd, length) < 0)
+    {
+        perror("ftruncate()");
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap()");
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    // A fresh segment is zero filled, which is a valid empty state for the
+    // atomics in the header.
+    static_cast<Header *>(base)->capacity = capacity;
+
+    return std::shared_ptr<ShmSegment>(new ShmSegment(name, base, length, true));
+}
+
+std::shared_ptr<ShmSegment> ShmSegment::open(const std::string &name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Header))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap()");
+        return nullptr;
+    }
+
+    auto segment = std::shared_ptr<ShmSegment>(new ShmSegment(name, base, st.st_size, false));
+    if (align_up(sizeof(Header)) + 2 * align_up(segment->capacity()) > (size_t)st.st_size)
+    {
+        return nullptr;
+    }
+
+    return segment;
+}
+
+ShmSegment::ShmSegment(std::string name, void *base, size_t length, bool owner)
+    : segment_name(std::move(name)), base(base), length(length), owner(owner)
+{
+}
+
+ShmSegment::~ShmSegment()
+{
+    munmap(base, length);
+    if (owner)
+    {
+        shm_unlink(segment_name.c_str());
+    }
+}
+
+size_t ShmSegment::capacity() const
+{
+    return static_cast<Header *>(base)->capacity;
+}
+
+char *ShmSegment::slot_data(uint32_t slot)
+{
+    return static_cast<char *>(base) + align_up(sizeof(Header)) + slot * align_up(capacity());
+}
+
+void ShmSegment::write(const void *data, size_t size, uint64_t version)
+{
+    Header *header = static_cast<Header *>(base);
+
+    // Write to the slot that readers are not directed to.
+    uint32_t slot = 1 - header->latest.load(std::memory_order_relaxed);
+    Header::SlotHeader &sh = header->slots[slot];
+
+    uint64_t seq = sh.seq.load(std::memory_order_relaxed);
+    sh.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    sh.size.store(size, std::memory_order_relaxed);
+    sh.version.store(version, std::memory_order_relaxed);
+    memcpy(slot_data(slot), data, size);
+
+    sh.seq.store(seq + 2, std::memory_order_release);
+    header->latest.store(slot, std::memory_order_release);
+}
+
+ssize_t ShmSegment::read(const std::function<void *(size_t)> &reserve, uint64_t &version)
+{
+    Header *header = static_cast<Header *>(base);
+
+    for (int attempt = 0; attempt < SHM_READ_SPINS + SHM_READ_BACKOFFS; ++attempt)
+    {
+        // Let a burst of writes pass before trying again.
+        if (attempt >= SHM_READ_SPINS)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(1 << (attempt - SHM_READ_SPINS)));
+        }
+
+        uint32_t slot = header->latest.load(std::memory_order_acquire) & 1;
+        Header::SlotHeader &sh = header->slots[slot];
+
+        uint64_t seq = sh.seq.load(std::memory_order_acquire);
+        if (seq & 1)
+        {
+            continue;
+        }
+
+        size_t size = sh.size.load(std::memory_order_relaxed);
+        uint64_t slot_version = sh.version.load(std::memory_order_relaxed);
+        if (size > capacity())
+        {
+            continue;
+        }
+
+        void *dst = reserve(size);
+        if (dst == nullptr)
+        {
+            return -1;
+        }
+        memcpy(dst, slot_data(slot), size);
+
+        // Only accept the copy if the slot was not rewritten during it.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sh.seq.load(std::memory_order_relaxed) == seq)
+        {
+            version = slot_version;
+            return size;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+namespace dsml
+{
+    /**
+     * Shared memory segment through which an owner publishes an array variable
+     * to subscribers on the same host.
+     *
+     * The segment holds two slots that are written alternately. Each slot is
+     * guarded by a sequence lock, so readers never block the writer and retry
+     * if the slot they are copying is overwritten underneath them.
+     */
+    class ShmSegment
+    {
+    public:
+        /**
+         * Create a new segment. The segment is unlinked when the returned
+         * object is destroyed.
+         *
+         * @param name Name of the segment, in the style of `shm_open`.
+         * @param capacity Size of each slot in bytes.
+         * @return The segment, or `nullptr` on failure.
+         */
+        static std::shared_ptr<ShmSegment> create(const std::string &name, size_t capacity);
+
+        /**
+         * Open an existing segment for reading.
+         *
+         * @param name Name of the segment.
+         * @return The segment, or `nullptr` on failure.
+         */
+        static std::shared_ptr<ShmSegment> open(const std::string &name);
+
+        ~ShmSegment();
+
+        ShmSegment(const ShmSegment &) = delete;
+        ShmSegment &operator=(const ShmSegment &) = delete;
+
+        /**
+         * Name of the segment.
+         */
+        const std::string &name() const
+        {
+            return segment_name;
+        }
+
+        /**
+         * Size of each slot in bytes.
+         */
+        size_t capacity() const;
+
+        /**
+         * Publish a new value. Only one thread may write at a time.
+         *
+         * @param data Data to publish.
+         * @param size Size of the data, at most `capacity()`.
+         * @param version Version of the value, stored along with it.
+         */
+        void write(const void *data, size_t size, uint64_t version);
+
+        /**
+         * Copy out the latest value.
+         *
+         * @param reserve Called with the size of the value; returns where to
+         *                copy it, or `nullptr` to give up.
+         * @param version Where to store the version of the value copied.
+         * @return Size of the value, or -1 if no consistent copy was made,
+         *         even after backing off to let the writer finish.
+         */
+        ssize_t read(const std::function<void *(size_t)> &reserve, uint64_t &version);
+
+    private:
+        struct Header;
+
+        ShmSegment(std::string name, void *base, size_t length, bool owner);
+
+        /**
+         * Start of the data of a slot.
+         */
+        char *slot_data(uint32_t slot);
+
+        std::string segment_name;
+        void *base;
+        size_t length;
+        bool owner;
+    };
+}
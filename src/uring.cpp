@@ -0,0 +1,454 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+    #include <csignal>
+    #include <poll.h>
+    #include <sys/eventfd.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/syscall.h>
+    #include <linux/io_uring.h>
+    #define URING_SUPPORTED
+#endif
+
+#include "uring.hpp"
+
+using namespace dsml;
+
+#ifdef URING_SUPPORTED
+
+// Receive buffers provided to the kernel.
+#define URING_BUFFERS 128
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+
+// Reserved `data` of requests that `complete` handles itself.
+#define URING_INTERNAL 0
+#define URING_WAKEUP 1
+#define URING_CHECK 2
+
+static void *map(size_t size, int fd, off_t offset)
+{
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+Uring::Uring(unsigned entries)
+{
+    struct io_uring_params params = {};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * entries;
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+    {
+        perror("io_uring_setup()");
+        throw std::runtime_error("Failed to set up io_uring.");
+    }
+
+    // Completions must never be dropped, and `submit` needs a timeout.
+    if ((params.features & (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)) != (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG))
+    {
+        release();
+        throw std::runtime_error("io_uring lacks required features.");
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sq_ring = map(sq_ring_size, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = map(cq_ring_size, ring_fd, IORING_OFF_CQ_RING);
+    sqes = static_cast<struct io_uring_sqe *>(map(sqes_size, ring_fd, IORING_OFF_SQES));
+    if (!sq_ring || !cq_ring || !sqes)
+    {
+        perror("mmap()");
+        release();
+        throw std::runtime_error("Failed to map io_uring.");
+    }
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    unsigned *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; ++i)
+    {
+        array[i] = i;
+    }
+
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // Provide the receive buffers, which the check below makes sure of.
+    buffer_memory = static_cast<char *>(map(URING_BUFFERS * URING_BUFFER_SIZE, -1, 0));
+    if (!buffer_memory)
+    {
+        perror("mmap()");
+        release();
+        throw std::runtime_error("Failed to allocate io_uring buffers.");
+    }
+    struct io_uring_sqe *sqe = get_sqe(URING_INTERNAL);
+    if (sqe == nullptr)
+    {
+        release();
+        throw std::runtime_error("No io_uring entry to provide buffers with.");
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_BUFFERS;
+    sqe->addr = (uint64_t)buffer_memory;
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->buf_group = URING_BUFFER_GROUP;
+
+    if (check_recv() < 0)
+    {
+        release();
+        throw std::runtime_error("io_uring lacks multishot receive.");
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+    {
+        perror("eventfd()");
+        release();
+        throw std::runtime_error("Failed to create wakeup eventfd.");
+    }
+    if (poll(wakeup_fd, URING_WAKEUP) < 0)
+    {
+        release();
+        throw std::runtime_error("No io_uring entry to watch the wakeup eventfd with.");
+    }
+}
+
+Uring::~Uring()
+{
+    release();
+}
+
+void Uring::release()
+{
+    // Closing the ring cancels what is still in flight.
+    if (ring_fd >= 0)
+    {
+        close(ring_fd);
+    }
+    if (wakeup_fd >= 0)
+    {
+        close(wakeup_fd);
+    }
+    if (sq_ring)
+    {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (cq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sqes)
+    {
+        munmap(sqes, sqes_size);
+    }
+    if (buffer_memory)
+    {
+        munmap(buffer_memory, URING_BUFFERS * URING_BUFFER_SIZE);
+    }
+    ring_fd = wakeup_fd = -1;
+    sq_ring = cq_ring = nullptr;
+    sqes = nullptr;
+    buffer_memory = nullptr;
+}
+
+int Uring::check_recv()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        return -1;
+    }
+
+    bool received = false, done = false;
+    if (recv(fds[0], URING_CHECK) == 0 && write(fds[1], "a", 1) == 1)
+    {
+        // Wait for the data, then for the receive to end once cancelled.
+        for (int tries = 0; tries < 4 && !done && submit(1, 1000) == 0; ++tries)
+        {
+            Completion completions[4];
+            int n = complete(completions, 4);
+            for (int i = 0; i < n; ++i)
+            {
+                if (completions[i].data != URING_CHECK)
+                {
+                    continue;
+                }
+                if (completions[i].result == 1 && completions[i].more && completions[i].buffer >= 0)
+                {
+                    received = true;
+                    recycle(completions[i].buffer);
+                    cancel(fds[0]);
+                }
+                done = !completions[i].more;
+            }
+        }
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    return received && done ? 0 : -1;
+}
+
+struct io_uring_sqe *Uring::get_sqe(uint64_t data)
+{
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+    {
+        submit(0, -1);
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        {
+            return nullptr;
+        }
+    }
+
+    // The kernel only looks at the entry when it is submitted, so it may be
+    // made visible before the caller fills it in.
+    struct io_uring_sqe *sqe = &sqes[tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = data;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++queued;
+    return sqe;
+}
+
+int Uring::reserve(unsigned count)
+{
+    if (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + count > sq_entries)
+    {
+        submit(0, -1);
+    }
+    return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + count > sq_entries ? -1 : 0;
+}
+
+int Uring::poll(int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe = get_sqe(data);
+    if (sqe == nullptr)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    return 0;
+}
+
+int Uring::recv(int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe = get_sqe(data);
+    if (sqe == nullptr)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    return 0;
+}
+
+int Uring::sendmsg(int fd, const struct msghdr *msg, bool link, uint64_t data)
+{
+    struct io_uring_sqe *sqe = get_sqe(data);
+    if (sqe == nullptr)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)msg;
+    sqe->len = 1;
+    // With `MSG_WAITALL` the kernel sends the rest of a partial send itself,
+    // so a link only breaks on failure.
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    return 0;
+}
+
+int Uring::cancel(int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(URING_INTERNAL);
+    if (sqe == nullptr)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    return 0;
+}
+
+int Uring::submit(unsigned wait, int timeout)
+{
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    void *argp = nullptr;
+    size_t argsz = 0;
+    if (wait > 0 && timeout >= 0)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+
+    int ret = syscall(__NR_io_uring_enter, ring_fd, queued, wait, flags, argp, argsz);
+    if (ret < 0)
+    {
+        if (errno == EINTR || errno == ETIME || errno == EAGAIN || errno == EBUSY)
+        {
+            return 0;
+        }
+        perror("io_uring_enter()");
+        return -1;
+    }
+    queued -= ret;
+    return 0;
+}
+
+int Uring::complete(Completion *completions, int max)
+{
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    int n = 0;
+    for (; head != tail && n < max; ++head)
+    {
+        const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        if (cqe.user_data == URING_WAKEUP)
+        {
+            uint64_t value;
+            while (read(wakeup_fd, &value, sizeof(value)) > 0)
+            {
+            }
+            if (!more)
+            {
+                poll(wakeup_fd, URING_WAKEUP);
+            }
+            continue;
+        }
+        if (cqe.user_data == URING_INTERNAL)
+        {
+            continue;
+        }
+
+        completions[n].data = cqe.user_data;
+        completions[n].result = cqe.res;
+        completions[n].more = more;
+        completions[n].buffer = (cqe.flags & IORING_CQE_F_BUFFER) ? (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+        ++n;
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+const char *Uring::buffer(int index) const
+{
+    return buffer_memory + (size_t)index * URING_BUFFER_SIZE;
+}
+
+void Uring::recycle(int index)
+{
+    // This goes to the kernel with the next submission.
+    struct io_uring_sqe *sqe = get_sqe(URING_INTERNAL);
+    if (sqe == nullptr)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (uint64_t)(buffer_memory + (size_t)index * URING_BUFFER_SIZE);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->off = index;
+}
+
+void Uring::wake()
+{
+    uint64_t one = 1;
+    write(wakeup_fd, &one, sizeof(one));
+}
+
+#else
+
+Uring::Uring(unsigned)
+{
+    throw std::runtime_error("io_uring is not supported on this system.");
+}
+
+Uring::~Uring()
+{
+}
+
+int Uring::poll(int, uint64_t)
+{
+    return -1;
+}
+
+int Uring::recv(int, uint64_t)
+{
+    return -1;
+}
+
+int Uring::sendmsg(int, const struct msghdr *, bool, uint64_t)
+{
+    return -1;
+}
+
+int Uring::cancel(int)
+{
+    return -1;
+}
+
+int Uring::reserve(unsigned)
+{
+    return -1;
+}
+
+int Uring::submit(unsigned, int)
+{
+    return -1;
+}
+
+int Uring::complete(Completion *, int)
+{
+    return 0;
+}
+
+const char *Uring::buffer(int) const
+{
+    return nullptr;
+}
+
+void Uring::recycle(int)
+{
+}
+
+void Uring::wake()
+{
+}
+
+#endif
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct msghdr;
+
+namespace dsml
+{
+    /**
+     * An io_uring instance, set up with raw system calls.
+     *
+     * Requests are queued with the methods below and handed to the kernel in
+     * one system call by `submit`, which also waits for their completions.
+     * Received data goes into a pool of buffers provided to the kernel, of
+     * which multishot receives take one per completion. An eventfd
+     * watched by the ring lets other threads interrupt `submit`.
+     *
+     * Only one thread may use an instance, apart from `wake`. The constructor
+     * throws if the kernel lacks any of the features used.
+     */
+    class Uring
+    {
+    public:
+        /**
+         * A completed request.
+         */
+        struct Completion
+        {
+            uint64_t data; // As passed with the request.
+            int32_t result;
+            bool more;     // Whether the request will complete again.
+            int buffer;    // Index of the receive buffer holding the data, or -1.
+        };
+
+        /**
+         * Set up a ring.
+         *
+         * @param entries Number of requests that may be queued at once.
+         */
+        explicit Uring(unsigned entries);
+        ~Uring();
+
+        Uring(const Uring &) = delete;
+        Uring &operator=(const Uring &) = delete;
+
+        /**
+         * Watch a file descriptor for input until cancelled.
+         *
+         * @param fd File descriptor to watch.
+         * @param data Reported back in each `Completion`.
+         * @return 0 on success, -1 on failure.
+         */
+        int poll(int fd, uint64_t data);
+
+        /**
+         * Receive from a socket into the registered buffers until cancelled
+         * or the buffers run out.
+         *
+         * @param fd Socket to receive from.
+         * @param data Reported back in each `Completion`.
+         * @return 0 on success, -1 on failure.
+         */
+        int recv(int fd, uint64_t data);
+
+        /**
+         * Send a message on a socket. It completes once all of it has been
+         * sent, or on failure.
+         *
+         * @param fd Socket to send on.
+         * @param msg The message, which must stay valid until completion.
+         * @param link Whether the next request starts only after this one
+         *             succeeds, and is cancelled otherwise.
+         * @param data Reported back in the `Completion`.
+         * @return 0 on success, -1 on failure.
+         */
+        int sendmsg(int fd, const struct msghdr *msg, bool link, uint64_t data);
+
+        /**
+         * Cancel all requests on a file descriptor. They complete with
+         * `-ECANCELED` or whatever they had come to.
+         *
+         * @param fd File descriptor of the requests.
+         * @return 0 on success, -1 on failure.
+         */
+        int cancel(int fd);
+
+        /**
+         * Make sure that `count` requests can be queued without handing any to
+         * the kernel in between, as linked requests must be.
+         *
+         * @param count Number of requests.
+         * @return 0 on success, -1 if there is not enough room.
+         */
+        int reserve(unsigned count);
+
+        /**
+         * Hand the queued requests to the kernel and wait for completions.
+         *
+         * @param wait Number of completions to wait for.
+         * @param timeout Maximum time to wait in milliseconds, or -1.
+         * @return 0 on success or timeout, -1 on failure.
+         */
+        int submit(unsigned wait, int timeout);
+
+        /**
+         * Take completed requests.
+         *
+         * @param completions Where to store the completions.
+         * @param max Size of `completions`.
+         * @return Number of completions stored.
+         */
+        int complete(Completion *completions, int max);
+
+        /**
+         * Get a receive buffer.
+         *
+         * @param index Index of the buffer, from a `Completion`.
+         * @return The buffer.
+         */
+        const char *buffer(int index) const;
+
+        /**
+         * Give a receive buffer back to the kernel once its data is used.
+         *
+         * @param index Index of the buffer, from a `Completion`.
+         */
+        void recycle(int index);
+
+        /**
+         * Make a concurrent or the next call to `submit` return.
+         */
+        void wake();
+
+    private:
+        /**
+         * Get a free submission queue entry, handing the queued ones to the
+         * kernel first if there is none.
+         *
+         * @param data Reported back in the `Completion`.
+         * @return The entry, or `nullptr` on failure.
+         */
+        struct io_uring_sqe *get_sqe(uint64_t data);
+
+        /**
+         * Check that multishot receives into registered buffers work, which
+         * no feature flag tells.
+         *
+         * @return 0 if they do, -1 otherwise.
+         */
+        int check_recv();
+
+        /**
+         * Free what has been set up.
+         */
+        void release();
+
+        int ring_fd = -1;
+        int wakeup_fd = -1;
+        unsigned queued = 0; // Entries queued since the last `submit`.
+
+        // Mappings of the rings shared with the kernel.
+        void *sq_ring = nullptr;
+        size_t sq_ring_size = 0;
+        void *cq_ring = nullptr;
+        size_t cq_ring_size = 0;
+        struct io_uring_sqe *sqes = nullptr;
+        size_t sqes_size = 0;
+
+        // Pointers into `sq_ring`.
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned sq_mask;
+        unsigned sq_entries;
+
+        // Pointers into `cq_ring`.
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+
+        // Receive buffers, which the kernel takes from as data arrives.
+        char *buffer_memory = nullptr;
+    };
+}
@@ -1,13 +1,31 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <dsml.hpp>
+#include <dsml_vars.hpp>
 
 #define PADDED_LENGTH 50
 
+// Size of the header that starts every message.
+#define HEADER_SIZE 16
+
 bool all_tests_passed = true;
 
 /**
@@ -25,6 +43,205 @@ void test(const bool &b, std::string msg)
     std::cerr << msg << std::endl;
 }
 
+/**
+ * Wait for a condition to hold, such as an update having arrived.
+ *
+ * @param condition Function returning whether the condition holds.
+ * @param timeout Longest to wait for.
+ * @return Whether the condition holds.
+ */
+template <typename F>
+bool eventually(F condition, std::chrono::milliseconds timeout = std::chrono::seconds(5))
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition())
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+/**
+ * Enumerates the kinds of messages, as `dsml::State` numbers them.
+ */
+enum MessageKind : uint8_t
+{
+    MESSAGE_UPDATE,
+    MESSAGE_INTEREST,
+    MESSAGE_REQUEST,
+    MESSAGE_GROUP,
+    MESSAGE_RESYNC,
+    MESSAGE_REJECT,
+};
+
+/**
+ * Enumerates how the data of a message is encoded, as `dsml::State`
+ * numbers them.
+ */
+enum Encoding : uint8_t
+{
+    ENCODING_RAW,
+    ENCODING_SHM,
+    ENCODING_DELTA,
+    ENCODING_LZ,
+    ENCODING_QUANTIZED,
+};
+
+/**
+ * Header that starts every message, laid out as `dsml::State` sends it.
+ */
+struct RawHeader
+{
+    MessageKind kind;
+    Encoding encoding;
+    uint16_t name_size;
+    uint32_t data_size;
+    uint64_t version;
+};
+static_assert(sizeof(RawHeader) == HEADER_SIZE);
+
+/**
+ * Data of an interest message, laid out as `dsml::State` reads it.
+ */
+struct RawInterest
+{
+    uint8_t shm = 0;
+    uint8_t conflate = 0;
+    uint8_t delta = 0;
+    uint8_t compress = 0;
+    uint8_t quantize = 0;
+    uint8_t reserved[3] = {};
+    uint64_t layout = 0;
+    uint32_t min_interval = 0;
+    uint32_t decimation = 0;
+    double deadband = 0;
+    double relative_deadband = 0;
+};
+
+/**
+ * Connect a raw socket to the first instance, to speak the protocol to it
+ * directly.
+ *
+ * @param rcvbuf Size of the receive buffer, or 0 for the default.
+ * @param timeout Longest that a receive may block for, or 0 for no limit.
+ * @return The socket.
+ */
+int connect_raw(int rcvbuf = 0, std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (rcvbuf > 0)
+    {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    if (timeout.count() > 0)
+    {
+        struct timeval tv = {(time_t)(timeout.count() / 1000), (suseconds_t)(timeout.count() % 1000 * 1000)};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1111);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    return sock;
+}
+
+/**
+ * Send a message from a raw socket.
+ *
+ * @param sock The socket.
+ * @param kind Kind of message.
+ * @param name Name of the variable.
+ * @param data Data of the message.
+ * @param data_size Size of the data in bytes.
+ * @param encoding Encoding of the data.
+ */
+void send_raw(int sock, MessageKind kind, const std::string &name, const void *data = nullptr, size_t data_size = 0,
+              Encoding encoding = ENCODING_RAW)
+{
+    RawHeader header = {kind, encoding, (uint16_t)name.size(), (uint32_t)data_size, 0};
+    std::vector<char> message(HEADER_SIZE + name.size() + data_size);
+    memcpy(message.data(), &header, HEADER_SIZE);
+    memcpy(message.data() + HEADER_SIZE, name.data(), name.size());
+    if (data_size > 0)
+    {
+        memcpy(message.data() + HEADER_SIZE + name.size(), data, data_size);
+    }
+    send(sock, message.data(), message.size(), 0);
+}
+
+/**
+ * Subscribe a raw socket to a variable.
+ *
+ * @param sock The socket.
+ * @param name Name of the variable.
+ * @param options Options of the subscription.
+ * @param size Number of bytes of the options to send, as a subscriber that
+ * knows fewer of them would.
+ */
+void send_interest(int sock, const std::string &name, const RawInterest &options = {}, size_t size = sizeof(RawInterest))
+{
+    send_raw(sock, MESSAGE_INTEREST, name, &options, size);
+}
+
+/**
+ * Receive a whole message from a raw socket.
+ *
+ * @param sock The socket.
+ * @return The message, or nothing if it did not arrive.
+ */
+std::vector<char> recv_frame(int sock)
+{
+    RawHeader header;
+    if (recv(sock, &header, HEADER_SIZE, MSG_WAITALL) != HEADER_SIZE)
+    {
+        return {};
+    }
+
+    std::vector<char> frame(HEADER_SIZE + header.name_size + header.data_size);
+    memcpy(frame.data(), &header, HEADER_SIZE);
+    if (recv(sock, frame.data() + HEADER_SIZE, frame.size() - HEADER_SIZE, MSG_WAITALL) != (ssize_t)frame.size() - HEADER_SIZE)
+    {
+        return {};
+    }
+    return frame;
+}
+
+/**
+ * Read the header of a message received from a raw socket.
+ *
+ * @param frame The message, as `recv_frame` returns it.
+ * @return The header.
+ */
+RawHeader header_of(const std::vector<char> &frame)
+{
+    RawHeader header = {};
+    memcpy(&header, frame.data(), std::min(frame.size(), (size_t)HEADER_SIZE));
+    return header;
+}
+
+/**
+ * Close a raw socket, and wait for the first instance to drop the queue to
+ * it, so that it no longer counts in `queue_stats`.
+ *
+ * @param dsml First instance of `dsml::State`.
+ * @param sock The socket.
+ */
+void close_raw(dsml::State &dsml, int sock)
+{
+    size_t queues = dsml.queue_stats().size();
+    close(sock);
+    eventually([&]
+    {
+        return dsml.queue_stats().size() < queues;
+    });
+}
+
 /**
  * Run simple tests.
  *
@@ -240,22 +457,1784 @@ void test_hard(dsml::State &dsml1, dsml::State &dsml2)
     test(dsml1.get<std::string>("TEST12") == "...", "set/get STRING request update");
 }
 
-int main()
+/**
+ * Run handle tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_handles(dsml::State &dsml1, dsml::State &dsml2)
 {
-    // Create first instance of `dsml::State`.
-    dsml::State dsml1("../test/config.tsv", "DSML1", 1111);
+    // Test `handle` with incorrect types.
+    try
+    {
+        dsml1.handle<std::string>("TEST3");
+        test(false, "handle incorrect type");
+    }
+    catch (...)
+    {
+        test(true, "handle incorrect type");
+    }
 
-    // Run simple tests.
-    std::cerr << "\nRUNNING SIMPLE TESTS..." << std::endl;
-    test_simple(dsml1);
+    auto int_handle1 = dsml1.handle<int32_t>("TEST3");
+    auto int_handle2 = dsml2.handle<int32_t>("TEST3");
+    auto array_handle1 = dsml1.handle<std::vector<int8_t>>("TEST11");
+    auto array_handle2 = dsml2.handle<std::vector<int8_t>>("TEST11");
+    auto string_handle1 = dsml1.handle<std::string>("TEST12");
+    auto string_handle2 = dsml2.handle<std::string>("TEST12");
 
-    // Create second instance of `dsml::State`.
-    dsml::State dsml2("../test/config.tsv", "DSML2", 1112);
-    dsml2.register_owner("DSML1", "127.0.0.1", 1111);
+    // Test `set` and `get` through handles.
+    dsml1.set(int_handle1, 33);
+    dsml1.set(array_handle1, {3, 3});
+    dsml1.set(string_handle1, "handle");
+    test(dsml1.get(int_handle1) == 33, "set/get INT32 handle");
+    test(dsml1.get(array_handle1) == std::vector<int8_t>{3, 3}, "set/get ARRAY handle");
+    test(dsml1.get(string_handle1) == "handle", "set/get STRING handle");
 
-    // Run hard tests.
-    std::cerr << "\nRUNNING HARD TESTS..." << std::endl;
-    test_hard(dsml1, dsml2);
+    // Test `get` through handles on the other instance.
+    test(eventually([&]
+    {
+        return dsml2.get(int_handle2) == 33;
+    }), "set/get INT32 handle remote");
+    test(eventually([&]
+    {
+        return dsml2.get(array_handle2) == std::vector<int8_t>{3, 3};
+    }), "set/get ARRAY handle remote");
+    test(eventually([&]
+    {
+        return dsml2.get(string_handle2) == "handle";
+    }), "set/get STRING handle remote");
+
+    // Test `wait_for` through handles. It only sees changes made after it
+    // starts, so keep making the change until it returns.
+    std::atomic<bool> done = false;
+    std::thread t([&]()
+    {
+        while (!done)
+        {
+            dsml1.set(int_handle1, 34);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+    test(dsml2.wait_for(int_handle2, std::chrono::seconds(5)) && dsml2.get(int_handle2) == 34, "wait_for handle");
+    done = true;
+    t.join();
+}
+
+/**
+ * Run lease tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_leases(dsml::State &dsml1, dsml::State &dsml2)
+{
+    dsml1.set("TEST11", std::vector<int8_t>{1, 2, 3});
+    eventually([&]
+    {
+        return dsml2.get<std::vector<int8_t>>("TEST11") == std::vector<int8_t>{1, 2, 3};
+    });
+
+    // Test that a lease sees the current data.
+    auto lease1 = dsml1.lease<int8_t>("TEST11");
+    auto lease2 = dsml2.lease<int8_t>("TEST11");
+    test(std::vector<int8_t>(lease1.begin(), lease1.end()) == std::vector<int8_t>{1, 2, 3}, "lease ARRAY");
+    test(std::vector<int8_t>(lease2.begin(), lease2.end()) == std::vector<int8_t>{1, 2, 3}, "lease ARRAY remote");
+
+    // Test that a lease is unaffected by later updates.
+    dsml1.set("TEST11", std::vector<int8_t>{4, 5});
+    bool updated = eventually([&]
+    {
+        return dsml2.lease<int8_t>("TEST11").size() == 2;
+    });
+    test(std::vector<int8_t>(lease1.begin(), lease1.end()) == std::vector<int8_t>{1, 2, 3}, "lease ARRAY after set");
+    test(std::vector<int8_t>(lease2.begin(), lease2.end()) == std::vector<int8_t>{1, 2, 3}, "lease ARRAY remote after set");
+    test(updated, "lease ARRAY new");
+
+    // Test `lease` with incorrect types.
+    try
+    {
+        dsml1.lease<int8_t>("TEST1");
+        test(false, "lease incorrect type");
+    }
+    catch (...)
+    {
+        test(true, "lease incorrect type");
+    }
+}
+
+/**
+ * Run buffer pool tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_buffer_pool(dsml::State &dsml1, dsml::State &dsml2)
+{
+    std::vector<int8_t> v(1000, 7);
+
+    // Test that updates of the same size reuse buffers.
+    dsml1.set("TEST11", v);
+    dsml::BufferStats before = dsml1.buffer_stats("TEST11");
+    for (int i = 0; i < 10; ++i)
+    {
+        dsml1.set("TEST11", v);
+    }
+    dsml::BufferStats after = dsml1.buffer_stats("TEST11");
+    test(after.allocations == before.allocations && after.reuses == before.reuses + 10, "buffer pool reuse");
+
+    // Test that a leased buffer is not reused.
+    auto lease = dsml1.lease<int8_t>("TEST11");
+    dsml1.set("TEST11", std::vector<int8_t>(1000, 8));
+    test(lease[0] == 7 && dsml1.get<std::vector<int8_t>>("TEST11")[0] == 8, "buffer pool leased");
+
+    // Test that received updates reuse buffers, once all of them have
+    // arrived.
+    auto arrived = [&]
+    {
+        std::vector<int8_t> value;
+        return dsml2.get_with_version("TEST11", value) == dsml1.get_with_version("TEST11", value);
+    };
+    eventually(arrived);
+    before = dsml2.buffer_stats("TEST11");
+    for (int i = 0; i < 10; ++i)
+    {
+        dsml1.set("TEST11", v);
+    }
+    eventually(arrived);
+    after = dsml2.buffer_stats("TEST11");
+    test(after.allocations <= before.allocations + 1 && after.reuses >= before.reuses + 9, "buffer pool reuse remote");
+}
+
+/**
+ * Run shared memory tests. Both instances are on the same host, so array
+ * updates between them go through shared memory.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_shm(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // Test an update that outgrows the current segment.
+    std::vector<int8_t> v(1 << 20);
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        v[i] = i % 127;
+    }
+    dsml1.set("TEST11", v);
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<int8_t>>("TEST11") == v;
+    }), "shm ARRAY large");
+
+    // Test a burst of updates, of which the last must arrive.
+    for (int8_t i = 0; i < 50; ++i)
+    {
+        dsml1.set("TEST11", std::vector<int8_t>{i, i});
+    }
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<int8_t>>("TEST11") == std::vector<int8_t>{49, 49};
+    }), "shm ARRAY burst");
+
+    // The version read along with a value is that of the value, even if it
+    // was read from the segment before the message about it arrived.
+    auto lease = dsml2.lease<int8_t>("TEST11");
+    test(std::vector<int8_t>(lease.begin(), lease.end()) == std::vector<int8_t>{49, 49} &&
+             lease.version() == dsml1.lease<int8_t>("TEST11").version(),
+         "shm ARRAY version");
+
+    // Only the owner may point a variable at a segment, so a request to
+    // read one is refused and the connection dropped.
+    int sock = connect_raw(0, std::chrono::seconds(2));
+    const std::string segment = "/dsml_test_bogus";
+    send_raw(sock, MESSAGE_REQUEST, "TEST11", segment.data(), segment.size(), ENCODING_SHM);
+    char c;
+    ssize_t n = recv(sock, &c, 1, 0);
+    bool dropped = n == 0 || (n < 0 && errno == ECONNRESET);
+    close(sock);
+    test(dropped && dsml1.get<std::vector<int8_t>>("TEST11") == std::vector<int8_t>{49, 49}, "shm refused from non-owner");
+}
+
+/**
+ * Run send queue tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_send_queues(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // Subscribe to TEST11 with a raw socket that never reads, so that the
+    // queue to it can only grow. Its interest message has only the shm flag,
+    // as those of subscribers from before the other options.
+    int sock = connect_raw(4096, std::chrono::seconds(5));
+    send_interest(sock, "TEST11", {}, 1);
+
+    // The value sent in reply shows that the subscription is in place.
+    char c;
+    recv(sock, &c, 1, MSG_PEEK);
+
+    // Updates must not wait for the stalled subscriber. If they did, they
+    // would not finish until the socket is closed.
+    std::vector<int8_t> v(256 * 1024);
+    std::atomic<bool> done = false;
+    std::thread setter([&]
+    {
+        for (int8_t i = 0; i < 40; ++i)
+        {
+            v[0] = i;
+            dsml1.set("TEST11", v);
+        }
+        done = true;
+    });
+    bool stalled = !eventually([&]
+    {
+        return done.load();
+    }, std::chrono::seconds(30));
+    if (stalled)
+    {
+        close(sock);
+    }
+    setter.join();
+    test(!stalled, "queues set() not stalled");
+
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<int8_t>>("TEST11") == v;
+    }), "queues other subscriber up to date");
+
+    std::vector<dsml::QueueStats> stats = dsml1.queue_stats();
+    bool backlog = std::any_of(stats.begin(), stats.end(), [](const dsml::QueueStats &q)
+    {
+        return q.messages > 0 && q.bytes > 0;
+    });
+    test(backlog, "queues backlog observable");
+
+    // The queue goes away with the subscriber.
+    close(sock);
+    test(eventually([&]
+    {
+        return dsml1.queue_stats().size() == stats.size() - 1;
+    }), "queues dropped on close");
+}
+
+/**
+ * Run conflation tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_conflation(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // Subscribe to TEST11 with a raw socket that asks for conflation and
+    // reads nothing until all updates have been made.
+    int sock = connect_raw(4096, std::chrono::seconds(2));
+    RawInterest options;
+    options.conflate = 1;
+    send_interest(sock, "TEST11", options);
+    char c;
+    recv(sock, &c, 1, MSG_PEEK);
+
+    std::vector<int8_t> v(256 * 1024);
+    for (int8_t i = 0; i < 40; ++i)
+    {
+        v[0] = i;
+        dsml1.set("TEST11", v);
+    }
+
+    // Only the queue to the raw socket is stalled.
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    getsockname(sock, (struct sockaddr *)&local, &local_len);
+    const std::string peer = "127.0.0.1:" + std::to_string(ntohs(local.sin_port));
+
+    std::vector<dsml::QueueStats> stats = dsml1.queue_stats();
+    bool bounded = std::any_of(stats.begin(), stats.end(), [&peer](const dsml::QueueStats &q)
+    {
+        return q.peer == peer && q.messages <= 2;
+    });
+    test(bounded, "conflation queue bounded");
+
+    // Read updates until the latest one, which must not have been dropped.
+    std::vector<char> frame(HEADER_SIZE + 6 + v.size());
+    int frames = 0;
+    bool latest = false;
+    while (!latest && recv(sock, frame.data(), frame.size(), MSG_WAITALL) == (ssize_t)frame.size())
+    {
+        ++frames;
+        latest = frame[HEADER_SIZE + 6] == 39;
+    }
+    test(latest, "conflation latest delivered");
+    test(frames < 40, "conflation updates replaced");
+
+    close_raw(dsml1, sock);
+
+    // An update must not be conflated into one queued ahead of a group with
+    // an older value of the same variable. The large TEST11 holds up the
+    // queue meanwhile, and TEST4 marks its end.
+    sock = connect_raw(4096, std::chrono::seconds(5));
+    for (const char *name : {"TEST11", "TEST1", "TEST3", "TEST4"})
+    {
+        send_interest(sock, name, options);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        recv_frame(sock);
+    }
+    v.assign(1 << 20, 0);
+    dsml1.set("TEST11", v);
+    dsml1.set("TEST3", 1);
+    dsml1.publish({{"TEST1", (int8_t)2}, {"TEST3", 2}});
+    dsml1.set("TEST3", 3);
+    dsml1.set("TEST4", (int64_t)4444);
+
+    int32_t value = 0;
+    uint64_t version = 0;
+    bool ordered = true;
+    bool marked = false;
+    while (!marked)
+    {
+        std::vector<char> frame = recv_frame(sock);
+        if (frame.empty())
+        {
+            break;
+        }
+        RawHeader header = header_of(frame);
+        const char *start = frame.data();
+        const char *end = frame.data() + frame.size();
+        if (header.kind == MESSAGE_GROUP)
+        {
+            start += HEADER_SIZE;
+        }
+        for (const char *p = start; p < end; p += HEADER_SIZE + header.name_size + header.data_size)
+        {
+            memcpy(&header, p, HEADER_SIZE);
+            std::string name(p + HEADER_SIZE, header.name_size);
+            if (name == "TEST3")
+            {
+                ordered = ordered && header.version >= version;
+                version = header.version;
+                memcpy(&value, p + HEADER_SIZE + header.name_size, sizeof(value));
+            }
+            marked = marked || name == "TEST4";
+        }
+    }
+    test(marked && ordered && value == 3, "conflation not ahead of group");
+
+    close_raw(dsml1, sock);
+
+    // Should updates still arrive out of order, the newer value is kept. A
+    // raw socket plays the owner here.
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1117);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    bind(server, (struct sockaddr *)&addr, sizeof(addr));
+    listen(server, 1);
+    {
+        dsml::State subscriber("../test/config.tsv", "DSML2");
+        subscriber.register_owner("DSML1", "127.0.0.1", 1117);
+        int owner = accept(server, nullptr, nullptr);
+        subscriber.subscribe("TEST3", {});
+        subscriber.subscribe("TEST4", {});
+        auto update = [owner](const std::string &name, auto value, uint64_t version)
+        {
+            RawHeader header = {MESSAGE_UPDATE, ENCODING_RAW, (uint16_t)name.size(), sizeof(value), version};
+            std::vector<char> message(HEADER_SIZE + name.size() + sizeof(value));
+            memcpy(message.data(), &header, HEADER_SIZE);
+            memcpy(message.data() + HEADER_SIZE, name.data(), name.size());
+            memcpy(message.data() + HEADER_SIZE + name.size(), &value, sizeof(value));
+            send(owner, message.data(), message.size(), 0);
+        };
+        update("TEST3", (int32_t)3, 3);
+        update("TEST3", (int32_t)2, 2);
+        update("TEST4", (int64_t)4, 1);
+        eventually([&]
+        {
+            return subscriber.get<int64_t>("TEST4") == 4;
+        });
+        int32_t kept = 0;
+        uint64_t kept_version = subscriber.get_with_version("TEST3", kept);
+        test(kept == 3 && kept_version == 3, "conflation older update dropped");
+        close(owner);
+    }
+    close(server);
+
+    // Subscribing with options works through the API as well.
+    dsml2.subscribe("TEST11", {true});
+    dsml1.set("TEST11", std::vector<int8_t>{1, 2, 3});
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<int8_t>>("TEST11") == std::vector<int8_t>{1, 2, 3};
+    }), "conflation subscribe");
+}
+
+/**
+ * Run publish tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_publish(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // Make sure that dsml2 is subscribed to all of the variables.
+    dsml2.get<int8_t>("TEST1");
+    dsml2.get<int32_t>("TEST3");
+    dsml2.get<std::vector<int8_t>>("TEST11");
+
+    // Whoever is woken by one variable of a group sees the others too.
+    for (int8_t i = 1; i <= 5; ++i)
+    {
+        bool woken = false;
+        int8_t test1 = 0;
+        int32_t test3;
+        std::vector<int8_t> test11;
+        uint64_t version = dsml2.get_with_version("TEST3", test3);
+        std::thread waiter([&]()
+        {
+            woken = dsml2.wait_newer_than("TEST3", version, std::chrono::seconds(5)) > version;
+            test1 = dsml2.get<int8_t>("TEST1");
+            test11 = dsml2.get<std::vector<int8_t>>("TEST11");
+        });
+
+        std::vector<int8_t> v(1000, i);
+        dsml1.publish({{"TEST1", i}, {"TEST3", (int32_t)i}, {"TEST11", v}});
+        waiter.join();
+
+        test(woken && test1 == i && test11 == v, "publish group " + std::to_string(i));
+    }
+
+    // Handles work as well.
+    auto test2 = dsml1.handle<int16_t>("TEST2");
+    dsml1.publish({{test2, 300}, {"TEST12", std::string("group")}});
+    test(eventually([&]
+    {
+        return dsml2.get<int16_t>("TEST2") == 300 && dsml2.get<std::string>("TEST12") == "group";
+    }), "publish handles");
+
+    bool thrown = false;
+    try
+    {
+        dsml1.publish({{"TEST1", (int8_t)1}, {"TEST1", (int8_t)2}});
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    test(thrown, "publish duplicate");
+
+    thrown = false;
+    try
+    {
+        dsml1.publish({{"TEST1", 1.0}});
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    test(thrown, "publish type");
+
+    thrown = false;
+    try
+    {
+        dsml2.publish({{"TEST1", (int8_t)1}});
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    test(thrown, "publish not owned");
+}
+
+/**
+ * Total number of bytes that a program has sent to its subscribers. Waits
+ * for its queues to empty first, since a send may only be counted after the
+ * subscriber has received it.
+ */
+uint64_t bytes_sent(dsml::State &dsml)
+{
+    eventually([&]
+    {
+        std::vector<dsml::QueueStats> stats = dsml.queue_stats();
+        return std::all_of(stats.begin(), stats.end(), [](const dsml::QueueStats &q)
+        {
+            return q.bytes == 0;
+        });
+    });
+    uint64_t sent = 0;
+    for (auto &q : dsml.queue_stats())
+    {
+        sent += q.sent;
+    }
+    return sent;
+}
+
+/**
+ * Run delta tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_delta(dsml::State &dsml1, dsml::State &dsml2)
+{
+    dsml::Subscription options;
+    options.delta = true;
+    dsml2.subscribe("TEST11", options);
+
+    std::vector<int8_t> v(1 << 20);
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        v[i] = i % 127;
+    }
+    dsml1.set("TEST11", v);
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<int8_t>>("TEST11") == v;
+    }), "delta ARRAY full");
+
+    // Changing a few elements only sends those.
+    uint64_t sent = bytes_sent(dsml1);
+    v[10] = -1;
+    v[500000] = -2;
+    dsml1.set("TEST11", v);
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<int8_t>>("TEST11") == v;
+    }), "delta ARRAY changed");
+    test(bytes_sent(dsml1) - sent < 1024, "delta ARRAY size");
+
+    // A leased value is left alone.
+    auto lease = dsml2.lease<int8_t>("TEST11");
+    v[20] = -3;
+    dsml1.set("TEST11", v);
+    test(eventually([&]
+    {
+        return lease[20] == 20 && dsml2.get<std::vector<int8_t>>("TEST11") == v;
+    }), "delta ARRAY leased");
+
+    // A different size is sent in full.
+    v.resize(1000);
+    dsml1.set("TEST11", v);
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<int8_t>>("TEST11") == v;
+    }), "delta ARRAY resized");
+
+    // Subscribe with a raw socket and ask for the value to be resent.
+    int sock = connect_raw(0, std::chrono::seconds(2));
+    RawInterest options_raw;
+    options_raw.delta = 1;
+    send_interest(sock, "TEST11", options_raw);
+
+    // A full update is a single run covering the value.
+    auto full_update = [&v](const std::vector<char> &frame)
+    {
+        return frame.size() == HEADER_SIZE + 6 + 24 + 8 + v.size() && header_of(frame).encoding == ENCODING_DELTA &&
+               std::vector<int8_t>(frame.begin() + HEADER_SIZE + 6 + 24 + 8, frame.end()) == v;
+    };
+    test(full_update(recv_frame(sock)), "delta full update");
+
+    send_raw(sock, MESSAGE_RESYNC, "TEST11");
+    test(full_update(recv_frame(sock)), "delta resync");
+
+    close_raw(dsml1, sock);
+}
+
+/**
+ * Run compression tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_compression(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // Subscribe with deltas, so that the updates go over the socket.
+    dsml::Subscription options;
+    options.delta = true;
+    dsml2.subscribe("TEST13", options);
+
+    std::vector<uint8_t> v(1 << 20);
+    for (size_t i = 0; i < v.size(); ++i)
+    {
+        v[i] = (i / 1000) % 7;
+    }
+    uint64_t sent = bytes_sent(dsml1);
+    dsml1.set("TEST13", v);
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<uint8_t>>("TEST13") == v;
+    }), "compression ARRAY");
+    test(bytes_sent(dsml1) - sent < v.size() / 8, "compression ARRAY size");
+
+    // Large changes are compressed too.
+    for (size_t i = 0; i < v.size() / 2; ++i)
+    {
+        v[i] = (i / 300) % 5;
+    }
+    dsml1.set("TEST13", v);
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<uint8_t>>("TEST13") == v;
+    }), "compression ARRAY changed");
+
+    // Data that does not compress is sent as it is.
+    uint32_t seed = 1;
+    for (auto &x : v)
+    {
+        seed = seed * 1103515245 + 12345;
+        x = seed >> 24;
+    }
+    dsml1.set("TEST13", v);
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<uint8_t>>("TEST13") == v;
+    }), "compression ARRAY random");
+
+    // Small values are not compressed.
+    v.assign(100, 3);
+    dsml1.set("TEST13", v);
+    test(eventually([&]
+    {
+        return dsml2.get<std::vector<uint8_t>>("TEST13") == v;
+    }), "compression ARRAY small");
+
+    // Subscribe with a raw socket that can decompress.
+    v.assign(1 << 16, 9);
+    dsml1.set("TEST13", v);
+    int sock = connect_raw(0, std::chrono::seconds(2));
+    RawInterest options_raw;
+    options_raw.compress = 1;
+    send_interest(sock, "TEST13", options_raw);
+
+    RawHeader header = header_of(recv_frame(sock));
+    test(header.encoding == ENCODING_LZ && header.data_size > 0 && header.data_size < v.size() / 8, "compression negotiated");
+
+    close_raw(dsml1, sock);
+}
+
+/**
+ * Run quantization tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ */
+void test_quantization(dsml::State &dsml1)
+{
+    std::vector<float> f(1000);
+    std::vector<double> d(100000), b(1000);
+    for (size_t i = 0; i < f.size(); ++i)
+    {
+        f[i] = std::sin(i * 0.01) * 100;
+    }
+    for (size_t i = 0; i < d.size(); ++i)
+    {
+        d[i] = std::sin(i * 0.001) * 10;
+    }
+    for (size_t i = 0; i < b.size(); ++i)
+    {
+        b[i] = std::exp(i * 0.01) - 5;
+    }
+    dsml1.set("TEST14", f);
+    dsml1.set("TEST15", d);
+    dsml1.set("TEST16", b);
+
+    // Subscribe with a raw socket that can decode quantized values.
+    int sock = connect_raw(0, std::chrono::seconds(2));
+    RawInterest options;
+    options.compress = 1;
+    options.quantize = 1;
+    std::vector<std::vector<char>> frames;
+    for (auto var : {"TEST14", "TEST15", "TEST16"})
+    {
+        send_interest(sock, var, options);
+        frames.push_back(recv_frame(sock));
+    }
+    test(frames[0].size() == HEADER_SIZE + 6 + 24 + 2 * f.size() && header_of(frames[0]).encoding == ENCODING_QUANTIZED,
+         "quantization f16 size");
+    test(frames[1].size() > 0 && frames[1].size() < HEADER_SIZE + 6 + 24 + 2 * d.size() + 16, "quantization i16 size");
+    test(frames[2].size() == HEADER_SIZE + 6 + 24 + 2 * b.size() && header_of(frames[2]).encoding == ENCODING_QUANTIZED,
+         "quantization bf16 size");
+
+    // Pass the updates on to another instance, which reconstructs the values.
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    dsml::State dsml3("../test/config.tsv", "DSML3");
+    dsml3.register_owner("DSML1", pair[0]);
+    for (auto var : {"TEST14", "TEST15", "TEST16"})
+    {
+        dsml3.subscribe(var, {});
+    }
+    for (auto &frame : frames)
+    {
+        send(pair[1], frame.data(), frame.size(), 0);
+    }
+
+    auto within = [](const auto &actual, const auto &expected, double relative, double absolute)
+    {
+        if (actual.size() != expected.size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < actual.size(); ++i)
+        {
+            if (std::abs(actual[i] - expected[i]) > std::abs(expected[i]) * relative + absolute)
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    test(eventually([&]
+    {
+        return within(dsml3.get<std::vector<float>>("TEST14"), f, 1.0 / 2048, 1e-7);
+    }), "quantization f16 values");
+    test(eventually([&]
+    {
+        return within(dsml3.get<std::vector<double>>("TEST15"), d, 0, 0.001 + 1e-12);
+    }), "quantization i16 values");
+    test(eventually([&]
+    {
+        return within(dsml3.get<std::vector<double>>("TEST16"), b, 1.0 / 256, 0);
+    }), "quantization bf16 values");
+
+    // Values beyond the range of the format are sent as they are.
+    f[0] = 1e6;
+    dsml1.set("TEST14", f);
+    std::vector<char> frame = recv_frame(sock);
+    test(frame.size() == HEADER_SIZE + 6 + 4 * f.size() && header_of(frame).encoding == ENCODING_RAW, "quantization out of range");
+
+    close_raw(dsml1, sock);
+    close(pair[1]);
+}
+
+/**
+ * Run io_uring tests, on instances of their own that ask for io_uring.
+ */
+void test_uring()
+{
+    dsml::State owner("../test/config.tsv", "DSML1", 1113, dsml::IO_URING);
+    dsml::State subscriber("../test/config.tsv", "DSML4", 0, dsml::IO_URING);
+    subscriber.register_owner("DSML1", "127.0.0.1", 1113);
+
+    // Kernels without io_uring fall back to the reactor, which the tests
+    // below then run against instead.
+    if (owner.io_backend() == dsml::IO_URING)
+    {
+        test(subscriber.io_backend() == dsml::IO_URING, "io_uring backend");
+    }
+    else
+    {
+        std::cerr << "io_uring not available, testing the fallback" << std::endl;
+    }
+
+    owner.set<int32_t>("TEST3", 7);
+    owner.set<std::string>("TEST12", "uring");
+    test(subscriber.get<int32_t>("TEST3") == 7, "io_uring INT32");
+    test(subscriber.get<std::string>("TEST12") == "uring", "io_uring STRING");
+
+    // A value spanning many receive buffers.
+    std::vector<int8_t> large(8 << 20);
+    for (size_t i = 0; i < large.size(); ++i)
+    {
+        large[i] = i * 7;
+    }
+    owner.set("TEST11", large);
+    test(subscriber.get<std::vector<int8_t>>("TEST11") == large, "io_uring ARRAY large");
+
+    // Many updates in a row arrive in order.
+    for (int32_t i = 1; i <= 1000; ++i)
+    {
+        owner.set<int32_t>("TEST3", i);
+    }
+    test(eventually([&]
+    {
+        return subscriber.get<int32_t>("TEST3") == 1000;
+    }), "io_uring burst");
+
+    owner.publish({{"TEST1", (int8_t)9}, {"TEST3", (int32_t)9}});
+    test(eventually([&]
+    {
+        return subscriber.get<int8_t>("TEST1") == 9 && subscriber.get<int32_t>("TEST3") == 9;
+    }), "io_uring publish group");
+}
+
+/**
+ * Run I/O thread tests, on instances of their own with several I/O
+ * threads each.
+ */
+void test_io_threads()
+{
+    dsml::State owner("../test/config.tsv", "DSML1", 1114, dsml::IO_REACTOR, 4);
+    std::vector<std::unique_ptr<dsml::State>> subscribers;
+    for (int i = 0; i < 6; ++i)
+    {
+        auto backend = i % 2 ? dsml::IO_URING : dsml::IO_REACTOR;
+        subscribers.push_back(std::make_unique<dsml::State>("../test/config.tsv", "DSML" + std::to_string(i + 5), 0, backend, 3));
+        subscribers.back()->register_owner("DSML1", "127.0.0.1", 1114);
+    }
+
+    // Every subscriber is served, whichever thread its connection is on.
+    std::vector<int8_t> large(4 << 20, 3);
+    owner.set<int32_t>("TEST3", 11);
+    owner.set("TEST11", large);
+    bool all = true;
+    for (auto &subscriber : subscribers)
+    {
+        all = all && subscriber->get<int32_t>("TEST3") == 11 && subscriber->get<std::vector<int8_t>>("TEST11") == large;
+    }
+    test(all, "io threads all subscribers");
+
+    // Updates sent from several threads at once all arrive.
+    std::vector<std::thread> setters;
+    for (int i = 0; i < 4; ++i)
+    {
+        setters.emplace_back([&owner, i]()
+        {
+            for (int j = 0; j < 100; ++j)
+            {
+                owner.set<int32_t>("TEST3", 1000 * (i + 1) + j);
+                owner.set<int64_t>("TEST4", j);
+            }
+        });
+    }
+    for (auto &setter : setters)
+    {
+        setter.join();
+    }
+    owner.set<int32_t>("TEST3", -1);
+    test(eventually([&]
+    {
+        return std::all_of(subscribers.begin(), subscribers.end(), [](const std::unique_ptr<dsml::State> &subscriber)
+        {
+            return subscriber->get<int32_t>("TEST3") == -1 && subscriber->get<int64_t>("TEST4") == 99;
+        });
+    }), "io threads concurrent updates");
+
+    // Closing some subscribers leaves the others connected.
+    subscribers.resize(3);
+    owner.set<int32_t>("TEST3", 12);
+    test(eventually([&]
+    {
+        return std::all_of(subscribers.begin(), subscribers.end(), [](const std::unique_ptr<dsml::State> &subscriber)
+        {
+            return subscriber->get<int32_t>("TEST3") == 12;
+        });
+    }), "io threads after close");
+}
+
+/**
+ * Run lock-free read tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_lock_free_reads(dsml::State &dsml1, dsml::State &dsml2)
+{
+    auto owned = dsml1.handle<uint32_t>("TEST7");
+    auto remote = dsml2.handle<uint32_t>("TEST7");
+    dsml1.set(owned, 0);
+    eventually([&]
+    {
+        return dsml2.get(remote) == 0;
+    });
+
+    // Readers polling as fast as they can only ever see values move forward.
+    std::atomic<bool> done = false, ordered = true;
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i)
+    {
+        readers.emplace_back([&, i]()
+        {
+            dsml::State &state = i % 2 ? dsml2 : dsml1;
+            auto &handle = i % 2 ? remote : owned;
+            uint32_t last = 0;
+            while (!done)
+            {
+                uint32_t value = state.get(handle);
+                if (value < last)
+                {
+                    ordered = false;
+                }
+                last = value;
+            }
+        });
+    }
+    for (uint32_t i = 1; i <= 20000; ++i)
+    {
+        dsml1.set(owned, i);
+    }
+    eventually([&]
+    {
+        return dsml2.get(remote) == 20000;
+    });
+    done = true;
+    for (auto &reader : readers)
+    {
+        reader.join();
+    }
+    test(ordered, "lock-free reads ordered");
+    test(dsml1.get(owned) == 20000 && dsml2.get(remote) == 20000, "lock-free reads latest");
+
+    // Once the owner is gone, reads fail again instead of returning a stale
+    // value.
+    auto owner = std::make_unique<dsml::State>("../test/config.tsv", "DSML1", 1115);
+    dsml::State subscriber("../test/config.tsv", "DSML2");
+    subscriber.register_owner("DSML1", "127.0.0.1", 1115);
+    owner->set<uint32_t>("TEST7", 5);
+    bool read = subscriber.get<uint32_t>("TEST7") == 5;
+    owner.reset();
+    bool thrown = eventually([&]
+    {
+        try
+        {
+            subscriber.get<uint32_t>("TEST7");
+        }
+        catch (const std::runtime_error &)
+        {
+            return true;
+        }
+        return false;
+    });
+    test(read && thrown, "lock-free reads owner gone");
+}
+
+/**
+ * Run schema tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_schema(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // The types come from the configuration file.
+    static_assert(std::is_same_v<decltype(dsml2.get(dsml::vars::TEST3)), int32_t>);
+    static_assert(std::is_same_v<decltype(dsml2.get(dsml::vars::TEST11)), std::vector<int8_t>>);
+    test(std::string(dsml::vars::TEST12.name) == "TEST12" && std::string(dsml::vars::TEST12.owner) == "DSML1", "schema names");
+
+    dsml1.set(dsml::vars::TEST3, 77);
+    dsml1.set(dsml::vars::TEST12, "schema");
+    test(eventually([&]
+    {
+        return dsml2.get(dsml::vars::TEST3) == 77;
+    }), "schema INT32");
+    test(eventually([&]
+    {
+        return dsml2.get(dsml::vars::TEST12) == "schema";
+    }), "schema STRING");
+    test(dsml2.get(dsml::vars::TEST3) == dsml2.get<int32_t>("TEST3"), "schema same as name");
+
+    dsml1.publish({{dsml::vars::TEST1, (int8_t)5}, {dsml::vars::TEST3, 78}});
+    test(eventually([&]
+    {
+        return dsml2.get(dsml::vars::TEST1) == 5 && dsml2.get(dsml::vars::TEST3) == 78;
+    }), "schema publish");
+
+    // Handles only work with the variables they were generated from.
+    std::ofstream("/tmp/dsml_schema_test.tsv") << "OTHER INT32 DSML1 false\nTEST3 INT64 DSML1 false\n";
+    dsml::State other("/tmp/dsml_schema_test.tsv", "DSML1");
+    bool thrown = false;
+    try
+    {
+        other.get(dsml::vars::TEST3);
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    test(thrown, "schema mismatch");
+    std::remove("/tmp/dsml_schema_test.tsv");
+}
+
+/**
+ * Struct with the layout of TEST17.
+ */
+struct Pose
+{
+    double x;
+    double y;
+    float heading;
+    int32_t id;
+};
+
+/**
+ * Run struct tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_structs(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // By name, with a struct of the program's own.
+    dsml1.set("TEST17", Pose{1.5, -2, 0.25f, 7});
+    eventually([&]
+    {
+        return dsml2.get<Pose>("TEST17").id == 7;
+    });
+    Pose pose = dsml2.get<Pose>("TEST17");
+    test(pose.x == 1.5 && pose.y == -2 && pose.heading == 0.25f && pose.id == 7, "struct set/get");
+
+    // Through the generated struct and handles.
+    static_assert(std::is_same_v<decltype(dsml2.get(dsml::vars::TEST19)), std::vector<dsml::vars::TEST19_t>>);
+    dsml1.set(dsml::vars::TEST18, {3, -4});
+    std::vector<dsml::vars::TEST19_t> colors = {{1, {255, 0, 0}}, {2, {0, 255, 0}}, {3, {0, 0, 255}}};
+    dsml1.set(dsml::vars::TEST19, colors);
+    eventually([&]
+    {
+        return dsml2.get(dsml::vars::TEST19).size() == 3;
+    });
+    dsml::vars::TEST18_t cell = dsml2.get(dsml::vars::TEST18);
+    test(cell.row == 3 && cell.col == -4, "struct schema");
+    std::vector<dsml::vars::TEST19_t> got = dsml2.get(dsml::vars::TEST19);
+    test(got.size() == 3 && got[2].id == 3 && got[2].rgb[2] == 255 && got[1].rgb[0] == 0, "struct array");
+
+    // A struct of up to 8 bytes is read without the lock once it has a value.
+    dsml1.publish({{dsml::vars::TEST18, {5, 6}}, {dsml::vars::TEST17, dsml::vars::TEST17_t{0, 0, 0, 8}}});
+    test(eventually([&]
+    {
+        cell = dsml2.get(dsml::vars::TEST18);
+        return cell.row == 5 && cell.col == 6 && dsml2.get<Pose>("TEST17").id == 8;
+    }), "struct publish");
+
+    // As it is after a delta update, which a struct may be sent as.
+    {
+        dsml::State subscriber("../test/config.tsv", "DSML2");
+        subscriber.register_owner("DSML1", "127.0.0.1", 1111);
+        dsml::Subscription delta;
+        delta.delta = true;
+        subscriber.subscribe("TEST18", delta);
+        eventually([&]
+        {
+            return subscriber.get(dsml::vars::TEST18).row == 5;
+        });
+        dsml1.set(dsml::vars::TEST18, {7, 8});
+        dsml::vars::TEST18_t locked;
+        eventually([&]
+        {
+            subscriber.get_with_version("TEST18", locked);
+            return locked.row == 7;
+        });
+        cell = subscriber.get(dsml::vars::TEST18);
+        test(locked.col == 8 && cell.row == 7 && cell.col == 8, "struct delta lock-free");
+    }
+
+    // The size of the struct must match.
+    bool thrown = false;
+    try
+    {
+        dsml2.handle<double>("TEST17");
+    }
+    catch (const std::runtime_error &)
+    {
+        thrown = true;
+    }
+    test(thrown, "struct incorrect type");
+
+    // A subscriber with a different layout gets no updates, but is told so.
+    auto subscribe = [](uint64_t layout)
+    {
+        int sock = connect_raw(0, std::chrono::seconds(5));
+        RawInterest options;
+        options.layout = layout;
+        send_interest(sock, "TEST17", options);
+
+        std::vector<char> frame = recv_frame(sock);
+        close(sock);
+        bool named = frame.size() > HEADER_SIZE && std::string(frame.data() + HEADER_SIZE, header_of(frame).name_size) == "TEST17";
+        return named ? header_of(frame).kind : MESSAGE_INTEREST;
+    };
+    test(subscribe(dsml::schema_fingerprint("STRUCT{x:DOUBLE,y:DOUBLE,heading:FLOAT,id:INT32}")) == MESSAGE_UPDATE, "struct same layout");
+    test(subscribe(dsml::schema_fingerprint("STRUCT{x:DOUBLE,y:DOUBLE,id:INT32,heading:FLOAT}")) == MESSAGE_REJECT, "struct different layout");
+
+    // So `get` fails instead of waiting for a value that never comes.
+    std::ofstream("/tmp/dsml_layout_test.tsv") << "TEST17 STRUCT{x:DOUBLE,y:DOUBLE,id:INT32,heading:FLOAT} DSML1 false\n";
+    {
+        dsml::State subscriber("/tmp/dsml_layout_test.tsv", "DSML2");
+        subscriber.register_owner("DSML1", "127.0.0.1", 1111);
+        std::future<Pose> future = subscriber.get_future(subscriber.handle<Pose>("TEST17"));
+        bool thrown = false;
+        if (future.wait_for(std::chrono::seconds(5)) == std::future_status::ready)
+        {
+            try
+            {
+                future.get();
+            }
+            catch (const std::runtime_error &)
+            {
+                thrown = true;
+            }
+        }
+        test(thrown, "struct different layout rejected");
+
+        // Later calls fail at once, if the first one did.
+        bool again = false;
+        try
+        {
+            if (thrown)
+            {
+                subscriber.get<Pose>("TEST17");
+            }
+        }
+        catch (const std::runtime_error &)
+        {
+            again = true;
+        }
+        test(again, "struct different layout get");
+    }
+    std::remove("/tmp/dsml_layout_test.tsv");
+}
+
+/**
+ * Run tensor tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_tensors(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // A contiguous tensor, leased without copying.
+    dsml::Tensor<float> t({2, 3});
+    for (int i = 0; i < 6; ++i)
+    {
+        t.data()[i] = i * 0.5f;
+    }
+    test(t.stride(0) == 3 * sizeof(float) && t.stride(1) == sizeof(float) && t.size() == 6 * sizeof(float), "tensor strides");
+    dsml1.set(dsml::vars::TEST20, t);
+    eventually([&]
+    {
+        return dsml2.get(dsml::vars::TEST20).size() == 6 * sizeof(float);
+    });
+    dsml::Lease<float> lease = dsml2.lease<float>("TEST20");
+    test(lease.rank() == 2 && lease.shape(0) == 2 && lease.shape(1) == 3 && lease[5] == 2.5f, "tensor lease");
+    test((uintptr_t)lease.data() % dsml::BUFFER_ALIGNMENT == 0, "tensor aligned");
+
+    // Rows padded to 64 bytes, along with another variable.
+    dsml::Tensor<float> padded({3, 2}, {64, sizeof(float)});
+    for (int r = 0; r < 3; ++r)
+    {
+        for (int c = 0; c < 2; ++c)
+        {
+            *(float *)((char *)padded.data() + r * 64 + c * sizeof(float)) = r * 10 + c;
+        }
+    }
+    dsml1.publish({{dsml::vars::TEST20, padded}, {dsml::vars::TEST1, (int8_t)9}});
+    eventually([&]
+    {
+        return dsml2.get(dsml::vars::TEST20).shape(0) == 3;
+    });
+    dsml::Tensor<float> copy = dsml2.get(dsml::vars::TEST20);
+    const char *bytes = (const char *)copy.data();
+    test(copy.rank() == 2 && copy.shape(0) == 3 && copy.stride(0) == 64 && copy.size() == 2 * 64 + 2 * sizeof(float) &&
+             *(const float *)(bytes + 2 * 64 + sizeof(float)) == 21,
+         "tensor padded rows");
+    test(lease[5] == 2.5f, "tensor lease unchanged");
+
+    // The elements must be of the declared type, in at most 4 dimensions.
+    int thrown = 0;
+    try
+    {
+        dsml2.handle<dsml::Tensor<double>>("TEST20");
+    }
+    catch (const std::runtime_error &)
+    {
+        ++thrown;
+    }
+    try
+    {
+        dsml::Tensor<float>({1, 2, 3, 4, 5});
+    }
+    catch (const std::runtime_error &)
+    {
+        ++thrown;
+    }
+    test(thrown == 2, "tensor incorrect type");
+}
+
+/**
+ * Run rate limit tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ */
+void test_rate_limits(dsml::State &dsml1)
+{
+    // Subscribe to TEST3 with a raw socket, with a rate limit, and return
+    // the values that it receives while `updates` updates are made, along
+    // with how long making them took.
+    std::chrono::steady_clock::duration elapsed;
+    auto receive = [&dsml1, &elapsed](uint32_t min_interval, uint32_t decimation, int32_t updates)
+    {
+        dsml1.set("TEST3", 0);
+        int sock = connect_raw(0, std::chrono::seconds(5));
+        RawInterest options;
+        options.min_interval = min_interval;
+        options.decimation = decimation;
+        send_interest(sock, "TEST3", options);
+
+        // The value sent in reply comes first, whatever the rate limit.
+        std::vector<int32_t> values;
+        char frame[HEADER_SIZE + 5 + sizeof(int32_t)];
+        auto read = [&]
+        {
+            if (recv(sock, frame, sizeof(frame), MSG_WAITALL) != (ssize_t)sizeof(frame))
+            {
+                return false;
+            }
+            int32_t value;
+            memcpy(&value, frame + HEADER_SIZE + 5, sizeof(value));
+            values.push_back(value);
+            return true;
+        };
+        read();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int32_t i = 1; i <= updates; ++i)
+        {
+            dsml1.set("TEST3", i);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+
+        // Read updates until the last one, which is never held back.
+        while ((values.empty() || values.back() != updates) && read())
+        {
+        }
+        close(sock);
+        return values;
+    };
+
+    std::vector<int32_t> values = receive(0, 0, 100);
+    test(values.size() == 101 && values.back() == 100, "rate limit none");
+
+    // At most one update per interval, besides the first and the last, however
+    // long the updates took to make.
+    values = receive(50000, 0, 100);
+    size_t intervals = elapsed / std::chrono::milliseconds(50);
+    test(values.size() > 2 && values.size() <= intervals + 3 && values.back() == 100, "rate limit interval");
+
+    values = receive(0, 10, 100);
+    test(values.size() > 5 && values.size() < 20 && values.back() == 100, "rate limit decimation");
+
+    // Through the API.
+    dsml::State subscriber("../test/config.tsv", "DSML2");
+    subscriber.register_owner("DSML1", "127.0.0.1", 1111);
+    dsml::Subscription options;
+    options.min_interval = std::chrono::milliseconds(50);
+    subscriber.subscribe("TEST3", options);
+    for (int32_t i = 1; i <= 20; ++i)
+    {
+        dsml1.set("TEST3", i);
+    }
+    test(eventually([&]
+    {
+        return subscriber.get<int32_t>("TEST3") == 20;
+    }), "rate limit latest sent");
+}
+
+/**
+ * Run deadband tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ */
+void test_deadband(dsml::State &dsml1)
+{
+    dsml1.set("TEST10", 1.0);
+    dsml1.set("TEST9", 100.0f);
+    std::vector<double> v(10, 0.0);
+    dsml1.set("TEST16", v);
+
+    dsml::State subscriber("../test/config.tsv", "DSML2");
+    subscriber.register_owner("DSML1", "127.0.0.1", 1111);
+    dsml::Subscription absolute;
+    absolute.deadband = 0.1;
+    subscriber.subscribe("TEST10", absolute);
+    subscriber.subscribe("TEST16", absolute);
+    dsml::Subscription relative;
+    relative.relative_deadband = 0.1;
+    subscriber.subscribe("TEST9", relative);
+
+    // Updates of TEST4, which has no deadband, come after whatever was sent
+    // before them.
+    int64_t marker = 1000;
+    subscriber.subscribe("TEST4", {});
+    auto sync = [&]
+    {
+        dsml1.set("TEST4", ++marker);
+        eventually([&]
+        {
+            return subscriber.get<int64_t>("TEST4") == marker;
+        });
+    };
+    sync();
+
+    // Small changes are not sent.
+    dsml1.set("TEST10", 1.05);
+    dsml1.set("TEST9", 105.0f);
+    v[2] = 0.05;
+    v[9] = -0.05;
+    dsml1.set("TEST16", v);
+    sync();
+    test(subscriber.get<double>("TEST10") == 1.0, "deadband absolute held");
+    test(subscriber.get<float>("TEST9") == 100.0f, "deadband relative held");
+    test(subscriber.get<std::vector<double>>("TEST16")[2] == 0, "deadband array held");
+
+    // Changes add up against the last value sent.
+    dsml1.set("TEST10", 1.15);
+    dsml1.set("TEST9", 111.0f);
+    v[9] = -0.2;
+    dsml1.set("TEST16", v);
+    sync();
+    test(subscriber.get<double>("TEST10") == 1.15, "deadband absolute sent");
+    test(subscriber.get<float>("TEST9") == 111.0f, "deadband relative sent");
+    std::vector<double> got = subscriber.get<std::vector<double>>("TEST16");
+    test(got[2] == 0.05 && got[9] == -0.2, "deadband array sent");
+
+    // A change of size is always sent.
+    v.push_back(0);
+    dsml1.set("TEST16", v);
+    test(eventually([&]
+    {
+        return subscriber.get<std::vector<double>>("TEST16").size() == 11;
+    }), "deadband size change");
+
+    // The value kept to compare with is a copy, which leaves the buffers of
+    // the owner free to be reused.
+    dsml::BufferStats before = dsml1.buffer_stats("TEST16");
+    for (int i = 1; i <= 10; ++i)
+    {
+        v[0] = i;
+        dsml1.set("TEST16", v);
+        sync();
+    }
+    dsml::BufferStats after = dsml1.buffer_stats("TEST16");
+    test(after.allocations == before.allocations && after.reuses == before.reuses + 10, "deadband buffers reused");
+}
+
+/**
+ * Run change handler tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ */
+void test_handlers(dsml::State &dsml1)
+{
+    dsml::State subscriber("../test/config.tsv", "DSML2", 0, dsml::IO_REACTOR, 1, 2);
+    subscriber.register_owner("DSML1", "127.0.0.1", 1111);
+
+    // The value that the owner sends on subscribing, and each change after
+    // it, calls the handler.
+    std::atomic<int> calls = 0;
+    std::atomic<int64_t> seen = 0;
+    dsml1.set("TEST4", (int64_t)40);
+    subscriber.on_change("TEST4", [&]
+    {
+        seen = subscriber.get<int64_t>("TEST4");
+        ++calls;
+    });
+    test(eventually([&]
+    {
+        return calls == 1 && seen == 40;
+    }), "handler called on subscribing");
+    dsml1.set("TEST4", (int64_t)41);
+    eventually([&]
+    {
+        return calls == 2;
+    });
+    dsml1.set("TEST4", (int64_t)42);
+    test(eventually([&]
+    {
+        return calls == 3 && seen == 42;
+    }), "handler called");
+
+    // Calls for a variable do not overlap, and a burst of changes shares
+    // the calls queued meanwhile.
+    calls = 0;
+    std::atomic<bool> running = false, overlapped = false;
+    subscriber.on_change("TEST4", [&]
+    {
+        overlapped = overlapped || running.exchange(true);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        seen = subscriber.get<int64_t>("TEST4");
+        running = false;
+        ++calls;
+    });
+    for (int64_t i = 1; i <= 20; ++i)
+    {
+        dsml1.set("TEST4", i);
+    }
+    bool settled = eventually([&]
+    {
+        return seen == 20 && subscriber.handler_stats("TEST4").calls == 3 + (uint64_t)calls;
+    });
+    dsml::HandlerStats stats = subscriber.handler_stats("TEST4");
+    test(!overlapped && calls < 20 && seen == 20, "handler serial and coalesced");
+    test(settled && stats.coalesced > 0, "handler stats counted");
+    test(stats.max_latency > std::chrono::nanoseconds(0) && stats.total_latency >= stats.max_latency, "handler stats latency");
+
+    // Handlers of owned variables are called on `set`, and one that throws
+    // does not stop the others.
+    std::atomic<int> owned_calls = 0;
+    subscriber.on_change("TEST3", [&]
+    {
+        throw std::runtime_error("Handler failed on purpose.");
+    });
+    dsml1.on_change("TEST2", [&]
+    {
+        ++owned_calls;
+    });
+    dsml1.set("TEST3", (int32_t)3);
+    dsml1.set("TEST2", (int16_t)2);
+    dsml1.set("TEST4", (int64_t)21);
+    test(eventually([&]
+    {
+        return owned_calls == 1 && seen == 21;
+    }), "handler of owned variable");
+
+    // A removed handler is no longer called.
+    calls = 0;
+    subscriber.on_change("TEST4", nullptr);
+    dsml1.on_change("TEST2", nullptr);
+    dsml1.set("TEST4", (int64_t)22);
+    dsml1.set("TEST2", (int16_t)3);
+    eventually([&]
+    {
+        return subscriber.get<int64_t>("TEST4") == 22;
+    });
+
+    // Nothing shows that a call did not happen, so give one the time to.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    test(calls == 0 && owned_calls == 1, "handler removed");
+}
+
+/**
+ * Coroutine that runs as soon as it is called and is not waited for.
+ */
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+Detached count_changes(dsml::State &state, int changes, std::atomic<int> &count)
+{
+    for (int i = 0; i < changes; ++i)
+    {
+        co_await state.changed("TEST4");
+        ++count;
+    }
+}
+
+Detached read_async(dsml::State &state, std::atomic<uint64_t> &value)
+{
+    value = co_await state.get_async<uint64_t>("TEST8");
+}
+
+/**
+ * Run async tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ */
+void test_async(dsml::State &dsml1)
+{
+    dsml::State subscriber("../test/config.tsv", "DSML2", 0, dsml::IO_REACTOR, 1, 1);
+    subscriber.register_owner("DSML1", "127.0.0.1", 1111);
+
+    // The first value has to come from the owner, later ones are there.
+    dsml1.set("TEST4", (int64_t)50);
+    std::future<int64_t> first = subscriber.get_future<int64_t>("TEST4");
+    test(first.wait_for(std::chrono::seconds(5)) == std::future_status::ready && first.get() == 50, "future first value");
+    std::future<int64_t> next = subscriber.get_future<int64_t>("TEST4");
+    test(next.wait_for(std::chrono::seconds(0)) == std::future_status::ready && next.get() == 50, "future value at once");
+
+    std::future<void> changed = subscriber.changed_future("TEST4");
+    bool early = changed.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    dsml1.set("TEST4", (int64_t)51);
+    test(!early && changed.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "future of change");
+
+    // A coroutine is resumed once the value arrives.
+    dsml1.set("TEST8", (uint64_t)80);
+    std::atomic<uint64_t> value = 0;
+    read_async(subscriber, value);
+    test(eventually([&]
+    {
+        return value == 80;
+    }), "coroutine first value");
+
+    // The single handler thread resumes every waiting coroutine.
+    std::atomic<int> count = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+        count_changes(subscriber, 2, count);
+    }
+    dsml1.set("TEST4", (int64_t)52);
+    bool after_one = eventually([&]
+    {
+        return count == 1000;
+    });
+    dsml1.set("TEST4", (int64_t)53);
+    test(after_one && eventually([&]
+    {
+        return count == 2000;
+    }), "coroutines resumed");
+}
+
+/**
+ * Run `wait_any` and `wait_all` tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_wait_many(dsml::State &dsml1, dsml::State &dsml2)
+{
+    dsml2.get<int8_t>("TEST1");
+    dsml2.get<int16_t>("TEST2");
+    dsml2.get(dsml::vars::TEST3);
+    std::vector<dsml::State::VarRef> vars = {"TEST1", "TEST2", dsml::vars::TEST3};
+
+    test(dsml2.wait_any(vars, std::chrono::milliseconds(50)).empty(), "wait_any timeout");
+
+    // A wait only sees the changes made after it starts, so keep making the
+    // change until it returns.
+    auto while_waiting = [](auto change, auto wait)
+    {
+        std::atomic<bool> done = false;
+        std::thread setter([&]
+        {
+            while (!done)
+            {
+                change();
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        });
+        auto result = wait();
+        done = true;
+        setter.join();
+        return result;
+    };
+
+    std::vector<size_t> changed = while_waiting([&]
+    {
+        dsml1.set("TEST2", (int16_t)20);
+    }, [&]
+    {
+        return dsml2.wait_any(vars, std::chrono::seconds(5));
+    });
+    test(changed == std::vector<size_t>{1}, "wait_any one changed");
+
+    // All of a group are seen together.
+    changed = while_waiting([&]
+    {
+        dsml1.publish({{"TEST1", (int8_t)10}, {dsml::vars::TEST3, (int32_t)30}});
+    }, [&]
+    {
+        return dsml2.wait_any(vars, std::chrono::seconds(5));
+    });
+    test(changed == std::vector<size_t>{0, 2}, "wait_any group");
+
+    bool all = while_waiting([&]
+    {
+        dsml1.set("TEST1", (int8_t)11);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        dsml1.set("TEST2", (int16_t)21);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        dsml1.set("TEST3", (int32_t)31);
+    }, [&]
+    {
+        return dsml2.wait_all(vars, std::chrono::seconds(5));
+    });
+    test(all && dsml2.get<int32_t>("TEST3") == 31, "wait_all");
+
+    // Some of them changing is not enough.
+    all = while_waiting([&]
+    {
+        dsml1.set("TEST1", (int8_t)12);
+    }, [&]
+    {
+        return dsml2.wait_all(vars, std::chrono::milliseconds(100));
+    });
+    test(!all, "wait_all timeout");
+}
+
+/**
+ * Run version tests.
+ *
+ * @param dsml1 First instance of `dsml::State`.
+ * @param dsml2 Second instance of `dsml::State`.
+ */
+void test_versions(dsml::State &dsml1, dsml::State &dsml2)
+{
+    // Both sides number a value the same.
+    uint8_t value;
+    dsml1.set("TEST5", (uint8_t)50);
+    uint64_t owned = dsml1.get_with_version("TEST5", value);
+    uint64_t version = dsml2.wait_newer_than("TEST5", owned - 1, std::chrono::seconds(5));
+    test(version == owned && dsml2.get_with_version("TEST5", value) == owned && value == 50, "version same on both sides");
+
+    // Updates made since a version was read are not waited for, and the gap
+    // shows how many were skipped.
+    dsml1.set("TEST5", (uint8_t)51);
+    dsml1.set("TEST5", (uint8_t)52);
+    eventually([&]
+    {
+        return dsml2.get<uint8_t>("TEST5") == 52;
+    });
+    version = dsml2.wait_newer_than(dsml::vars::TEST5, owned, std::chrono::seconds(0));
+    test(version == owned + 2, "version newer at once");
+    test(dsml2.wait_newer_than("TEST5", version, std::chrono::milliseconds(50)) == version, "version wait timeout");
+
+    std::thread setter([&dsml1]
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        dsml1.set("TEST5", (uint8_t)53);
+    });
+    version = dsml2.wait_newer_than("TEST5", version, std::chrono::seconds(5));
+    setter.join();
+    test(version == owned + 3 && dsml2.get<uint8_t>("TEST5") == 53, "version wait");
+
+    // Leases and the members of a group carry versions too.
+    dsml1.publish({{"TEST5", (uint8_t)54}, {"TEST11", std::vector<int8_t>{1, 2}}});
+    uint64_t array_version = dsml1.lease<int8_t>("TEST11").version();
+    eventually([&]
+    {
+        return dsml2.get_with_version("TEST5", value) == owned + 4;
+    });
+    test(dsml2.lease<int8_t>("TEST11").version() == array_version && dsml2.get_with_version("TEST5", value) == owned + 4,
+         "version of group and lease");
+
+    // A variable that its owner never set reads as zero, of version 0,
+    // rather than waiting for an update that may never come.
+    dsml::State owner("../test/config.tsv", "DSML1", 1116);
+    dsml::State subscriber("../test/config.tsv", "DSML2");
+    subscriber.register_owner("DSML1", "127.0.0.1", 1116);
+    std::atomic<bool> done = false;
+    int32_t never_set = -1;
+    uint64_t never_set_version = 1;
+    std::thread getter([&]
+    {
+        never_set_version = subscriber.get_with_version("TEST3", never_set);
+        done = true;
+    });
+    bool returned = eventually([&]
+    {
+        return done.load();
+    });
+    test(subscriber.wait_for("TEST4", std::chrono::seconds(5)), "version wait_for first value");
+
+    // Let a `get` that is stuck return.
+    owner.set("TEST3", 1);
+    getter.join();
+    test(returned && never_set == 0 && never_set_version == 0, "version get never set");
+}
+
+int main()
+{
+    // Create first instance of `dsml::State`.
+    dsml::State dsml1("../test/config.tsv", "DSML1", 1111);
+
+    // Run simple tests.
+    std::cerr << "\nRUNNING SIMPLE TESTS..." << std::endl;
+    test_simple(dsml1);
+
+    // Create second instance of `dsml::State`.
+    dsml::State dsml2("../test/config.tsv", "DSML2", 1112);
+    dsml2.register_owner("DSML1", "127.0.0.1", 1111);
+
+    // Run hard tests.
+    std::cerr << "\nRUNNING HARD TESTS..." << std::endl;
+    test_hard(dsml1, dsml2);
+
+    // Run handle tests.
+    std::cerr << "\nRUNNING HANDLE TESTS..." << std::endl;
+    test_handles(dsml1, dsml2);
+
+    // Run lease tests.
+    std::cerr << "\nRUNNING LEASE TESTS..." << std::endl;
+    test_leases(dsml1, dsml2);
+
+    // Run buffer pool tests.
+    std::cerr << "\nRUNNING BUFFER POOL TESTS..." << std::endl;
+    test_buffer_pool(dsml1, dsml2);
+
+    // Run shared memory tests.
+    std::cerr << "\nRUNNING SHARED MEMORY TESTS..." << std::endl;
+    test_shm(dsml1, dsml2);
+
+    // Run send queue tests.
+    std::cerr << "\nRUNNING SEND QUEUE TESTS..." << std::endl;
+    test_send_queues(dsml1, dsml2);
+
+    // Run conflation tests.
+    std::cerr << "\nRUNNING CONFLATION TESTS..." << std::endl;
+    test_conflation(dsml1, dsml2);
+
+    // Run publish tests.
+    std::cerr << "\nRUNNING PUBLISH TESTS..." << std::endl;
+    test_publish(dsml1, dsml2);
+
+    // Run delta tests.
+    std::cerr << "\nRUNNING DELTA TESTS..." << std::endl;
+    test_delta(dsml1, dsml2);
+
+    // Run compression tests.
+    std::cerr << "\nRUNNING COMPRESSION TESTS..." << std::endl;
+    test_compression(dsml1, dsml2);
+
+    // Run quantization tests.
+    std::cerr << "\nRUNNING QUANTIZATION TESTS..." << std::endl;
+    test_quantization(dsml1);
+
+    // Run io_uring tests.
+    std::cerr << "\nRUNNING IO_URING TESTS..." << std::endl;
+    test_uring();
+
+    // Run I/O thread tests.
+    std::cerr << "\nRUNNING IO THREAD TESTS..." << std::endl;
+    test_io_threads();
+
+    // Run lock-free read tests.
+    std::cerr << "\nRUNNING LOCK-FREE READ TESTS..." << std::endl;
+    test_lock_free_reads(dsml1, dsml2);
+
+    // Run schema tests.
+    std::cerr << "\nRUNNING SCHEMA TESTS..." << std::endl;
+    test_schema(dsml1, dsml2);
+
+    // Run struct tests.
+    std::cerr << "\nRUNNING STRUCT TESTS..." << std::endl;
+    test_structs(dsml1, dsml2);
+
+    // Run tensor tests.
+    std::cerr << "\nRUNNING TENSOR TESTS..." << std::endl;
+    test_tensors(dsml1, dsml2);
+
+    // Run rate limit tests.
+    std::cerr << "\nRUNNING RATE LIMIT TESTS..." << std::endl;
+    test_rate_limits(dsml1);
+
+    // Run deadband tests.
+    std::cerr << "\nRUNNING DEADBAND TESTS..." << std::endl;
+    test_deadband(dsml1);
+
+    // Run change handler tests.
+    std::cerr << "\nRUNNING CHANGE HANDLER TESTS..." << std::endl;
+    test_handlers(dsml1);
+
+    // Run async tests.
+    std::cerr << "\nRUNNING ASYNC TESTS..." << std::endl;
+    test_async(dsml1);
+
+    // Run wait_any/wait_all tests.
+    std::cerr << "\nRUNNING WAIT_ANY/WAIT_ALL TESTS..." << std::endl;
+    test_wait_many(dsml1, dsml2);
+
+    // Run version tests.
+    std::cerr << "\nRUNNING VERSION TESTS..." << std::endl;
+    test_versions(dsml1, dsml2);
 
     // Print results.
     const std::string msg = all_tests_passed ? "\nALL TESTS PASSED :)\n" : "\nSOME TESTS FAILED :(\n";